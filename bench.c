@@ -0,0 +1,223 @@
+// In-process micro-benchmarks of the lookup and read paths, no FUSE mount
+// involved. Every result is a JSON object on a line of its own.
+#define FUSE_USE_VERSION 26
+#define _GNU_SOURCE
+#define VFAT_BENCH
+#include <err.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "vfat.h"
+#include "cache.h"
+#include "dev.h"
+
+#define BENCH_READ_CHUNK    (128 * 1024)
+
+// A file or directory of the image
+struct bench_node {
+    char* path;
+    uint32_t first_cluster;
+    off_t size;
+};
+
+static struct bench_node* files;
+static size_t nfiles, files_cap;
+static struct bench_node* dirs;     // dirs[0] is the root
+static size_t ndirs, dirs_cap;
+static char* read_buf;
+static double min_seconds = 0.5;
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void add_node(struct bench_node** nodes, size_t* count, size_t* cap,
+                     char* path, const struct stat* st)
+{
+    if(*count == *cap) {
+        *cap = *cap ? *cap * 2 : 64;
+        *nodes = realloc(*nodes, *cap * sizeof(struct bench_node));
+        if(*nodes == NULL)
+            err(1, "realloc(nodes)");
+    }
+    (*nodes)[*count].path = path;
+    (*nodes)[*count].first_cluster = (uint32_t) st->st_ino;
+    (*nodes)[*count].size = st->st_size;
+    (*count)++;
+}
+
+// Records the files and subdirectories of the directory being listed.
+// Subdirectories are listed later, readdir is not reentrant.
+static int collect(void* data, const char* name, const struct stat* st, off_t offs)
+{
+    const char* dir = data;
+    char* path;
+
+    if(strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+        return 0;
+    if(asprintf(&path, "%s/%s", dir, name) < 0)
+        err(1, "asprintf");
+    if(S_ISDIR(st->st_mode))
+        add_node(&dirs, &ndirs, &dirs_cap, path, st);
+    else
+        add_node(&files, &nfiles, &files_cap, path, st);
+    return 0;
+}
+
+static int count_entries(void* data, const char* name, const struct stat* st, off_t offs)
+{
+    (*(uint64_t*) data)++;
+    return 0;
+}
+
+// One pass of each benchmark, returns the operations done and adds bytes moved
+static uint64_t pass_next_cluster(uint64_t* bytes)
+{
+    uint64_t ops = 0;
+    size_t i;
+    uint32_t c;
+
+    for(i = 0 ; i < nfiles ; i++) {
+        for(c = files[i].first_cluster ; c >= 2 && c < 0x0FFFFFF8 ; ops++)
+            c = vfat_next_cluster(c);
+    }
+    return ops;
+}
+
+static uint64_t pass_resolve(uint64_t* bytes)
+{
+    struct stat st;
+    size_t i;
+
+    for(i = 0 ; i < nfiles ; i++) {
+        if(vfat_resolve(files[i].path + 1, &st) != 0)
+            errx(1, "resolve %s failed", files[i].path);
+    }
+    return nfiles;
+}
+
+static uint64_t pass_readdir(uint64_t* bytes)
+{
+    uint64_t entries = 0;
+    size_t i;
+
+    for(i = 0 ; i < ndirs ; i++)
+        vfat_readdir(dirs[i].first_cluster, count_entries, &entries);
+    *bytes += entries * sizeof(struct fat32_direntry);
+    return ndirs;
+}
+
+static uint64_t pass_read(uint64_t* bytes)
+{
+    struct fuse_file_info fi;
+    size_t i;
+    off_t offs;
+    int ret;
+
+    for(i = 0 ; i < nfiles ; i++) {
+        memset(&fi, 0, sizeof(fi));
+        if(vfat_fuse_open(files[i].path, &fi) != 0)
+            errx(1, "open %s failed", files[i].path);
+        for(offs = 0 ; offs < files[i].size ; offs += ret) {
+            ret = vfat_fuse_read(files[i].path, read_buf, BENCH_READ_CHUNK, offs, &fi);
+            if(ret <= 0)
+                errx(1, "read %s at %lld failed", files[i].path, (long long) offs);
+            *bytes += ret;
+        }
+        vfat_fuse_release(files[i].path, &fi);
+    }
+    return nfiles;
+}
+
+// Repeats passes for at least min_seconds and prints the rates
+static void run(const char* name, uint64_t (*pass)(uint64_t*))
+{
+    uint64_t ops = 0, bytes = 0;
+    double start = now(), elapsed;
+
+    do {
+        ops += pass(&bytes);
+        elapsed = now() - start;
+    } while(elapsed < min_seconds);
+
+    printf("{\"bench\":\"%s\",\"ops\":%llu,\"seconds\":%.6f,\"ns_per_op\":%.1f,\"ops_per_sec\":%.0f,\"mb_per_sec\":%.1f}\n",
+           name, (unsigned long long) ops, elapsed, ops ? elapsed * 1e9 / ops : 0.0,
+           ops / elapsed, bytes / elapsed / (1024 * 1024));
+    fflush(stdout);
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: vfat_bench [-t seconds_per_bench] [-c cache_mb] [-C] [-b backend] image\n"
+                    "  -C  keep the FAT as runs, like -o fat=compact\n"
+                    "  -b  pread, mmap or direct, like -o backend=\n");
+    exit(1);
+}
+
+int main(int argc, char** argv)
+{
+    struct stat root;
+    size_t i;
+    int ch, saved, null;
+
+    vfat_info.cache_mb = VFAT_CACHE_DEFAULT_MB;
+    while((ch = getopt(argc, argv, "t:c:Cb:")) != -1) {
+        switch(ch) {
+        case 't': min_seconds = strtod(optarg, NULL); break;
+        case 'c': vfat_info.cache_mb = strtoul(optarg, NULL, 0); break;
+        case 'C': vfat_info.fat_compact = 1; break;
+        case 'b':
+            if(strcmp(optarg, "pread") == 0)
+                vfat_info.backend = VFAT_BACKEND_PREAD;
+            else if(strcmp(optarg, "mmap") == 0)
+                vfat_info.backend = VFAT_BACKEND_MMAP;
+            else if(strcmp(optarg, "direct") == 0)
+                vfat_info.backend = VFAT_BACKEND_DIRECT;
+            else
+                usage();
+            break;
+        default: usage();
+        }
+    }
+    if(optind != argc - 1)
+        usage();
+
+    // vfat_init() reports the geometry on stdout, keep it out of the results
+    fflush(stdout);
+    saved = dup(STDOUT_FILENO);
+    null = open("/dev/null", O_WRONLY);
+    if(saved < 0 || null < 0)
+        err(1, "redirect stdout");
+    dup2(null, STDOUT_FILENO);
+    vfat_bench_mount(argv[optind]);
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+    close(null);
+
+    read_buf = malloc(BENCH_READ_CHUNK);
+    if(read_buf == NULL)
+        err(1, "malloc");
+    root = vfat_info.root_inode;
+    add_node(&dirs, &ndirs, &dirs_cap, strdup(""), &root);
+    for(i = 0 ; i < ndirs ; i++)
+        vfat_readdir(dirs[i].first_cluster, collect, dirs[i].path);
+
+    printf("{\"image\":\"%s\",\"cluster_size\":%zu,\"clusters\":%zu,\"dirs\":%zu,\"files\":%zu,\"cache_mb\":%zu,\"fat\":\"%s\",\"backend\":\"%s\"}\n",
+           argv[optind], vfat_info.cluster_size, vfat_info.count_of_cluster, ndirs, nfiles,
+           vfat_info.cache_mb, vfat_info.fat_compact ? "compact" : "flat", vfat_dev_backend_name());
+    run("next_cluster", pass_next_cluster);
+    run("resolve", pass_resolve);
+    run("readdir", pass_readdir);
+    run("read", pass_read);
+    return 0;
+}
@@ -0,0 +1,424 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <err.h>
+
+#include "vfat.h"
+#include "extent.h"
+#include "cache.h"
+#include "dev.h"
+#include "fat.h"
+#include "stats.h"
+
+// Fixed number of cluster-sized slots carved out of one allocation.
+// Eviction uses the CLOCK algorithm: the hand skips (and clears) recently
+// referenced slots, so hot directory clusters survive a streaming scan.
+// Writes land in the slots and mark them dirty; they reach the device when
+// the slot is evicted or on vfat_cache_flush(). Directory clusters only go
+// out after the FAT, so an entry never names clusters the FAT has as free.
+struct cache_slot {
+    uint32_t cluster;       // 0 while the slot is empty
+    uint8_t  referenced;
+    uint8_t  dirty;
+    uint8_t  dir;           // written through vfat_cache_write_dir()
+    int32_t  hash_next;     // next slot in the same bucket, -1 ends the chain
+};
+
+static struct cache_slot* slots;
+static char*    slot_data;
+static size_t   nslots;
+static int32_t* buckets;
+static size_t   nbuckets;   // power of two
+static size_t   clock_hand;
+static size_t   ndirty;
+// Bumped when a slot is dropped, a reader that fetched the cluster from the
+// device before that must not cache what it read
+static unsigned long cache_gen;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Files with written data, by first cluster. A mark holds the write_seq of
+// the latest write to a file hashing to it; a file is dirty until a data
+// flush that started after its mark has finished. Files sharing a mark only
+// take the cache path more often than needed.
+static unsigned long file_marks[VFAT_CACHE_FILE_MARKS];
+static unsigned long write_seq;
+static unsigned long clean_seq;     // write_seq when the last clean flush started
+
+// Partial writes of uncached clusters read the rest of the cluster here
+static __thread char cache_fill_buf[VFAT_MAX_CLUSTER_SIZE];
+
+// Sizes the cache to the budget, 0 disables it
+void vfat_cache_init(size_t budget_bytes)
+{
+    size_t i;
+
+    nslots = budget_bytes / vfat_info.cluster_size;
+    if(nslots == 0)
+        return;
+
+    slots = calloc(nslots, sizeof(struct cache_slot));
+    slot_data = malloc(nslots * vfat_info.cluster_size);
+    nbuckets = 16;
+    while(nbuckets < nslots)
+        nbuckets *= 2;
+    buckets = malloc(nbuckets * sizeof(int32_t));
+    if(slots == NULL || slot_data == NULL || buckets == NULL)
+        err(1, "cluster cache of %lu bytes", budget_bytes);
+
+    for(i = 0 ; i < nbuckets ; i++)
+        buckets[i] = -1;
+    for(i = 0 ; i < nslots ; i++)
+        slots[i].hash_next = -1;
+}
+
+int vfat_cache_enabled(void)
+{
+    return nslots > 0;
+}
+
+static int32_t* cache_bucket(uint32_t cluster_num)
+{
+    return &buckets[(cluster_num * 2654435761u) & (nbuckets - 1)];
+}
+
+// Slot holding cluster_num or -1, called with cache_lock held
+static int32_t cache_find(uint32_t cluster_num)
+{
+    int32_t i;
+
+    for(i = *cache_bucket(cluster_num) ; i >= 0 ; i = slots[i].hash_next) {
+        if(slots[i].cluster == cluster_num)
+            return i;
+    }
+    return -1;
+}
+
+// Unhashes slot i, called with cache_lock held
+static void cache_drop(int32_t i)
+{
+    int32_t* pp = cache_bucket(slots[i].cluster);
+
+    while(*pp != i)
+        pp = &slots[*pp].hash_next;
+    *pp = slots[i].hash_next;
+    slots[i].hash_next = -1;
+    slots[i].cluster = 0;
+    slots[i].dir = 0;
+    if(slots[i].dirty) {
+        slots[i].dirty = 0;
+        __atomic_sub_fetch(&ndirty, 1, __ATOMIC_RELAXED);
+    }
+    cache_gen++;
+}
+
+/**
+ * Writes a dirty slot back to the device, called with cache_lock held
+ * @returns 0 on success, -1 if the write failed (the slot stays dirty then)
+ */
+static int cache_writeback(int32_t i)
+{
+    if(slots[i].dir && vfat_fat_flush() != 0)
+        return -1;
+    if(vfat_dev_write(slot_data + i * vfat_info.cluster_size, vfat_info.cluster_size,
+              vfat_cluster_offset(slots[i].cluster)) != vfat_info.cluster_size)
+        return -1;
+    vfat_count(VFAT_CNT_DEV_WRITES, 1);
+    vfat_count(VFAT_CNT_DEV_WRITE_BYTES, vfat_info.cluster_size);
+    slots[i].dirty = 0;
+    __atomic_sub_fetch(&ndirty, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+// Takes a slot for cluster_num, evicting the CLOCK victim. Called with
+// cache_lock held, the caller fills the slot data. A dirty victim that
+// cannot be written back is kept, -1 is returned then.
+static int32_t cache_claim(uint32_t cluster_num)
+{
+    int32_t i;
+    int32_t* head;
+
+    // advance the clock hand to the first slot not referenced since the last sweep
+    while(slots[clock_hand].referenced) {
+        slots[clock_hand].referenced = 0;
+        clock_hand = (clock_hand + 1) % nslots;
+    }
+    i = clock_hand;
+    clock_hand = (clock_hand + 1) % nslots;
+
+    if(slots[i].dirty && cache_writeback(i) != 0)
+        return -1;
+    if(slots[i].cluster != 0)
+        cache_drop(i);
+    slots[i].cluster = cluster_num;
+    slots[i].referenced = 1;
+    head = cache_bucket(cluster_num);
+    slots[i].hash_next = *head;
+    *head = i;
+    return i;
+}
+
+/**
+ * Fills buf with the whole cluster, from memory if cached
+ * @returns 0 on success, -1 if the device read or an eviction failed
+ */
+int vfat_cache_read_cluster(uint32_t cluster_num, char* buf)
+{
+    int32_t i;
+    unsigned long gen = 0;
+
+    if(nslots > 0) {
+        pthread_mutex_lock(&cache_lock);
+        i = cache_find(cluster_num);
+        if(i >= 0) {
+            slots[i].referenced = 1;
+            memcpy(buf, slot_data + i * vfat_info.cluster_size, vfat_info.cluster_size);
+            pthread_mutex_unlock(&cache_lock);
+            vfat_count(VFAT_CNT_CACHE_HITS, 1);
+            return 0;
+        }
+        gen = cache_gen;
+        pthread_mutex_unlock(&cache_lock);
+        vfat_count(VFAT_CNT_CACHE_MISSES, 1);
+    }
+
+    vfat_count(VFAT_CNT_DEV_READS, 1);
+    if(vfat_dev_read(buf, vfat_info.cluster_size, vfat_cluster_offset(cluster_num)) != vfat_info.cluster_size)
+        return -1;
+    vfat_count(VFAT_CNT_DEV_READ_BYTES, vfat_info.cluster_size);
+    if(nslots == 0)
+        return 0;
+
+    pthread_mutex_lock(&cache_lock);
+    if(gen == cache_gen && cache_find(cluster_num) < 0) {
+        i = cache_claim(cluster_num);
+        if(i < 0) {
+            pthread_mutex_unlock(&cache_lock);
+            return -1;
+        }
+        memcpy(slot_data + i * vfat_info.cluster_size, buf, vfat_info.cluster_size);
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return 0;
+}
+
+// Forgets a cached copy of the cluster, unwritten data included
+void vfat_cache_invalidate(uint32_t cluster_num)
+{
+    int32_t i;
+
+    if(nslots == 0)
+        return;
+    pthread_mutex_lock(&cache_lock);
+    i = cache_find(cluster_num);
+    if(i >= 0)
+        cache_drop(i);
+    pthread_mutex_unlock(&cache_lock);
+}
+
+// vfat_cache_write() and vfat_cache_write_dir()
+static int cache_write(uint32_t cluster_num, const char* data, size_t offs, size_t len, int dir)
+{
+    int32_t i;
+
+    if(nslots == 0) {
+        if(dir && vfat_fat_flush() != 0)
+            return -1;
+        vfat_count(VFAT_CNT_DEV_WRITES, 1);
+        vfat_count(VFAT_CNT_DEV_WRITE_BYTES, len);
+        return vfat_dev_write(data, len, vfat_cluster_offset(cluster_num) + offs) == len ? 0 : -1;
+    }
+
+    pthread_mutex_lock(&cache_lock);
+    while((i = cache_find(cluster_num)) < 0) {
+        if(len == vfat_info.cluster_size) {
+            i = cache_claim(cluster_num);
+            if(i < 0) {
+                pthread_mutex_unlock(&cache_lock);
+                return -1;
+            }
+            break;
+        }
+        // the rest of the cluster has to come from the device first
+        pthread_mutex_unlock(&cache_lock);
+        if(vfat_cache_read_cluster(cluster_num, cache_fill_buf) != 0)
+            return -1;
+        pthread_mutex_lock(&cache_lock);
+    }
+
+    memcpy(slot_data + i * vfat_info.cluster_size + offs, data, len);
+    slots[i].referenced = 1;
+    slots[i].dir = dir;
+    if(!slots[i].dirty) {
+        slots[i].dirty = 1;
+        __atomic_add_fetch(&ndirty, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return 0;
+}
+
+/**
+ * Writes len bytes at offs inside the cluster. The data stays in the cache
+ * until the slot is evicted or flushed; without a cache it goes straight out.
+ * @returns 0 on success, -1 if the device read or write or an eviction failed
+ */
+int vfat_cache_write(uint32_t cluster_num, const char* data, size_t offs, size_t len)
+{
+    return cache_write(cluster_num, data, offs, len, 0);
+}
+
+// vfat_cache_write() for directory clusters, they reach the device after the FAT
+int vfat_cache_write_dir(uint32_t cluster_num, const char* data, size_t offs, size_t len)
+{
+    return cache_write(cluster_num, data, offs, len, 1);
+}
+
+// Whether the cluster holds data that has not reached the device yet
+int vfat_cache_is_dirty(uint32_t cluster_num)
+{
+    int32_t i;
+    int ret;
+
+    if(nslots == 0)
+        return 0;
+    pthread_mutex_lock(&cache_lock);
+    i = cache_find(cluster_num);
+    ret = i >= 0 && slots[i].dirty;
+    pthread_mutex_unlock(&cache_lock);
+    return ret;
+}
+
+/**
+ * Relabels the cached copy of cluster from as cluster to, which then has
+ * to be written. Moves data that is still in memory without copying it.
+ * @returns 0 on success, -1 if from is not cached (nothing changed then)
+ */
+int vfat_cache_move(uint32_t from, uint32_t to)
+{
+    int32_t i, j;
+    int32_t* head;
+
+    if(nslots == 0)
+        return -1;
+    pthread_mutex_lock(&cache_lock);
+    i = cache_find(from);
+    if(i < 0) {
+        pthread_mutex_unlock(&cache_lock);
+        return -1;
+    }
+    j = cache_find(to);
+    if(j >= 0)
+        cache_drop(j);
+    // unhashed as clean, the slot is dirty again under its new cluster
+    if(!slots[i].dirty)
+        __atomic_add_fetch(&ndirty, 1, __ATOMIC_RELAXED);
+    slots[i].dirty = 0;
+    cache_drop(i);
+    slots[i].cluster = to;
+    slots[i].referenced = 1;
+    slots[i].dirty = 1;
+    head = cache_bucket(to);
+    slots[i].hash_next = *head;
+    *head = i;
+    pthread_mutex_unlock(&cache_lock);
+    return 0;
+}
+
+static int cmp_slot_cluster(const void* a, const void* b)
+{
+    uint32_t ca = slots[*(const int32_t*) a].cluster;
+    uint32_t cb = slots[*(const int32_t*) b].cluster;
+
+    return ca < cb ? -1 : ca > cb;
+}
+
+/**
+ * Writes every dirty cluster of file data (dirs == 0) or of directories
+ * back. Neighbouring clusters go out together in one pwritev, in ascending
+ * order.
+ * @returns 0 on success, -1 if a write failed
+ */
+int vfat_cache_flush(int dirs)
+{
+    int32_t* dirty;
+    struct iovec iov[IOV_MAX];
+    size_t count = 0, i, j, n;
+    unsigned long seq;
+    int ret = 0;
+
+    if(nslots == 0)
+        return 0;
+
+    pthread_mutex_lock(&cache_lock);
+    seq = write_seq;
+    dirty = malloc((ndirty + 1) * sizeof(int32_t));
+    if(dirty == NULL)
+        err(1, "malloc(dirty slots)");
+    for(i = 0 ; i < nslots ; i++) {
+        if(slots[i].dirty && !slots[i].dir == !dirs)
+            dirty[count++] = i;
+    }
+    qsort(dirty, count, sizeof(int32_t), cmp_slot_cluster);
+
+    for(i = 0 ; i < count ; i = j) {
+        for(j = i, n = 0 ; j < count && n < IOV_MAX ; j++, n++) {
+            if(j > i && slots[dirty[j]].cluster != slots[dirty[j - 1]].cluster + 1)
+                break;
+            iov[n].iov_base = slot_data + dirty[j] * vfat_info.cluster_size;
+            iov[n].iov_len = vfat_info.cluster_size;
+        }
+        if(vfat_dev_writev(iov, n, vfat_cluster_offset(slots[dirty[i]].cluster)) != (ssize_t)(n * vfat_info.cluster_size)) {
+            ret = -1;
+            continue;
+        }
+        vfat_count(VFAT_CNT_DEV_WRITES, 1);
+        vfat_count(VFAT_CNT_DEV_WRITE_BYTES, n * vfat_info.cluster_size);
+        for(n = i ; n < j ; n++)
+            slots[dirty[n]].dirty = 0;
+        __atomic_sub_fetch(&ndirty, j - i, __ATOMIC_RELAXED);
+    }
+    // every file written before the flush started is on the device now
+    if(ret == 0 && !dirs)
+        clean_seq = seq;
+    pthread_mutex_unlock(&cache_lock);
+    free(dirty);
+    return ret;
+}
+
+/**
+ * Records a write to the file starting at first_cluster. Writers mark the
+ * file before and after changing its clusters, so a flush in between cannot
+ * leave it marked clean.
+ */
+void vfat_cache_mark_file(uint32_t first_cluster)
+{
+    if(nslots == 0)
+        return;
+    pthread_mutex_lock(&cache_lock);
+    file_marks[first_cluster % VFAT_CACHE_FILE_MARKS] = ++write_seq;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+// Whether the file may have data that is only in the cache
+int vfat_cache_file_dirty(uint32_t first_cluster)
+{
+    int ret;
+
+    if(nslots == 0)
+        return 0;
+    pthread_mutex_lock(&cache_lock);
+    ret = file_marks[first_cluster % VFAT_CACHE_FILE_MARKS] > clean_seq;
+    pthread_mutex_unlock(&cache_lock);
+    return ret;
+}
+
+// Whether any written data is still only in the cache
+int vfat_cache_dirty(void)
+{
+    return __atomic_load_n(&ndirty, __ATOMIC_RELAXED) != 0;
+}
@@ -0,0 +1,28 @@
+#ifndef H_CACHE
+#define H_CACHE
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+// Default memory budget of the cluster cache, overridden by -o cache_mb=N
+#define VFAT_CACHE_DEFAULT_MB   32
+// Files up to this size are read through the cluster cache
+#define VFAT_CACHE_SMALL_FILE   (256 * 1024)
+// Slots of the per-file dirty marks, files are hashed by first cluster
+#define VFAT_CACHE_FILE_MARKS   1024
+
+void vfat_cache_init(size_t budget_bytes);
+int vfat_cache_enabled(void);
+int vfat_cache_read_cluster(uint32_t cluster_num, char* buf);
+void vfat_cache_invalidate(uint32_t cluster_num);
+int vfat_cache_write(uint32_t cluster_num, const char* data, size_t offs, size_t len);
+int vfat_cache_write_dir(uint32_t cluster_num, const char* data, size_t offs, size_t len);
+int vfat_cache_flush(int dirs);
+int vfat_cache_dirty(void);
+void vfat_cache_mark_file(uint32_t first_cluster);
+int vfat_cache_file_dirty(uint32_t first_cluster);
+int vfat_cache_is_dirty(uint32_t cluster_num);
+int vfat_cache_move(uint32_t from, uint32_t to);
+
+#endif
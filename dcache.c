@@ -0,0 +1,170 @@
+#include <sys/types.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <err.h>
+#include <pthread.h>
+
+#include "dcache.h"
+
+static struct vfat_dentry* dcache_hash[VFAT_DCACHE_BUCKETS];
+// lru_head is the most recently used entry, lru_tail the next victim
+static struct vfat_dentry* lru_head;
+static struct vfat_dentry* lru_tail;
+static size_t dcache_count;
+// Bumped by every change made through vfat_dcache_set(). Lookups that
+// started before a change must not insert what they found.
+static unsigned long dcache_gen;
+static pthread_mutex_t dcache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// FNV-1a over the parent cluster and the case-folded name
+static uint32_t dcache_hash_key(uint32_t parent, const char* name)
+{
+    uint32_t h = 2166136261u ^ parent;
+    h *= 16777619u;
+    while(*name) {
+        h ^= (uint8_t) tolower((unsigned char) *name++);
+        h *= 16777619u;
+    }
+    return h % VFAT_DCACHE_BUCKETS;
+}
+
+static void lru_unlink(struct vfat_dentry* d)
+{
+    if(d->lru_prev) d->lru_prev->lru_next = d->lru_next;
+    else lru_head = d->lru_next;
+    if(d->lru_next) d->lru_next->lru_prev = d->lru_prev;
+    else lru_tail = d->lru_prev;
+    d->lru_prev = d->lru_next = NULL;
+}
+
+static void lru_push_front(struct vfat_dentry* d)
+{
+    d->lru_prev = NULL;
+    d->lru_next = lru_head;
+    if(lru_head) lru_head->lru_prev = d;
+    lru_head = d;
+    if(lru_tail == NULL) lru_tail = d;
+}
+
+static struct vfat_dentry** dcache_find(uint32_t parent, const char* name)
+{
+    struct vfat_dentry** pp = &dcache_hash[dcache_hash_key(parent, name)];
+
+    for(; *pp != NULL ; pp = &(*pp)->hash_next) {
+        if((*pp)->parent == parent && strcasecmp((*pp)->name, name) == 0)
+            break;
+    }
+    return pp;
+}
+
+static void dcache_remove(struct vfat_dentry* d)
+{
+    struct vfat_dentry** pp = dcache_find(d->parent, d->name);
+
+    *pp = d->hash_next;
+    lru_unlink(d);
+    free(d->name);
+    free(d);
+    dcache_count--;
+}
+
+/**
+ * Looks up one path component
+ * @returns 0 and fills st on a hit, -ENOENT on a cached miss,
+ *          VFAT_DCACHE_MISS if the directory has to be read
+ */
+int vfat_dcache_lookup(uint32_t parent, const char* name, struct stat* st, struct vfat_dirent_loc* loc)
+{
+    struct vfat_dentry* d;
+    int ret;
+
+    pthread_mutex_lock(&dcache_lock);
+    d = *dcache_find(parent, name);
+    if(d == NULL) {
+        ret = VFAT_DCACHE_MISS;
+    } else {
+        lru_unlink(d);
+        lru_push_front(d);
+        if(d->negative) {
+            ret = -ENOENT;
+        } else {
+            *st = d->st;
+            if(loc != NULL)
+                *loc = d->loc;
+            ret = 0;
+        }
+    }
+    pthread_mutex_unlock(&dcache_lock);
+    return ret;
+}
+
+// Generation to hand to vfat_dcache_insert(), taken before the directory is read
+unsigned long vfat_dcache_generation(void)
+{
+    unsigned long gen;
+
+    pthread_mutex_lock(&dcache_lock);
+    gen = dcache_gen;
+    pthread_mutex_unlock(&dcache_lock);
+    return gen;
+}
+
+// Stores an entry, called with dcache_lock held
+static void dcache_store(uint32_t parent, const char* name, const struct stat* st,
+                         const struct vfat_dirent_loc* loc)
+{
+    struct vfat_dentry** pp;
+    struct vfat_dentry* d;
+
+    pp = dcache_find(parent, name);
+    d = *pp;
+    if(d == NULL) {
+        if(dcache_count >= VFAT_DCACHE_MAX) {
+            dcache_remove(lru_tail);
+            pp = dcache_find(parent, name);
+        }
+        d = calloc(1, sizeof(struct vfat_dentry));
+        if(d == NULL || (d->name = strdup(name)) == NULL)
+            err(1, "calloc(dentry)");
+        d->parent = parent;
+        *pp = d;
+        dcache_count++;
+    } else {
+        lru_unlink(d);
+    }
+
+    d->negative = (st == NULL);
+    if(st != NULL)
+        d->st = *st;
+    if(loc != NULL)
+        d->loc = *loc;
+    lru_push_front(d);
+}
+
+/**
+ * Remembers a resolved component; st == NULL caches that it does not exist
+ * @gen vfat_dcache_generation() from before the lookup, the result is
+ *      dropped if the directory changed meanwhile
+ */
+void vfat_dcache_insert(uint32_t parent, const char* name, const struct stat* st,
+                        const struct vfat_dirent_loc* loc, unsigned long gen)
+{
+    pthread_mutex_lock(&dcache_lock);
+    if(gen == dcache_gen)
+        dcache_store(parent, name, st, loc);
+    pthread_mutex_unlock(&dcache_lock);
+}
+
+// Records a change made to a directory, st == NULL if the name is gone
+void vfat_dcache_set(uint32_t parent, const char* name, const struct stat* st,
+                     const struct vfat_dirent_loc* loc)
+{
+    pthread_mutex_lock(&dcache_lock);
+    dcache_gen++;
+    dcache_store(parent, name, st, loc);
+    pthread_mutex_unlock(&dcache_lock);
+}
@@ -0,0 +1,34 @@
+#ifndef H_DCACHE
+#define H_DCACHE
+
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include "vfat.h"
+
+// Path component cache: (parent cluster, name) -> struct stat or ENOENT.
+// Names compare case-insensitively like on FAT, so every spelling of a
+// name shares one entry.
+struct vfat_dentry {
+    uint32_t    parent;
+    char*       name;
+    int         negative;       // cached ENOENT
+    struct stat st;
+    struct vfat_dirent_loc loc;
+    struct vfat_dentry* hash_next;
+    struct vfat_dentry* lru_prev;
+    struct vfat_dentry* lru_next;
+};
+
+#define VFAT_DCACHE_BUCKETS 4096
+#define VFAT_DCACHE_MAX     16384
+#define VFAT_DCACHE_MISS    1
+
+int vfat_dcache_lookup(uint32_t parent, const char* name, struct stat* st, struct vfat_dirent_loc* loc);
+unsigned long vfat_dcache_generation(void);
+void vfat_dcache_insert(uint32_t parent, const char* name, const struct stat* st,
+                        const struct vfat_dirent_loc* loc, unsigned long gen);
+void vfat_dcache_set(uint32_t parent, const char* name, const struct stat* st,
+                     const struct vfat_dirent_loc* loc);
+
+#endif
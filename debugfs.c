@@ -1,20 +1,72 @@
 #include <string.h>
 #include <stdio.h>
 #include <assert.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
 
 #include "vfat.h"
 #include "debugfs.h"
+#include "stats.h"
+#include "trace.h"
 
-#define DEBUGFS_MAX_FILE_LEN 1024
+#define DEBUGFS_MAX_FILE_LEN 32768
 
 #define NEXT_CLUSTER_PATH "/next_cluster"
+#define STATS_PATH "/stats"
+#define TRACE_PATH "/trace"
 
 #define CONSUME_PREFIX(str, prefix) (strncmp(str, prefix, strlen(prefix)) == 0 ? str += strlen(prefix) ,1: 0)
 
+// The trace is too big for one read, it is taken when the file is opened
+// and every read of that open file is served from the copy
+struct trace_snap {
+    size_t len;
+    char data[];
+};
+
+static int debugfs_read_trace(char *buf, size_t size, off_t offs, struct fuse_file_info *fi)
+{
+    const struct trace_snap* snap = fi ? (const struct trace_snap*)(uintptr_t) fi->fh : NULL;
+    int len = 0;
+
+    if (snap != NULL && offs < snap->len) {
+        len = snap->len - offs < size ? snap->len - offs : size;
+        memcpy(buf, snap->data + offs, len);
+    }
+    return len;
+}
+
+int debugfs_fuse_open(const char *path, struct fuse_file_info *fi)
+{
+    struct trace_snap* snap;
+    size_t cap;
+
+    fi->fh = 0;
+    if (strcmp(path, TRACE_PATH) != 0)
+        return 0;
+    cap = vfat_trace_max_len();
+    snap = malloc(sizeof(struct trace_snap) + cap);
+    if (snap == NULL)
+        return -ENOMEM;
+    snap->len = vfat_trace_json(snap->data, cap);
+    fi->fh = (uintptr_t) snap;
+    return 0;
+}
+
+int debugfs_fuse_release(const char *path, struct fuse_file_info *fi)
+{
+    free((void*)(uintptr_t) fi->fh);
+    fi->fh = 0;
+    return 0;
+}
+
 int debugfs_fuse_read(const char *path, char *buf, size_t size, off_t offs,
                       struct fuse_file_info *fi)
 {
     char tmpbuf[DEBUGFS_MAX_FILE_LEN];
+    if (strcmp(path, TRACE_PATH) == 0)
+        return debugfs_read_trace(buf, size, offs, fi);
     char* eof = tmpbuf;
     if (strcmp(path, "/bytes_per_sector")==0) {
         eof += sprintf(eof, "%d", (int) vfat_info.bytes_per_sector);
@@ -26,6 +78,12 @@ int debugfs_fuse_read(const char *path, char *buf, size_t size, off_t offs,
         eof += sprintf(eof, "%d", (int) vfat_info.fat_begin_offset);
     } else if (strcmp(path, "/fat_num_entries")==0) {
         eof += sprintf(eof, "%d", (int) vfat_info.fat_entries);
+    } else if (strcmp(path, STATS_PATH "/counters")==0) {
+        eof += vfat_stats_counters(eof, sizeof(tmpbuf));
+    } else if (strcmp(path, STATS_PATH "/latency")==0) {
+        eof += vfat_stats_latency(eof, sizeof(tmpbuf));
+    } else if (strcmp(path, STATS_PATH "/prometheus")==0) {
+        eof += vfat_stats_prometheus(eof, sizeof(tmpbuf));
     } else if (CONSUME_PREFIX(path, NEXT_CLUSTER_PATH "/")) {
       unsigned int i;
       if (sscanf(path, "%u", &i) == 1) {
@@ -40,7 +98,7 @@ int debugfs_fuse_read(const char *path, char *buf, size_t size, off_t offs,
     int len = (eof - tmpbuf) - offs;
     if (len < 0) return 0;
     
-    assert(len < 1024);
+    assert(len < DEBUGFS_MAX_FILE_LEN);
     if (len > size) {
       len = size;
     }
@@ -53,6 +111,12 @@ int debugfs_fuse_readdir(
       const char *path, void *callback_data,
       fuse_fill_dir_t callback, off_t unused_offs, struct fuse_file_info *unused_fi)
 {
+    if (strcmp(path, STATS_PATH) == 0) {
+        callback(callback_data, "counters", NULL, 0);
+        callback(callback_data, "latency", NULL, 0);
+        callback(callback_data, "prometheus", NULL, 0);
+        return 0;
+    }
     if (strcmp(path, "") != 0) return 0;
     char* listed_files[] = {
         "bytes_per_sector",
@@ -61,6 +125,8 @@ int debugfs_fuse_readdir(
         "fat_begin_offset",
         "fat_num_entries",
         "next_cluster", // directory
+        "stats", // directory
+        "trace",
         NULL,
     };
     char** name_ptr = listed_files;
@@ -80,15 +146,18 @@ int debugfs_fuse_getattr(const char *path, struct stat *st) {
     st->st_uid = vfat_info.mount_uid;
     st->st_gid = vfat_info.mount_gid;
     st->st_rdev = 0;
-    st->st_size = 5000; // Hey, we lie, but who cares? We anyway report EOF when reading.
+    st->st_size = DEBUGFS_MAX_FILE_LEN; // Hey, we lie, but who cares? We anyway report EOF when reading.
     st->st_blksize = 0; // Ignored by FUSE
     st->st_blocks = 1;
     st->st_mode = S_IRWXU | S_IRWXG | S_IRWXO;
     if (strcmp(path, "") == 0
-        || strcmp(path, NEXT_CLUSTER_PATH) == 0) {
+        || strcmp(path, NEXT_CLUSTER_PATH) == 0
+        || strcmp(path, STATS_PATH) == 0) {
         st->st_mode |= S_IFDIR; // Directory
     } else {
         st->st_mode |= S_IFREG; // File
     }
+    if (strcmp(path, TRACE_PATH) == 0)
+        st->st_size = vfat_trace_max_len();
     return 0; // You can stat anything, viva silent errors ;-)
 }
@@ -12,4 +12,8 @@ int debugfs_fuse_readdir(
 
 int debugfs_fuse_getattr(const char *path, struct stat *st);
 
+int debugfs_fuse_open(const char *path, struct fuse_file_info *fi);
+
+int debugfs_fuse_release(const char *path, struct fuse_file_info *fi);
+
 #endif
@@ -0,0 +1,281 @@
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <err.h>
+
+#include "vfat.h"
+#include "dev.h"
+
+// Every access to the image goes through here. pread is the plain path.
+// mmap maps the whole image once and reads are memcpy out of the page
+// cache, writes still use pwrite so the mapping can stay read-only. direct
+// opens with O_DIRECT and moves unaligned requests through an aligned
+// bounce buffer, nothing of the image is cached twice.
+
+static off_t dev_size;          // where the image ends
+static int dev_is_file;
+static const char* map;         // the whole image, mmap backend only
+
+// direct backend: per-thread aligned buffer, and writes are serialized so
+// two read-modify-writes of the same block cannot undo each other
+static __thread char* bounce;
+static __thread size_t bounce_len;
+static pthread_key_t bounce_key;
+static pthread_once_t bounce_key_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t direct_write_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char* const backend_names[] = {
+    [VFAT_BACKEND_PREAD]    = "pread",
+    [VFAT_BACKEND_MMAP]     = "mmap",
+    [VFAT_BACKEND_DIRECT]   = "direct",
+};
+
+static int dev_open_fd(const char* dev, int flags)
+{
+    int fd = open(dev, (vfat_info.read_only ? O_RDONLY : O_RDWR) | flags);
+
+    if(fd < 0 && !vfat_info.read_only && (errno == EROFS || errno == EACCES || errno == EPERM)) {
+        warnx("%s is write protected, mounting read-only", dev);
+        vfat_info.read_only = 1;
+        fd = open(dev, O_RDONLY | flags);
+    }
+    return fd;
+}
+
+/**
+ * Opens the image for the backend chosen with -o backend=, sets vfat_info.fd.
+ * A backend the image does not support falls back to pread.
+ */
+void vfat_dev_open(const char* dev)
+{
+    struct stat st;
+
+    if(vfat_info.backend == VFAT_BACKEND_DIRECT) {
+        vfat_info.fd = dev_open_fd(dev, O_DIRECT);
+        if(vfat_info.fd < 0 && errno == EINVAL) {
+            warnx("%s does not support O_DIRECT, using backend=pread", dev);
+            vfat_info.backend = VFAT_BACKEND_PREAD;
+        }
+    }
+    if(vfat_info.backend != VFAT_BACKEND_DIRECT)
+        vfat_info.fd = dev_open_fd(dev, 0);
+    if(vfat_info.fd < 0)
+        err(1, "open(%s)", dev);
+
+    if(fstat(vfat_info.fd, &st) != 0)
+        err(1, "fstat(%s)", dev);
+    // block devices report no size, their end does
+    dev_is_file = S_ISREG(st.st_mode);
+    dev_size = dev_is_file ? st.st_size : lseek(vfat_info.fd, 0, SEEK_END);
+
+    if(vfat_info.backend == VFAT_BACKEND_MMAP) {
+        map = dev_size > 0 ? mmap(NULL, dev_size, PROT_READ, MAP_SHARED, vfat_info.fd, 0) : MAP_FAILED;
+        if(map == MAP_FAILED) {
+            warn("mmap(%s), using backend=pread", dev);
+            map = NULL;
+            vfat_info.backend = VFAT_BACKEND_PREAD;
+        }
+    }
+}
+
+const char* vfat_dev_backend_name(void)
+{
+    return backend_names[vfat_info.backend];
+}
+
+// Bytes in the image, block devices included
+off_t vfat_dev_size(void)
+{
+    return dev_size;
+}
+
+// Whether the image is a regular file rather than a device
+int vfat_dev_is_file(void)
+{
+    return dev_is_file;
+}
+
+static void bounce_free(void* buf)
+{
+    free(buf);
+}
+
+static void bounce_key_create(void)
+{
+    if(pthread_key_create(&bounce_key, bounce_free) != 0)
+        err(1, "pthread_key_create(bounce)");
+}
+
+// The calling thread's bounce buffer, at least len bytes
+static char* bounce_get(size_t len)
+{
+    void* buf;
+
+    if(len <= bounce_len)
+        return bounce;
+    pthread_once(&bounce_key_once, bounce_key_create);
+    if(posix_memalign(&buf, VFAT_DIRECT_ALIGN, len) != 0)
+        return NULL;
+    free(bounce);
+    bounce = buf;
+    bounce_len = len;
+    pthread_setspecific(bounce_key, bounce);
+    return bounce;
+}
+
+static size_t iov_total(const struct iovec* iov, int niov)
+{
+    size_t len = 0;
+    int i;
+
+    for(i = 0 ; i < niov ; i++)
+        len += iov[i].iov_len;
+    return len;
+}
+
+// Reads the aligned blocks around [offs, offs + len) into the bounce buffer
+// @returns where offs landed in it, NULL on error; *got is what it holds from offs on
+static char* direct_read_span(size_t len, off_t offs, size_t* got)
+{
+    off_t start = offs & ~(off_t)(VFAT_DIRECT_ALIGN - 1);
+    size_t span = (offs + len - start + VFAT_DIRECT_ALIGN - 1) & ~(size_t)(VFAT_DIRECT_ALIGN - 1);
+    char* buf = bounce_get(span);
+    ssize_t ret;
+
+    if(buf == NULL)
+        return NULL;
+    ret = pread(vfat_info.fd, buf, span, start);
+    if(ret < 0)
+        return NULL;
+    // the device may end inside the span
+    *got = ret > offs - start ? ret - (offs - start) : 0;
+    if(*got > len)
+        *got = len;
+    return buf + (offs - start);
+}
+
+static int aligned(const void* buf, size_t len, off_t offs)
+{
+    return ((uintptr_t) buf | len | (size_t) offs) % VFAT_DIRECT_ALIGN == 0;
+}
+
+/**
+ * Reads from the image like pread()
+ * @returns bytes read, short at the end of the image, -1 on error
+ */
+ssize_t vfat_dev_read(void* buf, size_t len, off_t offs)
+{
+    struct iovec iov;
+
+    if(vfat_info.backend == VFAT_BACKEND_PREAD)
+        return pread(vfat_info.fd, buf, len, offs);
+    iov.iov_base = buf;
+    iov.iov_len = len;
+    return vfat_dev_readv(&iov, 1, offs);
+}
+
+/**
+ * Scattering read from the image like preadv()
+ * @returns bytes read, short at the end of the image, -1 on error
+ */
+ssize_t vfat_dev_readv(const struct iovec* iov, int niov, off_t offs)
+{
+    const char* src;
+    size_t len = iov_total(iov, niov), got, n, done = 0;
+    int i;
+
+    switch(vfat_info.backend) {
+    case VFAT_BACKEND_MMAP:
+        if(offs >= dev_size)
+            return 0;
+        got = len < (size_t)(dev_size - offs) ? len : (size_t)(dev_size - offs);
+        src = map + offs;
+        break;
+    case VFAT_BACKEND_DIRECT:
+        if(niov == 1 && aligned(iov[0].iov_base, len, offs))
+            return pread(vfat_info.fd, iov[0].iov_base, len, offs);
+        src = direct_read_span(len, offs, &got);
+        if(src == NULL)
+            return -1;
+        break;
+    default:
+        return preadv(vfat_info.fd, iov, niov, offs);
+    }
+
+    for(i = 0 ; i < niov && done < got ; i++) {
+        n = iov[i].iov_len < got - done ? iov[i].iov_len : got - done;
+        memcpy(iov[i].iov_base, src + done, n);
+        done += n;
+    }
+    return done;
+}
+
+/**
+ * Gathering write to the image like pwritev()
+ * @returns bytes written, -1 on error
+ */
+ssize_t vfat_dev_writev(const struct iovec* iov, int niov, off_t offs)
+{
+    size_t len, span, got, done = 0;
+    off_t start;
+    char* dst;
+    ssize_t ret;
+    int i;
+
+    if(vfat_info.backend != VFAT_BACKEND_DIRECT)
+        return pwritev(vfat_info.fd, iov, niov, offs);
+
+    len = iov_total(iov, niov);
+    if(niov == 1 && aligned(iov[0].iov_base, len, offs)) {
+        pthread_mutex_lock(&direct_write_lock);
+        ret = pwrite(vfat_info.fd, iov[0].iov_base, len, offs);
+        pthread_mutex_unlock(&direct_write_lock);
+        return ret;
+    }
+
+    // read-modify-write of the blocks the range touches
+    pthread_mutex_lock(&direct_write_lock);
+    start = offs & ~(off_t)(VFAT_DIRECT_ALIGN - 1);
+    dst = direct_read_span(len, offs, &got);
+    if(dst == NULL) {
+        pthread_mutex_unlock(&direct_write_lock);
+        return -1;
+    }
+    for(i = 0 ; i < niov ; i++) {
+        memcpy(dst + done, iov[i].iov_base, iov[i].iov_len);
+        done += iov[i].iov_len;
+    }
+    span = (offs + len - start + VFAT_DIRECT_ALIGN - 1) & ~(size_t)(VFAT_DIRECT_ALIGN - 1);
+    ret = pwrite(vfat_info.fd, bounce, span, start);
+    // an image file that does not end on a block boundary got padded
+    if(ret > 0 && dev_is_file && start + ret > dev_size && ftruncate(vfat_info.fd, dev_size) != 0)
+        ret = -1;
+    pthread_mutex_unlock(&direct_write_lock);
+    if(ret < 0)
+        return -1;
+    // only what reached the image past offs counts
+    ret -= offs - start;
+    return ret < 0 ? 0 : ret > (ssize_t) len ? (ssize_t) len : ret;
+}
+
+// Writes to the image like pwrite()
+ssize_t vfat_dev_write(const void* buf, size_t len, off_t offs)
+{
+    struct iovec iov;
+
+    if(vfat_info.backend != VFAT_BACKEND_DIRECT)
+        return pwrite(vfat_info.fd, buf, len, offs);
+    iov.iov_base = (void*) buf;
+    iov.iov_len = len;
+    return vfat_dev_writev(&iov, 1, offs);
+}
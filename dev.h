@@ -0,0 +1,27 @@
+#ifndef H_DEV
+#define H_DEV
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+// How the image is accessed (-o backend=...)
+enum vfat_backend {
+    VFAT_BACKEND_PREAD,     // pread/pwrite through the page cache, the default
+    VFAT_BACKEND_MMAP,      // reads copy out of a mapping of the whole image
+    VFAT_BACKEND_DIRECT,    // O_DIRECT, bypasses the page cache
+};
+
+// O_DIRECT transfers start and end on this boundary
+#define VFAT_DIRECT_ALIGN   4096
+
+void vfat_dev_open(const char* dev);
+ssize_t vfat_dev_read(void* buf, size_t len, off_t offs);
+ssize_t vfat_dev_readv(const struct iovec* iov, int niov, off_t offs);
+ssize_t vfat_dev_write(const void* buf, size_t len, off_t offs);
+ssize_t vfat_dev_writev(const struct iovec* iov, int niov, off_t offs);
+const char* vfat_dev_backend_name(void);
+off_t vfat_dev_size(void);
+int vfat_dev_is_file(void);
+
+#endif
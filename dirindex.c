@@ -0,0 +1,164 @@
+#include <sys/types.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <err.h>
+
+#include "vfat.h"
+#include "dirindex.h"
+#include "sidecar.h"
+
+static struct vfat_cached* dir_index_build(uint32_t cluster);
+static void dir_index_destroy(struct vfat_cached* obj);
+
+// Directories are looked up by their first cluster, a colliding slot is
+// replaced. An index built from a directory that changed meanwhile is used
+// once but not cached.
+static struct vfat_cached* dir_index_slots[VFAT_DIRINDEX_SLOTS];
+static struct vfat_refcache dir_index_cache =
+    VFAT_REFCACHE_INIT(dir_index_slots, dir_index_build, dir_index_destroy);
+
+// FNV-1a over the ASCII case-folded name, FAT names are case-insensitive
+static uint32_t dir_name_hash(const char* name)
+{
+    uint32_t h = 2166136261u;
+    while(*name) {
+        h ^= (uint8_t) tolower((unsigned char) *name++);
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void dir_index_destroy(struct vfat_cached* obj)
+{
+    struct vfat_dir_index* idx = (struct vfat_dir_index*) obj;
+    size_t i;
+
+    for(i = 0 ; i < idx->count ; i++)
+        free(idx->entries[i].name);
+    free(idx->entries);
+    free(idx->buckets);
+    free(idx);
+}
+
+// vfat_readdir_loc() callback collecting every entry of the directory
+static int dir_index_fill(void *data, const char *name, const struct stat *st,
+                          const struct vfat_dirent_loc *loc)
+{
+    struct vfat_dir_index* idx = data;
+    struct vfat_dir_name* e;
+
+    if(idx->count == idx->alloc) {
+        idx->alloc = idx->alloc ? idx->alloc * 2 : 32;
+        idx->entries = realloc(idx->entries, idx->alloc * sizeof(struct vfat_dir_name));
+        if(idx->entries == NULL)
+            err(1, "realloc(dir index)");
+    }
+    e = &idx->entries[idx->count++];
+    if((e->name = strdup(name)) == NULL)
+        err(1, "strdup");
+    e->hash = dir_name_hash(name);
+    e->st = *st;
+    e->loc = *loc;
+    return 0;
+}
+
+// Copies the entries the sidecar index has for the directory
+static int dir_index_from_sidecar(struct vfat_dir_index* idx, uint32_t cluster)
+{
+    const struct vfat_sidecar_entry* ents;
+    int count = vfat_sidecar_dir(cluster, &ents);
+    int i;
+
+    if(count < 0)
+        return -1;
+    idx->alloc = count ? count : 1;
+    idx->entries = malloc(idx->alloc * sizeof(struct vfat_dir_name));
+    if(idx->entries == NULL)
+        err(1, "malloc(dir index)");
+    for(i = 0 ; i < count ; i++) {
+        struct vfat_dir_name* e = &idx->entries[idx->count++];
+
+        if((e->name = strdup(vfat_sidecar_name(&ents[i]))) == NULL)
+            err(1, "strdup");
+        e->hash = ents[i].hash;
+        vfat_sidecar_stat(&ents[i], &e->st);
+        e->loc = ents[i].loc;
+    }
+    return 0;
+}
+
+static struct vfat_cached* dir_index_build(uint32_t cluster)
+{
+    struct vfat_dir_index* idx = calloc(1, sizeof(struct vfat_dir_index));
+    size_t i;
+
+    if(idx == NULL)
+        err(1, "calloc(dir index)");
+    if(dir_index_from_sidecar(idx, cluster) != 0)
+        vfat_readdir_loc(cluster, dir_index_fill, idx);
+
+    // keep the load factor at or below 1/2
+    idx->nbuckets = 16;
+    while(idx->nbuckets < idx->count * 2)
+        idx->nbuckets *= 2;
+    idx->buckets = malloc(idx->nbuckets * sizeof(int32_t));
+    if(idx->buckets == NULL)
+        err(1, "malloc(dir index buckets)");
+    memset(idx->buckets, 0xff, idx->nbuckets * sizeof(int32_t));
+
+    // insert in reverse so the first on-disk entry wins on duplicate names
+    for(i = idx->count ; i-- > 0 ;) {
+        int32_t* head = &idx->buckets[idx->entries[i].hash & (idx->nbuckets - 1)];
+        idx->entries[i].next = *head;
+        *head = i;
+    }
+    return &idx->cached;
+}
+
+// Name index of the directory starting at cluster, built by the first scan.
+// Release it with vfat_dir_index_put().
+struct vfat_dir_index* vfat_dir_index_get(uint32_t cluster)
+{
+    return (struct vfat_dir_index*) vfat_refcache_get(&dir_index_cache, cluster);
+}
+
+void vfat_dir_index_put(struct vfat_dir_index* idx)
+{
+    vfat_refcache_put(&dir_index_cache, &idx->cached);
+}
+
+// Forgets the index of a directory whose entries were changed
+void vfat_dir_index_invalidate(uint32_t cluster)
+{
+    vfat_sidecar_drop();
+    vfat_refcache_update(&dir_index_cache, cluster, NULL, NULL);
+}
+
+/**
+ * Case-insensitive lookup of a name inside a directory
+ * @loc gets where the entry is stored, may be NULL
+ * @returns 0 and fills st if found, -ENOENT otherwise
+ */
+int vfat_dir_index_lookup(uint32_t cluster, const char* name, struct stat* st, struct vfat_dirent_loc* loc)
+{
+    struct vfat_dir_index* idx = vfat_dir_index_get(cluster);
+    uint32_t hash = dir_name_hash(name);
+    int32_t i;
+    int ret = -ENOENT;
+
+    for(i = idx->buckets[hash & (idx->nbuckets - 1)] ; i >= 0 ; i = idx->entries[i].next) {
+        if(idx->entries[i].hash == hash && strcasecmp(idx->entries[i].name, name) == 0) {
+            *st = idx->entries[i].st;
+            if(loc != NULL)
+                *loc = idx->entries[i].loc;
+            ret = 0;
+            break;
+        }
+    }
+    vfat_dir_index_put(idx);
+    return ret;
+}
@@ -0,0 +1,36 @@
+#ifndef H_DIRINDEX
+#define H_DIRINDEX
+
+#include <stdint.h>
+#include <sys/stat.h>
+#include <fuse.h>
+
+#include "refcache.h"
+
+// One parsed directory entry
+struct vfat_dir_name {
+    char*       name;
+    uint32_t    hash;       // case-insensitive hash of name
+    int32_t     next;       // next entry in the same bucket, -1 ends the chain
+    struct stat st;
+    struct vfat_dirent_loc loc;
+};
+
+// All entries of one directory, hashed by case-folded name
+struct vfat_dir_index {
+    struct vfat_cached cached;      // keyed by the first cluster
+    size_t      count;
+    size_t      alloc;
+    struct vfat_dir_name* entries;  // in on-disk order
+    size_t      nbuckets;           // power of two
+    int32_t*    buckets;
+};
+
+#define VFAT_DIRINDEX_SLOTS 64
+
+struct vfat_dir_index* vfat_dir_index_get(uint32_t cluster);
+void vfat_dir_index_put(struct vfat_dir_index* idx);
+int vfat_dir_index_lookup(uint32_t cluster, const char* name, struct stat* st, struct vfat_dirent_loc* loc);
+void vfat_dir_index_invalidate(uint32_t cluster);
+
+#endif
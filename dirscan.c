@@ -0,0 +1,172 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "vfat.h"
+#include "dirscan.h"
+
+// Per-slot classification bits produced by the scanners below
+#define SLOT_FREE       1
+#define SLOT_DELETED    2
+#define SLOT_LFN        4
+#define SLOT_VOLUME     8
+
+// Collects a group of per-slot class masks (bit j = slot base + j) into the
+// per-class bitmaps
+static inline void put_bits(uint64_t* bm, size_t base, uint32_t bits)
+{
+    bm[base / 64] |= (uint64_t) bits << (base % 64);
+}
+
+static void dirscan_scalar(const uint8_t* p, size_t from, size_t nslots, uint64_t* free_bm, struct vfat_dirscan* scan)
+{
+    size_t i;
+
+    for(i = from ; i < nslots ; i++) {
+        uint8_t first = p[i * 32];
+        uint8_t attr = p[i * 32 + 11];
+
+        if(first == 0x00)
+            put_bits(free_bm, i, 1);
+        if(first == 0xE5)
+            put_bits(scan->deleted, i, 1);
+        if((attr & 0x3F) == VFAT_ATTR_LFN)
+            put_bits(scan->lfn, i, 1);
+        if(attr & ATTR_VOLUME_ID)
+            put_bits(scan->volume, i, 1);
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// SSE2: four slots per step. The first 16 bytes of each slot are transposed
+// so one vector holds byte 0..3 and another byte 8..11 of all four slots.
+static size_t dirscan_sse2(const uint8_t* p, size_t nslots, uint64_t* free_bm, struct vfat_dirscan* scan)
+{
+    const __m128i low = _mm_set1_epi32(0xFF);
+    const __m128i e5 = _mm_set1_epi32(0xE5);
+    const __m128i attr_mask = _mm_set1_epi32(0x3F);
+    const __m128i lfn = _mm_set1_epi32(VFAT_ATTR_LFN);
+    const __m128i vol = _mm_set1_epi32(ATTR_VOLUME_ID);
+    size_t i;
+
+    for(i = 0 ; i + 4 <= nslots ; i += 4) {
+        __m128i h0 = _mm_loadu_si128((const __m128i*)(p + (i + 0) * 32));
+        __m128i h1 = _mm_loadu_si128((const __m128i*)(p + (i + 1) * 32));
+        __m128i h2 = _mm_loadu_si128((const __m128i*)(p + (i + 2) * 32));
+        __m128i h3 = _mm_loadu_si128((const __m128i*)(p + (i + 3) * 32));
+        __m128i d0 = _mm_unpacklo_epi64(_mm_unpacklo_epi32(h0, h1), _mm_unpacklo_epi32(h2, h3));
+        __m128i d2 = _mm_unpacklo_epi64(_mm_unpackhi_epi32(h0, h1), _mm_unpackhi_epi32(h2, h3));
+        __m128i first = _mm_and_si128(d0, low);
+        __m128i attr = _mm_srli_epi32(d2, 24);
+
+        put_bits(free_bm, i, _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(first, _mm_setzero_si128()))));
+        put_bits(scan->deleted, i, _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(first, e5))));
+        put_bits(scan->lfn, i, _mm_movemask_ps(_mm_castsi128_ps(
+            _mm_cmpeq_epi32(_mm_and_si128(attr, attr_mask), lfn))));
+        put_bits(scan->volume, i, _mm_movemask_ps(_mm_castsi128_ps(
+            _mm_cmpeq_epi32(_mm_and_si128(attr, vol), vol))));
+    }
+    return i;
+}
+
+// AVX2: eight slots per step, byte 0..3 and 8..11 of each slot are gathered
+__attribute__((target("avx2")))
+static size_t dirscan_avx2(const uint8_t* p, size_t nslots, uint64_t* free_bm, struct vfat_dirscan* scan)
+{
+    const __m256i idx = _mm256_setr_epi32(0, 32, 64, 96, 128, 160, 192, 224);
+    const __m256i low = _mm256_set1_epi32(0xFF);
+    const __m256i e5 = _mm256_set1_epi32(0xE5);
+    const __m256i attr_mask = _mm256_set1_epi32(0x3F);
+    const __m256i lfn = _mm256_set1_epi32(VFAT_ATTR_LFN);
+    const __m256i vol = _mm256_set1_epi32(ATTR_VOLUME_ID);
+    size_t i;
+
+    for(i = 0 ; i + 8 <= nslots ; i += 8) {
+        const int* base = (const int*)(p + i * 32);
+        __m256i first = _mm256_and_si256(_mm256_i32gather_epi32(base, idx, 1), low);
+        __m256i attr = _mm256_srli_epi32(_mm256_i32gather_epi32(base + 2, idx, 1), 24);
+
+        put_bits(free_bm, i, _mm256_movemask_ps(_mm256_castsi256_ps(
+            _mm256_cmpeq_epi32(first, _mm256_setzero_si256()))));
+        put_bits(scan->deleted, i, _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(first, e5))));
+        put_bits(scan->lfn, i, _mm256_movemask_ps(_mm256_castsi256_ps(
+            _mm256_cmpeq_epi32(_mm256_and_si256(attr, attr_mask), lfn))));
+        put_bits(scan->volume, i, _mm256_movemask_ps(_mm256_castsi256_ps(
+            _mm256_cmpeq_epi32(_mm256_and_si256(attr, vol), vol))));
+    }
+    return i;
+}
+#endif
+
+/**
+ * Classifies all slots of a directory cluster at once and finds the 0x00
+ * slot that ends the directory
+ * @nslots cluster_size / 32
+ */
+void vfat_dirscan(const char* cluster_buf, size_t nslots, struct vfat_dirscan* scan)
+{
+    const uint8_t* p = (const uint8_t*) cluster_buf;
+    uint64_t free_bm[VFAT_DIRSCAN_WORDS];
+    size_t words = (nslots + 63) / 64;
+    size_t done = 0, w;
+
+    memset(free_bm, 0, sizeof(free_bm));
+    memset(scan, 0, sizeof(struct vfat_dirscan));
+
+#if defined(__x86_64__) || defined(__i386__)
+    if(__builtin_cpu_supports("avx2"))
+        done = dirscan_avx2(p, nslots, free_bm, scan);
+    else
+        done = dirscan_sse2(p, nslots, free_bm, scan);
+#endif
+    dirscan_scalar(p, done, nslots, free_bm, scan);
+
+    // Everything from the first free slot on is not part of the directory
+    scan->nslots = nslots;
+    for(w = 0 ; w < words ; w++) {
+        if(free_bm[w]) {
+            scan->nslots = w * 64 + __builtin_ctzll(free_bm[w]);
+            scan->end = 1;
+            break;
+        }
+    }
+
+    for(w = 0 ; w < words ; w++) {
+        uint64_t valid;
+
+        if(w * 64 >= scan->nslots)
+            valid = 0;
+        else if(scan->nslots - w * 64 >= 64)
+            valid = ~0ULL;
+        else
+            valid = (1ULL << (scan->nslots - w * 64)) - 1;
+
+        // deleted beats everything, an LFN attr beats the volume bit it contains
+        scan->deleted[w] &= valid;
+        scan->lfn[w] &= valid & ~scan->deleted[w];
+        scan->volume[w] &= valid & ~scan->deleted[w] & ~scan->lfn[w];
+        scan->live[w] = valid & ~(scan->deleted[w] | scan->lfn[w] | scan->volume[w]);
+    }
+}
+
+// Whether any bit in [from, to) of the mask is set
+int vfat_dirscan_any(const uint64_t* mask, size_t from, size_t to)
+{
+    while(from < to) {
+        size_t w = from / 64;
+        size_t bit = from % 64;
+        size_t n = 64 - bit;
+        uint64_t m;
+
+        if(n > to - from)
+            n = to - from;
+        m = (n == 64) ? ~0ULL : ((1ULL << n) - 1) << bit;
+        if(mask[w] & m)
+            return 1;
+        from += n;
+    }
+    return 0;
+}
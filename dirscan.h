@@ -0,0 +1,26 @@
+#ifndef H_DIRSCAN
+#define H_DIRSCAN
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "vfat.h"
+
+#define VFAT_DIRSCAN_WORDS  (VFAT_MAX_CLUSTER_SIZE / 32 / 64)
+
+// Classification of every 32-byte slot of one directory cluster, bit i of a
+// mask stands for slot i. Slots at or after the terminating 0x00 slot are
+// in none of the masks.
+struct vfat_dirscan {
+    size_t   nslots;        // slots before the terminating slot, or all of them
+    int      end;           // the directory ends inside this cluster
+    uint64_t deleted[VFAT_DIRSCAN_WORDS];   // 0xE5
+    uint64_t lfn[VFAT_DIRSCAN_WORDS];       // attr 0x0F
+    uint64_t volume[VFAT_DIRSCAN_WORDS];    // volume ID
+    uint64_t live[VFAT_DIRSCAN_WORDS];      // short entries
+};
+
+void vfat_dirscan(const char* cluster_buf, size_t nslots, struct vfat_dirscan* scan);
+int vfat_dirscan_any(const uint64_t* mask, size_t from, size_t to);
+
+#endif
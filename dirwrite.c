@@ -0,0 +1,485 @@
+#include <sys/types.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <endian.h>
+#include <errno.h>
+#include <err.h>
+
+#include "vfat.h"
+#include "extent.h"
+#include "cache.h"
+#include "fat.h"
+#include "dirwrite.h"
+
+// Scratch cluster for directory scans, one per thread like the readdir pipeline
+static __thread char dirw_cluster_buf[VFAT_MAX_CLUSTER_SIZE];
+
+static uint32_t slots_per_cluster(void)
+{
+    return vfat_info.cluster_size / 32;
+}
+
+// Disk cluster holding the given slot of a directory, 0 past its end
+static uint32_t dir_slot_cluster(uint32_t dir, uint32_t slot)
+{
+    struct vfat_extent_map* map = vfat_extent_map_get(dir);
+    const struct vfat_extent* ext = vfat_extent_find(map, slot / slots_per_cluster());
+    uint32_t cluster = 0;
+
+    if(ext != NULL)
+        cluster = ext->disk_cluster + (slot / slots_per_cluster() - ext->file_cluster);
+    vfat_extent_map_put(map);
+    return cluster;
+}
+
+/**
+ * Reads / writes one 32-byte slot of a directory through the cluster cache
+ * @returns 0 on success, -EIO otherwise
+ */
+int vfat_dirent_read(uint32_t dir, uint32_t slot, struct fat32_direntry* e)
+{
+    uint32_t cluster = dir_slot_cluster(dir, slot);
+
+    if(cluster == 0 || vfat_cache_read_cluster(cluster, dirw_cluster_buf) != 0)
+        return -EIO;
+    memcpy(e, dirw_cluster_buf + (slot % slots_per_cluster()) * 32, 32);
+    return 0;
+}
+
+int vfat_dirent_write(uint32_t dir, uint32_t slot, const struct fat32_direntry* e)
+{
+    uint32_t cluster = dir_slot_cluster(dir, slot);
+
+    if(cluster == 0 || vfat_cache_write_dir(cluster, (const char*) e, (slot % slots_per_cluster()) * 32, 32) != 0)
+        return -EIO;
+    return 0;
+}
+
+void vfat_dirent_set_cluster(struct fat32_direntry* e, uint32_t cluster)
+{
+    e->cluster_hi = htole16(cluster >> 16);
+    e->cluster_lo = htole16(cluster & 0xFFFF);
+}
+
+// A fresh short entry without a name, all three times set to now
+void vfat_dirent_init(struct fat32_direntry* e, uint8_t attr, uint32_t cluster, time_t now)
+{
+    uint16_t date, time;
+
+    memset(e, 0, sizeof(struct fat32_direntry));
+    e->attr = attr;
+    vfat_dirent_set_cluster(e, cluster);
+    pack_time(now, &date, &time);
+    e->ctime_date = e->mtime_date = e->atime_date = htole16(date);
+    e->ctime_time = e->mtime_time = htole16(time);
+}
+
+// Characters a short name may hold besides upper case letters and digits
+static int short_char_ok(uint8_t c)
+{
+    return isupper(c) || isdigit(c) || (c != 0 && strchr("!#$%&'()-@^_`{}~", c) != NULL);
+}
+
+/**
+ * Decodes a UTF-8 name to the UTF-16 units of its long name
+ * @returns number of units, -EINVAL for bytes or characters FAT does not
+ *          allow, -ENAMETOOLONG past 255 units
+ */
+static int utf8_to_utf16(const char* name, uint16_t* out)
+{
+    const uint8_t* p = (const uint8_t*) name;
+    int units = 0;
+
+    while(*p) {
+        uint32_t c;
+        int more, i;
+
+        if(*p < 0x80) {
+            c = *p;
+            more = 0;
+            if(c < 0x20 || strchr("\"*/:<>?\\|", c) != NULL)
+                return -EINVAL;
+        } else if((*p & 0xE0) == 0xC0) {
+            c = *p & 0x1F;
+            more = 1;
+        } else if((*p & 0xF0) == 0xE0) {
+            c = *p & 0x0F;
+            more = 2;
+        } else if((*p & 0xF8) == 0xF0) {
+            c = *p & 0x07;
+            more = 3;
+        } else {
+            return -EINVAL;
+        }
+        p++;
+        for(i = 0 ; i < more ; i++, p++) {
+            if((*p & 0xC0) != 0x80)
+                return -EINVAL;
+            c = (c << 6) | (*p & 0x3F);
+        }
+
+        if(units + (c >= 0x10000 ? 2 : 1) > 255)
+            return -ENAMETOOLONG;
+        if(c >= 0x10000) {
+            c -= 0x10000;
+            out[units++] = htole16(0xD800 + (c >> 10));
+            out[units++] = htole16(0xDC00 + (c & 0x3FF));
+        } else {
+            out[units++] = htole16(c);
+        }
+    }
+    return units;
+}
+
+/**
+ * Derives the 8.3 form of name
+ * @basis gets the upper case base (up to 8 characters, NUL terminated)
+ * @ext gets the upper case extension (up to 3 characters, NUL terminated)
+ * @res gets the NT lower case flags when the name fits 8.3 as is
+ * @returns 1 if the name is a valid short name (no long name needed)
+ */
+static int short_name_basis(const char* name, char* basis, char* ext, uint8_t* res)
+{
+    const char* dot = strrchr(name, '.');
+    const char* p;
+    int exact = 1, n = 0;
+    int base_lower = 0, base_upper = 0, ext_lower = 0, ext_upper = 0;
+
+    if(dot == name)     // ".profile" has no extension, only a base
+        dot = NULL;
+
+    for(p = name ; *p && p != dot ; p++) {
+        uint8_t c = *p;
+        if(c == ' ' || c == '.') {      // dropped from the short name
+            exact = 0;
+            continue;
+        }
+        if(islower(c)) base_lower = 1;
+        if(isupper(c)) base_upper = 1;
+        c = toupper(c);
+        if(!short_char_ok(c)) {
+            exact = 0;
+            if((c & 0xC0) == 0x80)      // UTF-8 continuation, one '_' per character
+                continue;
+            c = '_';
+        }
+        if(n < 8)
+            basis[n++] = c;
+        else
+            exact = 0;
+    }
+    basis[n] = '\0';
+    if(n == 0)
+        exact = 0;
+
+    n = 0;
+    for(p = dot ? dot + 1 : "" ; *p ; p++) {
+        uint8_t c = *p;
+        if(c == ' ') {
+            exact = 0;
+            continue;
+        }
+        if(islower(c)) ext_lower = 1;
+        if(isupper(c)) ext_upper = 1;
+        c = toupper(c);
+        if(!short_char_ok(c)) {
+            exact = 0;
+            if((c & 0xC0) == 0x80)
+                continue;
+            c = '_';
+        }
+        if(n < 3)
+            ext[n++] = c;
+        else
+            exact = 0;
+    }
+    ext[n] = '\0';
+
+    // mixed case within base or extension needs a long name to survive
+    if((base_lower && base_upper) || (ext_lower && ext_upper))
+        exact = 0;
+    *res = (base_lower ? 0x08 : 0) | (ext_lower ? 0x10 : 0);
+    return exact;
+}
+
+static void short_name_pack(char* nameext, const char* base, const char* ext)
+{
+    size_t n = strlen(base);
+
+    memset(nameext, ' ', 11);
+    memcpy(nameext, base, n);
+    memcpy(nameext + 8, ext, strlen(ext));
+    if((uint8_t) nameext[0] == 0xE5)
+        nameext[0] = 0x05;
+}
+
+// What a scan of a directory found out for vfat_dir_add()
+struct dir_survey {
+    char*    names;         // 11 bytes per short name in use
+    size_t   count;
+    size_t   alloc;
+    uint32_t nslots;        // slots in the chain
+    uint32_t run_start;     // first slot of the earliest free run of the wanted length
+    int      run_found;
+    uint32_t tail_start;    // free slots from here up to the end of the chain
+    int      end_seen;      // the 0x00 end marker was found
+    uint32_t end_slot;      // and this is where
+};
+
+static int dir_survey(uint32_t dir, uint32_t need, struct dir_survey* sv)
+{
+    uint32_t cluster = dir, per = slots_per_cluster();
+    uint32_t run = 0, i;
+    size_t hops = 0;
+
+    memset(sv, 0, sizeof(struct dir_survey));
+    while(cluster >= 2 && cluster < (uint32_t) 0x0FFFFFF8 && hops++ <= vfat_info.count_of_cluster) {
+        if(vfat_cache_read_cluster(cluster, dirw_cluster_buf) != 0)
+            return -EIO;
+        for(i = 0 ; i < per ; i++) {
+            const struct fat32_direntry* e = (const struct fat32_direntry*)(dirw_cluster_buf + i * 32);
+            uint8_t first = e->nameext[0];
+
+            if(!sv->end_seen && first == 0x00) {
+                sv->end_seen = 1;
+                sv->end_slot = sv->nslots + i;
+            }
+            if(sv->end_seen || first == 0xE5) {
+                if(run++ == 0)
+                    sv->tail_start = sv->nslots + i;
+                if(run == need && !sv->run_found) {
+                    sv->run_found = 1;
+                    sv->run_start = sv->tail_start;
+                }
+                continue;
+            }
+            run = 0;
+            if((e->attr & 0x3F) == VFAT_ATTR_LFN || (e->attr & ATTR_VOLUME_ID))
+                continue;
+            if(sv->count == sv->alloc) {
+                sv->alloc = sv->alloc ? sv->alloc * 2 : 64;
+                sv->names = realloc(sv->names, sv->alloc * 11);
+                if(sv->names == NULL)
+                    err(1, "realloc(short names)");
+            }
+            memcpy(sv->names + sv->count++ * 11, e->nameext, 11);
+        }
+        sv->nslots += per;
+        cluster = vfat_next_cluster(cluster);
+    }
+    if(run == 0)
+        sv->tail_start = sv->nslots;
+    return 0;
+}
+
+static int short_name_taken(const struct dir_survey* sv, const char* nameext)
+{
+    size_t i;
+
+    for(i = 0 ; i < sv->count ; i++) {
+        if(memcmp(sv->names + i * 11, nameext, 11) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+// Picks a free "BASIS~N" short name
+static int short_name_generate(const struct dir_survey* sv, const char* name,
+                               const char* basis, const char* ext, char* nameext)
+{
+    char base[9], tail[9];
+    uint32_t hash = 2166136261u;
+    const char* p;
+    unsigned n;
+    size_t keep;
+
+    for(p = name ; *p ; p++) {
+        hash ^= (uint8_t) *p;
+        hash *= 16777619u;
+    }
+
+    for(n = 1 ; n < 1000000 ; n++) {
+        snprintf(tail, sizeof(tail), "~%u", n);
+        if(n <= VFAT_SHORT_TAIL_PLAIN || strlen(basis) <= 2) {
+            keep = strlen(basis);
+            if(keep > 8 - strlen(tail))
+                keep = 8 - strlen(tail);
+            memcpy(base, basis, keep);
+        } else {
+            // two characters of the basis and a hash of the long name
+            keep = snprintf(base, sizeof(base), "%.2s%04X", basis, (hash ^ (hash >> 16)) & 0xFFFF);
+            if(keep > 8 - strlen(tail))
+                keep = 8 - strlen(tail);
+        }
+        base[keep] = '\0';
+        strcat(base, tail);
+        short_name_pack(nameext, base, ext);
+        if(!short_name_taken(sv, nameext))
+            return 0;
+    }
+    return -EEXIST;
+}
+
+// Appends count zeroed clusters to a directory
+static int dir_extend(uint32_t dir, uint32_t last, uint32_t count)
+{
+    uint32_t c, first;
+    uint32_t i;
+
+    memset(dirw_cluster_buf, 0, vfat_info.cluster_size);
+    first = vfat_chain_alloc(last, count, 0, 0);
+    if(first == 0)
+        return -ENOSPC;
+    for(c = first, i = 0 ; i < count ; i++, c = vfat_next_cluster(c)) {
+        if(vfat_cache_write_dir(c, dirw_cluster_buf, 0, vfat_info.cluster_size) != 0)
+            return -EIO;
+        vfat_extent_map_grow(dir, c, 1);
+    }
+    vfat_dir_size_invalidate(dir);
+    return 0;
+}
+
+// Last cluster of a chain
+static uint32_t chain_last(uint32_t first)
+{
+    struct vfat_extent_map* map = vfat_extent_map_get(first);
+    const struct vfat_extent* ext = &map->extents[map->count - 1];
+    uint32_t last = ext->disk_cluster + ext->length - 1;
+
+    vfat_extent_map_put(map);
+    return last;
+}
+
+/**
+ * Adds name to the directory. The short name (and the long name entries if
+ * name does not fit 8.3) are filled in, everything else of e is kept.
+ * @loc gets where the entry went
+ * @returns 0 on success, -errno otherwise
+ */
+int vfat_dir_add(uint32_t dir, const char* name, struct fat32_direntry* e, struct vfat_dirent_loc* loc)
+{
+    uint16_t units[VFAT_LFN_MAX_UNITS];
+    char basis[9], ext[4];
+    struct dir_survey sv;
+    struct fat32_direntry_long l;
+    uint32_t need, start, k, i;
+    uint8_t res, csum;
+    int nunits, exact, ret;
+
+    nunits = utf8_to_utf16(name, units);
+    if(nunits < 0)
+        return nunits;
+    if(nunits == 0)
+        return -EINVAL;
+
+    exact = short_name_basis(name, basis, ext, &res);
+    need = exact ? 1 : (nunits + 12) / 13 + 1;
+
+    ret = dir_survey(dir, need, &sv);
+    if(ret == 0) {
+        if(exact) {
+            short_name_pack(e->nameext, basis, ext);
+            e->res = res;
+            // "foo.txt" next to a "FOO.TXT" from elsewhere still gets a tail
+            if(short_name_taken(&sv, e->nameext)) {
+                exact = 0;
+                need = (nunits + 12) / 13 + 1;
+                free(sv.names);
+                ret = dir_survey(dir, need, &sv);
+            }
+        }
+    }
+    if(ret == 0 && !exact) {
+        e->res = 0;
+        ret = short_name_generate(&sv, name, basis, ext, e->nameext);
+    }
+    free(sv.names);
+    if(ret != 0)
+        return ret;
+
+    // no free run big enough: grow the directory behind its free tail
+    if(sv.run_found) {
+        start = sv.run_start;
+    } else {
+        start = sv.tail_start;
+        ret = dir_extend(dir, chain_last(dir),
+                         (start + need - sv.nslots + slots_per_cluster() - 1) / slots_per_cluster());
+        if(ret != 0)
+            return ret;
+        sv.nslots += (start + need - sv.nslots + slots_per_cluster() - 1) / slots_per_cluster() * slots_per_cluster();
+    }
+
+    // long name entries come first, the last part of the name first on disk
+    csum = ChkSum((unsigned char*) e->nameext);
+    for(k = need - 1, i = 0 ; k >= 1 ; k--, i++) {
+        uint16_t part[13];
+        int j;
+
+        for(j = 0 ; j < 13 ; j++) {
+            int u = (k - 1) * 13 + j;
+            part[j] = u < nunits ? units[u] : (u == nunits ? 0x0000 : 0xFFFF);
+        }
+        memset(&l, 0, sizeof(l));
+        l.seq = k | (k == need - 1 ? VFAT_LFN_SEQ_START : 0);
+        l.attr = VFAT_ATTR_LFN;
+        l.csum = csum;
+        memcpy(l.name1, part, sizeof(l.name1));
+        memcpy(l.name2, part + 5, sizeof(l.name2));
+        memcpy(l.name3, part + 11, sizeof(l.name3));
+        if(vfat_dirent_write(dir, start + i, (struct fat32_direntry*) &l) != 0)
+            return -EIO;
+    }
+    if(vfat_dirent_write(dir, start + need - 1, e) != 0)
+        return -EIO;
+
+    // entries placed over the old end marker need a new one behind them
+    if(sv.end_seen && start + need > sv.end_slot && start + need < sv.nslots) {
+        struct fat32_direntry next;
+        if(vfat_dirent_read(dir, start + need, &next) == 0 && next.nameext[0] != 0x00) {
+            memset(&next, 0, sizeof(next));
+            vfat_dirent_write(dir, start + need, &next);
+        }
+    }
+
+    loc->dir = dir;
+    loc->first = start;
+    loc->slot = start + need - 1;
+    return 0;
+}
+
+// Marks the short entry and its long name entries deleted
+int vfat_dir_remove(const struct vfat_dirent_loc* loc)
+{
+    struct fat32_direntry e;
+    uint32_t i;
+
+    for(i = loc->first ; i <= loc->slot ; i++) {
+        if(vfat_dirent_read(loc->dir, i, &e) != 0)
+            return -EIO;
+        e.nameext[0] = (char) 0xE5;
+        if(vfat_dirent_write(loc->dir, i, &e) != 0)
+            return -EIO;
+    }
+    return 0;
+}
+
+static int dir_any_entry(void* data, const char* name, const struct stat* st,
+                         const struct vfat_dirent_loc* loc)
+{
+    if(strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+        return 0;
+    *(int*) data = 0;
+    return 1;
+}
+
+// Whether the directory holds nothing but "." and ".."
+int vfat_dir_is_empty(uint32_t dir)
+{
+    int empty = 1;
+
+    vfat_readdir_loc(dir, dir_any_entry, &empty);
+    return empty;
+}
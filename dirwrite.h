@@ -0,0 +1,21 @@
+#ifndef H_DIRWRITE
+#define H_DIRWRITE
+
+#include <stdint.h>
+#include <time.h>
+
+#include "vfat.h"
+
+// Numeric tails ~1..~N are tried on the plain basis name before switching to
+// a hashed basis, so a directory full of similar long names stays cheap
+#define VFAT_SHORT_TAIL_PLAIN   4
+
+int vfat_dirent_read(uint32_t dir, uint32_t slot, struct fat32_direntry* e);
+int vfat_dirent_write(uint32_t dir, uint32_t slot, const struct fat32_direntry* e);
+void vfat_dirent_init(struct fat32_direntry* e, uint8_t attr, uint32_t cluster, time_t now);
+void vfat_dirent_set_cluster(struct fat32_direntry* e, uint32_t cluster);
+int vfat_dir_add(uint32_t dir, const char* name, struct fat32_direntry* e, struct vfat_dirent_loc* loc);
+int vfat_dir_remove(const struct vfat_dirent_loc* loc);
+int vfat_dir_is_empty(uint32_t dir);
+
+#endif
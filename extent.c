@@ -0,0 +1,167 @@
+#include <sys/types.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <err.h>
+
+#include "vfat.h"
+#include "extent.h"
+#include "sidecar.h"
+
+static struct vfat_cached* extent_map_build(uint32_t first_cluster);
+static void extent_map_destroy(struct vfat_cached* obj);
+
+// Chains are looked up by their first cluster. A slot is simply replaced on
+// collision, which keeps the cache bounded without any bookkeeping. Every
+// change to a chain updates it, maps built from the old FAT are not cached.
+static struct vfat_cached* extent_slots[VFAT_EXTENT_CACHE_SLOTS];
+static struct vfat_refcache extent_cache =
+    VFAT_REFCACHE_INIT(extent_slots, extent_map_build, extent_map_destroy);
+
+// Byte offset of cluster[n] on the device
+off_t vfat_cluster_offset(uint32_t cluster_num)
+{
+    if(cluster_num < 2)
+        err(1, "cluster number should be greater than 2!\n");
+    // ((n-2) * BPB_SecPerClus) + FirstDataSector
+    return ((off_t)(cluster_num - 2) * vfat_info.sectors_per_cluster + vfat_info.first_data_sector)
+        * vfat_info.bytes_per_sector;
+}
+
+static void extent_map_destroy(struct vfat_cached* obj)
+{
+    struct vfat_extent_map* map = (struct vfat_extent_map*) obj;
+
+    free(map->extents);
+    free(map);
+}
+
+// Appends count clusters starting at disk cluster_no to the map
+static void extent_map_append(struct vfat_extent_map* map, uint32_t cluster_no, uint32_t count)
+{
+    struct vfat_extent* last = map->count ? &map->extents[map->count - 1] : NULL;
+
+    if(last != NULL && last->disk_cluster + last->length == cluster_no) {
+        last->length += count;
+    } else {
+        if(map->count == map->alloc) {
+            map->alloc = map->alloc ? map->alloc * 2 : 4;
+            map->extents = realloc(map->extents, map->alloc * sizeof(struct vfat_extent));
+            if(map->extents == NULL)
+                err(1, "realloc(extents)");
+        }
+        last = &map->extents[map->count++];
+        last->file_cluster = map->nclusters;
+        last->disk_cluster = cluster_no;
+        last->length = count;
+    }
+    map->nclusters += count;
+}
+
+// Walk the chain once and merge neighbouring clusters into extents
+static struct vfat_cached* extent_map_build(uint32_t first_cluster)
+{
+    struct vfat_extent_map* map = calloc(1, sizeof(struct vfat_extent_map));
+    uint32_t cluster_no = first_cluster;
+    const struct vfat_extent* extents;
+    size_t count;
+
+    if(map == NULL)
+        err(1, "calloc(extent map)");
+
+    // the sidecar index has every chain of the volume as it was at mount
+    if(vfat_sidecar_chain(first_cluster, &extents, &count, &map->nclusters) == 0) {
+        map->alloc = count ? count : 1;
+        if((map->extents = malloc(map->alloc * sizeof(struct vfat_extent))) == NULL)
+            err(1, "malloc(extents)");
+        memcpy(map->extents, extents, count * sizeof(struct vfat_extent));
+        map->count = count;
+        return &map->cached;
+    }
+
+    while(cluster_no >= 2 && cluster_no < (uint32_t) 0x0FFFFFF8) {
+        // a chain can never be longer than the volume; anything else is a loop
+        if(map->nclusters > vfat_info.count_of_cluster)
+            err(1, "FAT chain starting at %u loops!!\n", first_cluster);
+
+        extent_map_append(map, cluster_no, 1);
+        cluster_no = vfat_next_cluster(cluster_no);
+    }
+    return &map->cached;
+}
+
+// Extent map of the chain starting at first_cluster, built on first use.
+// Release it with vfat_extent_map_put().
+struct vfat_extent_map* vfat_extent_map_get(uint32_t first_cluster)
+{
+    return (struct vfat_extent_map*) vfat_refcache_get(&extent_cache, first_cluster);
+}
+
+void vfat_extent_map_put(struct vfat_extent_map* map)
+{
+    vfat_refcache_put(&extent_cache, &map->cached);
+}
+
+// Binary search for the extent holding the file_cluster'th cluster of the chain
+const struct vfat_extent* vfat_extent_find(const struct vfat_extent_map* map, uint32_t file_cluster)
+{
+    size_t lo = 0, hi = map->count;
+
+    if(file_cluster >= map->nclusters)
+        return NULL;
+
+    // find the last extent with file_cluster <= target
+    while(hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if(map->extents[mid].file_cluster <= file_cluster)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    assert(file_cluster - map->extents[lo].file_cluster < map->extents[lo].length);
+    return &map->extents[lo];
+}
+
+// Where a chain grew, see vfat_extent_map_grow()
+struct extent_growth {
+    uint32_t disk_cluster;
+    uint32_t count;
+};
+
+// The cached map extended by the growth, readers may still use the old one
+static struct vfat_cached* extent_map_grown(const struct vfat_cached* obj, void* arg)
+{
+    const struct vfat_extent_map* old = (const struct vfat_extent_map*) obj;
+    const struct extent_growth* g = arg;
+    struct vfat_extent_map* map = calloc(1, sizeof(struct vfat_extent_map));
+
+    if(map == NULL || (map->extents = malloc((old->count + 1) * sizeof(struct vfat_extent))) == NULL)
+        err(1, "malloc(extent map)");
+    map->count = old->count;
+    map->alloc = map->count + 1;
+    map->nclusters = old->nclusters;
+    memcpy(map->extents, old->extents, map->count * sizeof(struct vfat_extent));
+    extent_map_append(map, g->disk_cluster, g->count);
+    return &map->cached;
+}
+
+/**
+ * Records that the chain starting at first_cluster got count more clusters,
+ * starting at disk_cluster and contiguous. A cached map is extended in a
+ * copy instead of walking the whole chain again on the next lookup.
+ */
+void vfat_extent_map_grow(uint32_t first_cluster, uint32_t disk_cluster, uint32_t count)
+{
+    struct extent_growth g = { disk_cluster, count };
+
+    vfat_sidecar_drop();
+    vfat_refcache_update(&extent_cache, first_cluster, extent_map_grown, &g);
+}
+
+// Forgets the map of a chain that was shortened or freed
+void vfat_extent_map_invalidate(uint32_t first_cluster)
+{
+    vfat_sidecar_drop();
+    vfat_refcache_update(&extent_cache, first_cluster, NULL, NULL);
+}
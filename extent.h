@@ -0,0 +1,34 @@
+#ifndef H_EXTENT
+#define H_EXTENT
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "refcache.h"
+
+// One run of physically contiguous clusters inside a cluster chain
+struct vfat_extent {
+    uint32_t file_cluster;  // index of the run's first cluster inside the file
+    uint32_t disk_cluster;  // cluster number of the run on disk
+    uint32_t length;        // clusters in the run
+};
+
+// Run-length compressed cluster chain of one file/directory
+struct vfat_extent_map {
+    struct vfat_cached cached;  // keyed by the first cluster
+    uint32_t nclusters;     // clusters in the whole chain
+    size_t   count;         // number of extents
+    size_t   alloc;
+    struct vfat_extent* extents;
+};
+
+#define VFAT_EXTENT_CACHE_SLOTS 256
+
+off_t vfat_cluster_offset(uint32_t cluster_num);
+struct vfat_extent_map* vfat_extent_map_get(uint32_t first_cluster);
+void vfat_extent_map_put(struct vfat_extent_map* map);
+const struct vfat_extent* vfat_extent_find(const struct vfat_extent_map* map, uint32_t file_cluster);
+void vfat_extent_map_grow(uint32_t first_cluster, uint32_t disk_cluster, uint32_t count);
+void vfat_extent_map_invalidate(uint32_t first_cluster);
+
+#endif
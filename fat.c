@@ -0,0 +1,394 @@
+#include <sys/types.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <err.h>
+
+#include "vfat.h"
+#include "cache.h"
+#include "dev.h"
+#include "freespace.h"
+#include "fat.h"
+#include "stats.h"
+
+// Writable mounts keep the active FAT in memory. Changes only mark their
+// sector dirty, vfat_fat_flush() writes each run of dirty sectors with one
+// pwrite per FAT copy.
+static uint64_t* fat_dirty;         // one bit per FAT sector
+static int fsinfo_dirty;
+static pthread_mutex_t fat_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t flush_thread_once = PTHREAD_ONCE_INIT;
+
+// Chains no entry refers to anymore, waiting for the reclaimer. A chain
+// is freed once a vfat_sync() that started after it was queued has written
+// the entry that let go of it.
+struct reclaim_item {
+    uint32_t first_cluster;
+    unsigned long ticket;   // vfat_sync() calls started before it was queued
+};
+
+static struct reclaim_item* reclaim_queue;
+static size_t reclaim_count;
+static size_t reclaim_alloc;
+static size_t reclaim_uncached;     // items whose cached data is dropped already
+static unsigned long sync_started;  // vfat_sync() calls begun
+static unsigned long sync_done;     // the latest of them that finished without error
+static pthread_mutex_t reclaim_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t reclaim_run_lock = PTHREAD_MUTEX_INITIALIZER;  // one batch at a time
+static pthread_cond_t reclaim_cond = PTHREAD_COND_INITIALIZER;
+static pthread_once_t reclaim_thread_once = PTHREAD_ONCE_INIT;
+
+// Loads the active FAT into memory, replaces the read-only mapping
+void vfat_fat_load(void)
+{
+    size_t bytes = vfat_info.fat_size * vfat_info.bytes_per_sector;
+
+    vfat_info.fat = malloc(bytes);
+    fat_dirty = calloc(vfat_info.fat_size / 64 + 1, sizeof(uint64_t));
+    if(vfat_info.fat == NULL || fat_dirty == NULL)
+        err(1, "malloc(FAT of %lu bytes)", bytes);
+    if(vfat_dev_read(vfat_info.fat, bytes,
+             vfat_info.fat_begin_offset + vfat_info.active_fat * bytes) != bytes)
+        err(1, "read FAT");
+}
+
+// Periodic write-back, started with the first change
+static void* flush_thread(void* unused)
+{
+    for(;;) {
+        sleep(VFAT_FLUSH_INTERVAL);
+        vfat_sync(0);
+    }
+    return NULL;
+}
+
+static void flush_start_thread(void)
+{
+    pthread_t tid;
+
+    if(pthread_create(&tid, NULL, flush_thread, NULL) != 0)
+        err(1, "pthread_create(flush)");
+    pthread_detach(tid);
+}
+
+// Sets FAT[cluster_num], the reserved top 4 bits of the entry are kept
+void vfat_fat_set(uint32_t cluster_num, uint32_t value)
+{
+    size_t sector = cluster_num * sizeof(uint32_t) / vfat_info.bytes_per_sector;
+    uint32_t old;
+
+    if(cluster_num >= vfat_info.fat_entries)
+        err(1, "cluster %u is out of FAT range!!\n", cluster_num);
+    pthread_once(&flush_thread_once, flush_start_thread);
+
+    pthread_mutex_lock(&fat_lock);
+    old = le32toh(vfat_info.fat[cluster_num]);
+    __atomic_store_n(&vfat_info.fat[cluster_num], htole32((old & 0xF0000000) | (value & 0x0FFFFFFF)), __ATOMIC_RELAXED);
+    fat_dirty[sector / 64] |= 1ULL << (sector % 64);
+    fsinfo_dirty = 1;
+    pthread_mutex_unlock(&fat_lock);
+}
+
+// Rewrites the free cluster count and next free hint, called with fat_lock held
+static int fsinfo_write(void)
+{
+    struct fat_fsinfo fsinfo;
+    off_t pos = vfat_info.fsinfo_sector * vfat_info.bytes_per_sector;
+
+    if(vfat_dev_read(&fsinfo, sizeof(fsinfo), pos) != sizeof(fsinfo))
+        return -1;
+    fsinfo.free_count = htole32(vfat_free_clusters());
+    fsinfo.next_free = htole32(vfat_info.fsinfo_next_free);
+    if(vfat_dev_write(&fsinfo, sizeof(fsinfo), pos) != sizeof(fsinfo))
+        return -1;
+    return 0;
+}
+
+/**
+ * Writes the dirty FAT sectors to every FAT copy (only the active one if
+ * mirroring is off), neighbouring sectors in one write, then FSInfo.
+ * Whatever failed stays dirty for the next flush.
+ * @returns 0 on success, -1 if a write failed
+ */
+int vfat_fat_flush(void)
+{
+    size_t bps = vfat_info.bytes_per_sector;
+    size_t first, last, copy, i;
+    int ret = 0, failed;
+
+    pthread_mutex_lock(&fat_lock);
+    for(first = 0 ; first < vfat_info.fat_size ; first = last) {
+        if(fat_dirty[first / 64] == 0) {
+            last = (first / 64 + 1) * 64;
+            continue;
+        }
+        if(!(fat_dirty[first / 64] & (1ULL << (first % 64)))) {
+            last = first + 1;
+            continue;
+        }
+        for(last = first ; last < vfat_info.fat_size && (fat_dirty[last / 64] & (1ULL << (last % 64))) ; last++)
+            ;
+
+        failed = 0;
+        for(copy = 0 ; copy < vfat_info.fat_count ; copy++) {
+            if(!vfat_info.fat_mirrored && copy != vfat_info.active_fat)
+                continue;
+            if(vfat_dev_write((char*) vfat_info.fat + first * bps, (last - first) * bps,
+                      vfat_info.fat_begin_offset + (copy * vfat_info.fat_size + first) * bps) != (last - first) * bps)
+                failed = 1;
+            vfat_count(VFAT_CNT_DEV_WRITES, 1);
+            vfat_count(VFAT_CNT_DEV_WRITE_BYTES, (last - first) * bps);
+        }
+        // the sectors stay dirty until every copy has them
+        if(failed) {
+            ret = -1;
+            continue;
+        }
+        for(i = first ; i < last ; i++)
+            fat_dirty[i / 64] &= ~(1ULL << (i % 64));
+    }
+    if(fsinfo_dirty && vfat_info.fsinfo_sector != 0 && fsinfo_write() != 0)
+        ret = -1;
+    else
+        fsinfo_dirty = 0;
+    pthread_mutex_unlock(&fat_lock);
+    return ret;
+}
+
+/**
+ * Allocates count clusters and links them after last, 0 starts a new chain.
+ * They are taken in as few contiguous runs as the free space allows.
+ * @extra clusters more the chain is expected to grow by, kept in reserve
+ * @owner file the chain belongs to, 0 for none
+ * @returns the first new cluster, 0 if the volume is full (nothing changed then)
+ */
+uint32_t vfat_chain_alloc(uint32_t last, size_t count, size_t extra, uint64_t owner)
+{
+    uint32_t first = 0, prev = last, c, got, i;
+
+    while(count > 0) {
+        c = vfat_alloc_run(owner, prev ? prev + 1 : 0, count, extra, &got);
+        // clusters waiting for the reclaimer are freed right away when needed
+        if(c == 0 && vfat_reclaim_pending()) {
+            vfat_reclaim_drain();
+            c = vfat_alloc_run(owner, prev ? prev + 1 : 0, count, extra, &got);
+        }
+        if(c == 0) {
+            if(first != 0)
+                vfat_chain_free(first);
+            if(last != 0)
+                vfat_fat_set(last, VFAT_EOC);
+            return 0;
+        }
+        for(i = 0 ; i < got ; i++)
+            vfat_fat_set(c + i, i + 1 < got ? c + i + 1 : VFAT_EOC);
+        if(prev != 0)
+            vfat_fat_set(prev, c);
+        if(first == 0)
+            first = c;
+        prev = c + got - 1;
+        count -= got;
+    }
+    return first;
+}
+
+// Frees every cluster of the chain and drops them from the cluster cache
+void vfat_chain_free(uint32_t first_cluster)
+{
+    uint32_t c = first_cluster, next, run_start = 0, run_len = 0;
+    size_t hops = 0;
+
+    while(c >= 2 && c < (uint32_t) 0x0FFFFFF8 && hops++ <= vfat_info.count_of_cluster) {
+        next = vfat_next_cluster(c);
+        vfat_fat_set(c, 0);
+        vfat_cache_invalidate(c);
+        if(run_len > 0 && c == run_start + run_len) {
+            run_len++;
+        } else {
+            if(run_len > 0)
+                vfat_release_run(run_start, run_len);
+            run_start = c;
+            run_len = 1;
+        }
+        c = next;
+    }
+    if(run_len > 0)
+        vfat_release_run(run_start, run_len);
+}
+
+// Drops the cached clusters of a chain, unwritten data included
+static void chain_uncache(uint32_t first_cluster)
+{
+    uint32_t c = first_cluster;
+    size_t hops = 0;
+
+    while(c >= 2 && c < (uint32_t) 0x0FFFFFF8 && hops++ <= vfat_info.count_of_cluster) {
+        vfat_cache_invalidate(c);
+        c = vfat_next_cluster(c);
+    }
+}
+
+/**
+ * Frees the queued chains whose entries have been written. The device
+ * gets them for good before the FAT frees the chains, so a crash in
+ * between leaves lost clusters, never shared ones. The freed FAT sectors
+ * go out together.
+ * @returns the number of chains freed
+ */
+static size_t reclaim_ready(void)
+{
+    uint32_t* batch;
+    size_t n, i;
+
+    pthread_mutex_lock(&reclaim_run_lock);
+    pthread_mutex_lock(&reclaim_lock);
+    for(n = 0 ; n < reclaim_count && reclaim_queue[n].ticket < sync_done ; n++)
+        ;
+    batch = malloc((n + 1) * sizeof(uint32_t));
+    if(batch == NULL)
+        err(1, "malloc(reclaim batch)");
+    for(i = 0 ; i < n ; i++)
+        batch[i] = reclaim_queue[i].first_cluster;
+    memmove(reclaim_queue, reclaim_queue + n, (reclaim_count - n) * sizeof(struct reclaim_item));
+    reclaim_count -= n;
+    reclaim_uncached = reclaim_uncached > n ? reclaim_uncached - n : 0;
+    pthread_mutex_unlock(&reclaim_lock);
+
+    // if the device cannot confirm, the chains stay allocated
+    if(n > 0 && fdatasync(vfat_info.fd) == 0) {
+        for(i = 0 ; i < n ; i++)
+            vfat_chain_free(batch[i]);
+        vfat_fat_flush();
+    } else {
+        n = 0;
+    }
+    pthread_mutex_unlock(&reclaim_run_lock);
+    free(batch);
+    return n;
+}
+
+// Frees every queued chain now, writing out whatever that takes
+void vfat_reclaim_drain(void)
+{
+    vfat_sync(1);
+    reclaim_ready();
+}
+
+// Drops the data of queued chains from the cache before a flush writes it,
+// then frees them after the next flush
+static void* reclaim_thread(void* unused)
+{
+    uint32_t first_cluster;
+
+    pthread_mutex_lock(&reclaim_lock);
+    for(;;) {
+        if(reclaim_uncached < reclaim_count) {
+            // a batch freeing the chain meanwhile would hand its clusters
+            // to new files, so batches wait until it is uncached
+            pthread_mutex_unlock(&reclaim_lock);
+            pthread_mutex_lock(&reclaim_run_lock);
+            pthread_mutex_lock(&reclaim_lock);
+            if(reclaim_uncached < reclaim_count) {
+                first_cluster = reclaim_queue[reclaim_uncached++].first_cluster;
+                pthread_mutex_unlock(&reclaim_lock);
+                chain_uncache(first_cluster);
+                pthread_mutex_lock(&reclaim_lock);
+            }
+            pthread_mutex_unlock(&reclaim_run_lock);
+        } else if(reclaim_count > 0 && reclaim_queue[0].ticket < sync_done) {
+            pthread_mutex_unlock(&reclaim_lock);
+            reclaim_ready();
+            pthread_mutex_lock(&reclaim_lock);
+        } else {
+            pthread_cond_wait(&reclaim_cond, &reclaim_lock);
+        }
+    }
+    return NULL;
+}
+
+static void reclaim_start_thread(void)
+{
+    pthread_t tid;
+
+    if(pthread_create(&tid, NULL, reclaim_thread, NULL) != 0)
+        err(1, "pthread_create(reclaim)");
+    pthread_detach(tid);
+}
+
+// Whether chains are waiting for the reclaimer
+int vfat_reclaim_pending(void)
+{
+    int ret;
+
+    pthread_mutex_lock(&reclaim_lock);
+    ret = reclaim_count > 0;
+    pthread_mutex_unlock(&reclaim_lock);
+    return ret;
+}
+
+/**
+ * Hands a chain to the background reclaimer. Nothing may refer to it
+ * anymore: the entry has been removed or changed, or the chain was cut
+ * off its file with an end of chain mark.
+ */
+void vfat_chain_reclaim(uint32_t first_cluster)
+{
+    if(first_cluster < 2 || first_cluster >= (uint32_t) 0x0FFFFFF8)
+        return;
+    pthread_once(&reclaim_thread_once, reclaim_start_thread);
+
+    pthread_mutex_lock(&reclaim_lock);
+    if(reclaim_count == reclaim_alloc) {
+        reclaim_alloc = reclaim_alloc ? reclaim_alloc * 2 : 64;
+        reclaim_queue = realloc(reclaim_queue, reclaim_alloc * sizeof(struct reclaim_item));
+        if(reclaim_queue == NULL)
+            err(1, "realloc(reclaim queue)");
+    }
+    reclaim_queue[reclaim_count].first_cluster = first_cluster;
+    reclaim_queue[reclaim_count].ticket = sync_started;
+    reclaim_count++;
+    pthread_cond_signal(&reclaim_cond);
+    pthread_mutex_unlock(&reclaim_lock);
+}
+
+/**
+ * Pushes written file data, then the FAT, then directory clusters to the
+ * device. An entry only reaches it once the FAT has the clusters it names,
+ * a crash in between leaves lost clusters instead of cross-linked ones.
+ * @durable also waits until the device has it
+ * @returns 0 on success, -1 if a write failed
+ */
+int vfat_sync(int durable)
+{
+    unsigned long ticket;
+    int ret = 0;
+
+    if(vfat_info.read_only)
+        return 0;
+    pthread_mutex_lock(&reclaim_lock);
+    ticket = ++sync_started;
+    pthread_mutex_unlock(&reclaim_lock);
+
+    if(vfat_cache_flush(0) != 0)
+        ret = -1;
+    // directories wait for a FAT that made it out
+    if(vfat_fat_flush() != 0)
+        ret = -1;
+    else if(vfat_cache_flush(1) != 0)
+        ret = -1;
+    if(durable && fdatasync(vfat_info.fd) != 0)
+        ret = -1;
+
+    // what was queued for the reclaimer before is safe to free now
+    if(ret == 0) {
+        pthread_mutex_lock(&reclaim_lock);
+        if(ticket > sync_done)
+            sync_done = ticket;
+        pthread_cond_signal(&reclaim_cond);
+        pthread_mutex_unlock(&reclaim_lock);
+    }
+    return ret;
+}
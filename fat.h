@@ -0,0 +1,21 @@
+#ifndef H_FAT
+#define H_FAT
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define VFAT_EOC                0x0FFFFFFF
+// Written data and dirty FAT sectors reach the device at least this often (seconds)
+#define VFAT_FLUSH_INTERVAL     5
+
+void vfat_fat_load(void);
+void vfat_fat_set(uint32_t cluster_num, uint32_t value);
+int vfat_fat_flush(void);
+uint32_t vfat_chain_alloc(uint32_t last, size_t count, size_t extra, uint64_t owner);
+void vfat_chain_free(uint32_t first_cluster);
+void vfat_chain_reclaim(uint32_t first_cluster);
+int vfat_reclaim_pending(void);
+void vfat_reclaim_drain(void);
+int vfat_sync(int durable);
+
+#endif
@@ -0,0 +1,124 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <endian.h>
+#include <err.h>
+
+#include "vfat.h"
+#include "fatrun.h"
+
+// Read-only mounts with -o fat=compact keep the FAT as runs instead of one
+// entry per cluster. A run is a range of entries that either link each
+// cluster to the next one (a contiguous piece of a chain, its last entry
+// holds where the chain goes on) or all hold the same value (free space,
+// bad clusters, one cluster files). Runs are found by binary search over
+// their first entries. An unfragmented volume needs a few runs per file.
+
+#define RUN_CONST   0x80000000u     // every entry of the run holds the value
+#define RUN_VALUE   0x0FFFFFFFu
+
+static uint32_t* run_start;         // first entry of each run, run_start[nruns] is the end
+static uint32_t* run_value;         // RUN_CONST | value, or the last entry of a linked run
+static size_t nruns;
+static size_t runs_alloc;
+
+// The run of the previous lookup, chains are mostly walked in order
+static __thread size_t last_run;
+
+static void run_add(uint32_t start, uint32_t value)
+{
+    if(nruns == runs_alloc) {
+        runs_alloc = runs_alloc ? runs_alloc * 2 : 1024;
+        run_start = realloc(run_start, (runs_alloc + 1) * sizeof(uint32_t));
+        run_value = realloc(run_value, runs_alloc * sizeof(uint32_t));
+        if(run_start == NULL || run_value == NULL)
+            err(1, "realloc(FAT runs)");
+    }
+    run_start[nruns] = start;
+    run_value[nruns++] = value;
+}
+
+/**
+ * Encodes the first entries of the FAT as runs.
+ * The caller may drop the FAT afterwards.
+ */
+void vfat_fatrun_build(const uint32_t* fat, size_t entries)
+{
+    size_t i, j;
+    uint32_t v;
+
+    for(i = 0 ; i < entries ; i = j + 1) {
+        v = le32toh(fat[i]) & RUN_VALUE;
+        j = i;
+        if(v == i + 1) {
+            while(j + 1 < entries && (le32toh(fat[j + 1]) & RUN_VALUE) == j + 2)
+                j++;
+            // the entry leaving the run belongs to it as well
+            if(j + 1 < entries)
+                j++;
+            run_add(i, le32toh(fat[j]) & RUN_VALUE);
+        } else {
+            while(j + 1 < entries && (le32toh(fat[j + 1]) & RUN_VALUE) == v)
+                j++;
+            run_add(i, RUN_CONST | v);
+        }
+    }
+    run_start[nruns] = entries;
+    // give back what the doubling reserved
+    run_start = realloc(run_start, (nruns + 1) * sizeof(uint32_t));
+    run_value = realloc(run_value, (nruns ? nruns : 1) * sizeof(uint32_t));
+    if(run_start == NULL || run_value == NULL)
+        err(1, "realloc(FAT runs)");
+    runs_alloc = nruns;
+}
+
+// Run holding entry c, c is below the end of the last run
+static size_t run_find(uint32_t c)
+{
+    size_t lo = last_run, hi;
+
+    if(lo < nruns && run_start[lo] <= c && c < run_start[lo + 1])
+        return lo;
+    // the next run is the likely one after the last cluster of a run
+    if(++lo < nruns && run_start[lo] <= c && c < run_start[lo + 1])
+        return last_run = lo;
+
+    // last run whose first entry is at or below c
+    for(lo = 0, hi = nruns ; hi - lo > 1 ;) {
+        size_t mid = lo + (hi - lo) / 2;
+        if(run_start[mid] <= c)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return last_run = lo;
+}
+
+// FAT[cluster_num], as vfat_next_cluster() returns it
+uint32_t vfat_fatrun_next(uint32_t cluster_num)
+{
+    size_t r = run_find(cluster_num);
+
+    if(run_value[r] & RUN_CONST)
+        return run_value[r] & RUN_VALUE;
+    return cluster_num + 1 == run_start[r + 1] ? run_value[r] : cluster_num + 1;
+}
+
+// Calls fn for every run of free entries below end
+void vfat_fatrun_each_free(size_t end, void (*fn)(size_t start, size_t count))
+{
+    size_t r, last;
+
+    for(r = 0 ; r < nruns && run_start[r] < end ; r++) {
+        if(run_value[r] != RUN_CONST)
+            continue;
+        last = run_start[r + 1] < end ? run_start[r + 1] : end;
+        fn(run_start[r], last - run_start[r]);
+    }
+}
+
+// Memory the runs take
+size_t vfat_fatrun_bytes(void)
+{
+    return (2 * nruns + 1) * sizeof(uint32_t);
+}
@@ -0,0 +1,12 @@
+#ifndef H_FATRUN
+#define H_FATRUN
+
+#include <stdint.h>
+#include <stddef.h>
+
+void vfat_fatrun_build(const uint32_t* fat, size_t entries);
+uint32_t vfat_fatrun_next(uint32_t cluster_num);
+void vfat_fatrun_each_free(size_t end, void (*fn)(size_t start, size_t count));
+size_t vfat_fatrun_bytes(void);
+
+#endif
@@ -0,0 +1,547 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <endian.h>
+#include <pthread.h>
+#include <err.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "vfat.h"
+#include "freespace.h"
+#include "fatrun.h"
+
+// One bit per cluster, set while the cluster is free. Built from the cached
+// FAT the first time an exact answer is needed, kept up to date by the
+// allocator afterwards.
+static uint64_t* free_bitmap;
+static size_t free_count;
+static size_t reserved;     // clusters out of the bitmap for a reservation, still free
+static size_t free_end;     // one past the last cluster number
+static pthread_mutex_t free_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline void mark_free(size_t base, uint32_t bits)
+{
+    free_bitmap[base / 64] |= (uint64_t) bits << (base % 64);
+}
+
+static size_t count_scalar(size_t from, size_t to)
+{
+    size_t i;
+
+    for(i = from ; i < to ; i++) {
+        if((le32toh(vfat_info.fat[i]) & 0x0FFFFFFF) == 0)
+            mark_free(i, 1);
+    }
+    return to;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// Zero test of four FAT entries per step, the result goes straight into the bitmap
+static size_t count_sse2(size_t from, size_t to)
+{
+    const __m128i mask = _mm_set1_epi32(0x0FFFFFFF);
+    size_t i;
+
+    for(i = from ; i + 4 <= to ; i += 4) {
+        __m128i v = _mm_and_si128(_mm_loadu_si128((const __m128i*)(vfat_info.fat + i)), mask);
+        mark_free(i, _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(v, _mm_setzero_si128()))));
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+static size_t count_avx2(size_t from, size_t to)
+{
+    const __m256i mask = _mm256_set1_epi32(0x0FFFFFFF);
+    size_t i;
+
+    for(i = from ; i + 8 <= to ; i += 8) {
+        __m256i v = _mm256_and_si256(_mm256_loadu_si256((const __m256i*)(vfat_info.fat + i)), mask);
+        mark_free(i, _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(v, _mm256_setzero_si256()))));
+    }
+    return i;
+}
+#endif
+
+static void mark_free_range(size_t start, size_t count)
+{
+    size_t c;
+
+    for(c = start ; c < start + count ; c++)
+        mark_free(c, 1);
+}
+
+// Called with free_lock held
+static void free_bitmap_build(void)
+{
+    size_t end = vfat_info.count_of_cluster + 2;
+    size_t from = 2, w;
+
+    if(free_bitmap != NULL)
+        return;
+    if(end > vfat_info.fat_entries)
+        end = vfat_info.fat_entries;
+    free_bitmap = calloc((end + 63) / 64 + 1, sizeof(uint64_t));
+    if(free_bitmap == NULL)
+        err(1, "calloc(free bitmap)");
+
+    if(vfat_info.fat_compact) {
+        // clusters 0 and 1 are never free, the runs start at entry 0
+        vfat_fatrun_each_free(end, mark_free_range);
+        free_bitmap[0] &= ~3ULL;
+    } else {
+        // step to an 8 entry boundary so the vector loops stay aligned with words
+        from = count_scalar(from, end < 8 ? end : 8);
+#if defined(__x86_64__) || defined(__i386__)
+        if(__builtin_cpu_supports("avx2"))
+            from = count_avx2(from, end);
+        else
+            from = count_sse2(from, end);
+#endif
+        count_scalar(from, end);
+    }
+
+    for(w = 0 ; w < (end + 63) / 64 ; w++)
+        free_count += __builtin_popcountll(free_bitmap[w]);
+    free_end = end;
+}
+
+// Free clusters on the volume. A valid FSInfo hint is trusted, otherwise the
+// FAT is counted once and the bitmap answers from then on.
+size_t vfat_free_clusters(void)
+{
+    size_t ret;
+
+    pthread_mutex_lock(&free_lock);
+    if(free_bitmap == NULL && vfat_info.fsinfo_free <= vfat_info.count_of_cluster) {
+        ret = vfat_info.fsinfo_free;
+    } else {
+        free_bitmap_build();
+        ret = free_count + reserved;
+    }
+    pthread_mutex_unlock(&free_lock);
+    return ret;
+}
+
+int vfat_cluster_is_free(uint32_t cluster_num)
+{
+    int ret;
+
+    if(cluster_num < 2 || cluster_num >= vfat_info.count_of_cluster + 2)
+        return 0;
+    pthread_mutex_lock(&free_lock);
+    free_bitmap_build();
+    ret = (free_bitmap[cluster_num / 64] >> (cluster_num % 64)) & 1;
+    pthread_mutex_unlock(&free_lock);
+    return ret;
+}
+
+// First free cluster at or after from, 0 if there is none. Called with free_lock held.
+static uint32_t free_search(size_t from, size_t to)
+{
+    size_t w;
+    uint64_t bits;
+
+    if(from >= to)
+        return 0;
+    w = from / 64;
+    bits = free_bitmap[w] & (~0ULL << (from % 64));
+    while(bits == 0) {
+        if(++w * 64 >= to)
+            return 0;
+        bits = free_bitmap[w];
+    }
+    from = w * 64 + __builtin_ctzll(bits);
+    return from < to ? from : 0;
+}
+
+// First cluster at or after from that is not free, to if there is none
+static size_t used_search(size_t from, size_t to)
+{
+    size_t w;
+    uint64_t bits;
+
+    if(from >= to)
+        return to;
+    w = from / 64;
+    bits = ~free_bitmap[w] & (~0ULL << (from % 64));
+    while(bits == 0) {
+        if(++w * 64 >= to)
+            return to;
+        bits = ~free_bitmap[w];
+    }
+    from = w * 64 + __builtin_ctzll(bits);
+    return from < to ? from : to;
+}
+
+static inline int is_free(size_t c)
+{
+    return (free_bitmap[c / 64] >> (c % 64)) & 1;
+}
+
+// First cluster of the free run c is in. Clusters 0 and 1 are never free.
+static size_t free_run_start(size_t c)
+{
+    size_t w = c / 64;
+    uint64_t bits = c % 64 ? ~free_bitmap[w] & (~0ULL >> (64 - c % 64)) : 0;
+
+    while(bits == 0 && w > 0)
+        bits = ~free_bitmap[--w];
+    return bits ? w * 64 + 64 - __builtin_clzll(bits) : 0;
+}
+
+static void take_bits(size_t start, size_t count)
+{
+    size_t c;
+
+    for(c = start ; c < start + count ; c++)
+        free_bitmap[c / 64] &= ~(1ULL << (c % 64));
+    free_count -= count;
+}
+
+/*
+ * Free runs sorted into buckets by size, bucket b holds the runs of
+ * 2^b .. 2^(b+1)-1 clusters. Entries are not updated in place: every
+ * change to the bitmap pushes the run it created, and an entry that no
+ * longer matches the bitmap is dropped when a search comes across it.
+ * The index is rebuilt from the bitmap once stale entries pile up.
+ */
+struct free_run {
+    uint32_t start;
+    uint32_t length;
+};
+
+static struct {
+    struct free_run* runs;
+    size_t count;
+    size_t alloc;
+} run_bucket[32];
+static size_t run_entries;
+static size_t run_rebuild_at;       // 0 until the index is built
+
+static inline int bucket_of(uint32_t length)
+{
+    return 31 - __builtin_clz(length);
+}
+
+static void run_push(uint32_t start, uint32_t length)
+{
+    int b = bucket_of(length);
+
+    if(run_bucket[b].count == run_bucket[b].alloc) {
+        run_bucket[b].alloc = run_bucket[b].alloc ? run_bucket[b].alloc * 2 : 64;
+        run_bucket[b].runs = realloc(run_bucket[b].runs, run_bucket[b].alloc * sizeof(struct free_run));
+        if(run_bucket[b].runs == NULL)
+            err(1, "realloc(free runs)");
+    }
+    run_bucket[b].runs[run_bucket[b].count++] = (struct free_run) { start, length };
+    run_entries++;
+}
+
+static void run_remove(int b, size_t i)
+{
+    run_bucket[b].runs[i] = run_bucket[b].runs[--run_bucket[b].count];
+    run_entries--;
+}
+
+// Does the entry still describe a whole free run?
+static int run_valid(const struct free_run* r)
+{
+    return is_free(r->start) && !is_free(r->start - 1) &&
+           used_search(r->start, r->start + r->length + 1) == r->start + r->length;
+}
+
+static void run_index_build(void)
+{
+    size_t start, end;
+    int b;
+
+    for(b = 0 ; b < 32 ; b++)
+        run_bucket[b].count = 0;
+    run_entries = 0;
+    for(start = free_search(2, free_end) ; start != 0 ; start = free_search(end, free_end)) {
+        end = used_search(start, free_end);
+        run_push(start, end - start);
+    }
+    run_rebuild_at = run_entries * 2 + 1024;
+}
+
+// Pushes the run the free cluster c belongs to after it changed
+static void run_changed(size_t c)
+{
+    size_t start = free_run_start(c);
+
+    run_push(start, used_search(c, free_end) - start);
+    if(run_entries > run_rebuild_at)
+        run_index_build();
+}
+
+/**
+ * Takes the first run of at least want clusters out of the index,
+ * looking at the smaller buckets first
+ * @returns 1 if one was found
+ */
+static int run_take(uint32_t want, struct free_run* out)
+{
+    size_t i;
+    int b;
+
+    for(b = bucket_of(want) ; b < 32 ; b++) {
+        for(i = 0 ; i < run_bucket[b].count ; ) {
+            struct free_run r = run_bucket[b].runs[i];
+
+            if(!run_valid(&r)) {
+                run_remove(b, i);
+                continue;
+            }
+            if(r.length >= want) {
+                run_remove(b, i);
+                *out = r;
+                return 1;
+            }
+            i++;
+        }
+    }
+    return 0;
+}
+
+// Takes the longest run out of the index, for when none is long enough
+static int run_take_largest(struct free_run* out)
+{
+    size_t i, best;
+    int b;
+
+    for(b = 31 ; b >= 0 ; b--) {
+        best = run_bucket[b].count;
+        for(i = 0 ; i < run_bucket[b].count ; ) {
+            if(!run_valid(&run_bucket[b].runs[i])) {
+                run_remove(b, i);
+                continue;
+            }
+            if(best == run_bucket[b].count || run_bucket[b].runs[i].length > run_bucket[b].runs[best].length)
+                best = i;
+            i++;
+        }
+        if(best < run_bucket[b].count) {
+            *out = run_bucket[b].runs[best];
+            run_remove(b, best);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Clusters set aside for the next allocation of one file, so that it
+ * goes on where the file ends. They are out of the bitmap but still
+ * free in the FAT and count as free.
+ */
+static struct {
+    uint64_t owner;
+    uint32_t start;
+    uint32_t count;
+    unsigned long stamp;
+} reserve[VFAT_RESERVE_SLOTS];
+static unsigned long reserve_clock;
+
+// Called with free_lock held
+static void release_bits(size_t start, size_t count)
+{
+    size_t c;
+
+    if(start < 2 || start >= free_end)
+        return;
+    if(start + count > free_end)
+        count = free_end - start;
+    for(c = start ; c < start + count ; c++) {
+        if(!is_free(c)) {
+            free_bitmap[c / 64] |= 1ULL << (c % 64);
+            free_count++;
+        }
+    }
+    if(count > 0 && run_rebuild_at != 0)
+        run_changed(start);
+}
+
+static void reserve_drop(int i)
+{
+    reserved -= reserve[i].count;
+    release_bits(reserve[i].start, reserve[i].count);
+    reserve[i].owner = 0;
+    reserve[i].count = 0;
+}
+
+static int reserve_find(uint64_t owner)
+{
+    int i;
+
+    for(i = 0 ; owner != 0 && i < VFAT_RESERVE_SLOTS ; i++) {
+        if(reserve[i].owner == owner)
+            return i;
+    }
+    return -1;
+}
+
+// Hands count clusters taken out of the bitmap at start to owner
+static void reserve_set(uint64_t owner, uint32_t start, uint32_t count)
+{
+    int i, slot = reserve_find(owner);
+
+    if(slot < 0) {
+        for(slot = 0, i = 1 ; i < VFAT_RESERVE_SLOTS && reserve[slot].owner != 0 ; i++) {
+            if(reserve[i].owner == 0 || reserve[i].stamp < reserve[slot].stamp)
+                slot = i;
+        }
+    }
+    if(reserve[slot].owner != 0)
+        reserve_drop(slot);
+    reserve[slot].owner = owner;
+    reserve[slot].start = start;
+    reserve[slot].count = count;
+    reserve[slot].stamp = ++reserve_clock;
+    reserved += count;
+}
+
+static void index_prepare(void)
+{
+    free_bitmap_build();
+    if(run_rebuild_at == 0)
+        run_index_build();
+}
+
+/**
+ * Finds room for up to want clusters: the free run at goal if there is
+ * one (goal 0 for none), otherwise the smallest run that holds want, then
+ * need, then the longest run there is. Called with free_lock held.
+ * @returns 1 if a run was found, it is out of the index but still free
+ */
+static int run_find(uint32_t goal, uint32_t want, uint32_t need, struct free_run* r)
+{
+    int i;
+
+    for(;;) {
+        if(goal >= 2 && goal < free_end && is_free(goal)) {
+            r->start = goal;
+            r->length = used_search(goal, (size_t) goal + want) - goal;
+            return 1;
+        }
+        if(run_take(want, r) || (need < want && run_take(need, r)) || run_take_largest(r))
+            return 1;
+        if(reserved == 0)
+            return 0;
+        // the volume is full, the reservations are given up first
+        for(i = 0 ; i < VFAT_RESERVE_SLOTS ; i++) {
+            if(reserve[i].owner != 0)
+                reserve_drop(i);
+        }
+    }
+}
+
+/**
+ * Allocates up to need contiguous clusters for owner's chain, the caller
+ * links them into the FAT. Clusters the owner reserved right at goal (or
+ * anywhere if its chain is still empty) come first. Otherwise the chain
+ * goes on in place at goal, or moves to the smallest free run that
+ * holds need + extra clusters, the extra ones stay reserved for owner.
+ * @owner identifies the file, 0 takes no reservation
+ * @got gets the number of clusters allocated
+ * @returns the first cluster, 0 if the volume is full
+ */
+uint32_t vfat_alloc_run(uint64_t owner, uint32_t goal, uint32_t need, uint32_t extra, uint32_t* got)
+{
+    struct free_run r;
+    uint32_t start = 0, take;
+    int i;
+
+    *got = 0;
+    if(need == 0)
+        return 0;
+    pthread_mutex_lock(&free_lock);
+    index_prepare();
+    i = reserve_find(owner);
+    if(i >= 0 && (goal == 0 || goal == reserve[i].start)) {
+        start = reserve[i].start;
+        *got = need < reserve[i].count ? need : reserve[i].count;
+        reserve[i].start += *got;
+        reserve[i].count -= *got;
+        reserved -= *got;
+        if(reserve[i].count == 0)
+            reserve[i].owner = 0;
+    } else {
+        if(i >= 0)
+            reserve_drop(i);
+        if(owner == 0)
+            extra = 0;
+        if(run_find(goal, need + extra, need, &r)) {
+            take = r.length < need + extra ? r.length : need + extra;
+            take_bits(r.start, take);
+            if(is_free(r.start + take))
+                run_changed(r.start + take);
+            start = r.start;
+            *got = take < need ? take : need;
+            if(take > *got)
+                reserve_set(owner, start + *got, take - *got);
+        }
+    }
+    if(start != 0)
+        vfat_info.fsinfo_next_free = start + *got < free_end ? start + *got : 2;
+    pthread_mutex_unlock(&free_lock);
+    return start;
+}
+
+/**
+ * Sets count contiguous clusters aside for owner's chain, which ends
+ * right before goal (goal 0 for an empty chain). A reservation that is
+ * already in place and big enough is kept.
+ * @returns the number of clusters reserved
+ */
+uint32_t vfat_alloc_reserve(uint64_t owner, uint32_t goal, uint32_t count)
+{
+    struct free_run r;
+    uint32_t ret = 0;
+    int i;
+
+    if(owner == 0 || count == 0)
+        return 0;
+    pthread_mutex_lock(&free_lock);
+    index_prepare();
+    i = reserve_find(owner);
+    if(i >= 0 && (goal == 0 || goal == reserve[i].start) && reserve[i].count >= count) {
+        ret = reserve[i].count;
+    } else {
+        if(i >= 0)
+            reserve_drop(i);
+        if(run_find(goal, count, count, &r)) {
+            ret = r.length < count ? r.length : count;
+            take_bits(r.start, ret);
+            if(is_free(r.start + ret))
+                run_changed(r.start + ret);
+            reserve_set(owner, r.start, ret);
+        }
+    }
+    pthread_mutex_unlock(&free_lock);
+    return ret;
+}
+
+// Gives up what owner has reserved, once it is done growing
+void vfat_alloc_unreserve(uint64_t owner)
+{
+    int i;
+
+    pthread_mutex_lock(&free_lock);
+    i = reserve_find(owner);
+    if(i >= 0)
+        reserve_drop(i);
+    pthread_mutex_unlock(&free_lock);
+}
+
+// Returns count clusters from start on, whose FAT entries were zeroed, to the free space
+void vfat_release_run(uint32_t start, uint32_t count)
+{
+    pthread_mutex_lock(&free_lock);
+    free_bitmap_build();
+    release_bits(start, count);
+    pthread_mutex_unlock(&free_lock);
+}
@@ -0,0 +1,21 @@
+#ifndef H_FREESPACE
+#define H_FREESPACE
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Files growing at the same time each reserve room behind their end
+#define VFAT_RESERVE_SLOTS      64
+// A growing file reserves as much again as it has, up to this many bytes
+#define VFAT_RESERVE_MAX        (16 * 1024 * 1024)
+// Files up to this size still in the cache are moved to one run when closed
+#define VFAT_SETTLE_MAX         (64 * 1024 * 1024)
+
+size_t vfat_free_clusters(void);
+int vfat_cluster_is_free(uint32_t cluster_num);
+uint32_t vfat_alloc_run(uint64_t owner, uint32_t goal, uint32_t need, uint32_t extra, uint32_t* got);
+uint32_t vfat_alloc_reserve(uint64_t owner, uint32_t goal, uint32_t count);
+void vfat_alloc_unreserve(uint64_t owner);
+void vfat_release_run(uint32_t start, uint32_t count);
+
+#endif
@@ -0,0 +1,136 @@
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "vfat.h"
+#include "io.h"
+#include "uring.h"
+#include "dev.h"
+#include "stats.h"
+
+// Gap bytes land here, its contents are never looked at. Per thread so
+// concurrent readers do not scribble over the same memory.
+static __thread char io_discard[VFAT_IO_GAP_MAX];
+
+// What a device read covers besides its iovecs
+struct io_run {
+    size_t want;                // bytes that go to the callers' buffers
+    size_t gaps;                // bytes thrown away between them
+};
+
+// Segments that follow each other on disk, directly or after a small hole,
+// become one run scattering into the callers' buffers
+static size_t io_runs(const struct vfat_io_seg* segs, size_t count, struct iovec* iov,
+                      struct vfat_uring_read* rds, struct io_run* runs)
+{
+    size_t i = 0, nruns = 0;
+
+    while(i < count) {
+        struct vfat_uring_read* rd = &rds[nruns];
+        struct io_run* run = &runs[nruns++];
+        off_t end = segs[i].dev_offset;
+
+        rd->offset = end;
+        rd->iov = iov;
+        rd->niov = 0;
+        run->want = run->gaps = 0;
+        // grow the run while the next segment starts at or shortly after end
+        do {
+            off_t hole = segs[i].dev_offset - end;
+            if(rd->niov > 0 && hole > 0) {
+                iov->iov_base = io_discard;
+                iov->iov_len = hole;
+                iov++;
+                rd->niov++;
+                run->gaps += hole;
+            }
+            iov->iov_base = segs[i].buf;
+            iov->iov_len = segs[i].len;
+            iov++;
+            rd->niov++;
+            run->want += segs[i].len;
+            end = segs[i].dev_offset + segs[i].len;
+            i++;
+        } while(i < count && rd->niov + 2 <= IOV_MAX &&
+                segs[i].dev_offset >= end && segs[i].dev_offset - end <= VFAT_IO_GAP_MAX);
+    }
+    return nruns;
+}
+
+static ssize_t io_read(const struct vfat_uring_read* rd)
+{
+    if(rd->niov == 1)
+        return vfat_dev_read(rd->iov[0].iov_base, rd->iov[0].iov_len, rd->offset);
+    return vfat_dev_readv(rd->iov, rd->niov, rd->offset);
+}
+
+/**
+ * Reads a list of device ranges in as few syscalls as possible. Segments that
+ * follow each other on disk, directly or after a small hole, are read by a
+ * single preadv() scattering into the callers' buffers. When that leaves more
+ * than one read, they all go to io_uring at once and complete in parallel.
+ * @returns bytes stored into the segment buffers, stops at the first short read
+ *          -1 if nothing could be read
+ */
+ssize_t vfat_read_segments(const struct vfat_io_seg* segs, size_t count)
+{
+    struct iovec* iov;
+    struct vfat_uring_read* rds;
+    struct io_run* runs;
+    size_t nruns, i, k;
+    ssize_t done = 0;
+    int batched = 0;
+
+    if(count == 0)
+        return 0;
+    // a segment and the hole before it take two iovecs at most
+    iov = malloc(2 * count * sizeof(struct iovec));
+    rds = malloc(count * sizeof(struct vfat_uring_read));
+    runs = malloc(count * sizeof(struct io_run));
+    if(iov == NULL || rds == NULL || runs == NULL) {
+        done = -1;
+        goto out;
+    }
+    nruns = io_runs(segs, count, iov, rds, runs);
+    // the other backends do not issue syscalls io_uring could take over
+    if(nruns > 1 && vfat_info.backend == VFAT_BACKEND_PREAD &&
+       vfat_uring_readv(vfat_info.fd, rds, nruns) == 0) {
+        batched = 1;
+        vfat_count(VFAT_CNT_URING_BATCHES, 1);
+    }
+
+    for(i = 0 ; i < nruns ; i++) {
+        const struct vfat_uring_read* rd = &rds[i];
+        struct io_run* run = &runs[i];
+        ssize_t ret = batched ? rd->res : io_read(rd);
+
+        if(ret < 0) {
+            if(done == 0)
+                done = -1;
+            break;
+        }
+        vfat_count(VFAT_CNT_DEV_READS, 1);
+        vfat_count(VFAT_CNT_DEV_READ_BYTES, ret);
+        if((size_t) ret != run->want + run->gaps) {
+            // short read, count only what reached the callers' buffers
+            for(k = 0 ; k < rd->niov && ret > 0 ; k++) {
+                size_t n = (size_t) ret < rd->iov[k].iov_len ? (size_t) ret : rd->iov[k].iov_len;
+                if(rd->iov[k].iov_base != io_discard)
+                    done += n;
+                ret -= n;
+            }
+            break;
+        }
+        done += run->want;
+    }
+out:
+    free(iov);
+    free(rds);
+    free(runs);
+    return done;
+}
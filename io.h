@@ -0,0 +1,20 @@
+#ifndef H_IO
+#define H_IO
+
+#include <stddef.h>
+#include <sys/types.h>
+
+// One device range to be read into buf
+struct vfat_io_seg {
+    off_t   dev_offset;
+    size_t  len;
+    char*   buf;
+};
+
+// Holes up to this size between two segments are read and thrown away,
+// one bigger read is cheaper than another syscall
+#define VFAT_IO_GAP_MAX (64 * 1024)
+
+ssize_t vfat_read_segments(const struct vfat_io_seg* segs, size_t count);
+
+#endif
@@ -0,0 +1,436 @@
+// End-to-end load generator: clients hammer a mounted file system through
+// plain system calls and report throughput and latency percentiles per
+// operation class, one JSON line each. It can mount the image itself with
+// the vfat binary, so all it needs is /dev/fuse.
+#define _GNU_SOURCE
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <dirent.h>
+#include <err.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LOAD_MAX_CLIENTS    256
+#define LOAD_SEQ_CHUNK      (128 * 1024)
+#define LOAD_RAND_SIZE      4096
+// Random reads switch to another file after this many reads
+#define LOAD_RAND_PER_FILE  16
+// Latency buckets: exact below 16 ns, then 16 per power of two
+#define LOAD_SUB_BITS       4
+#define LOAD_BUCKETS        (64 << LOAD_SUB_BITS)
+
+enum load_class {
+    LOAD_STAT,      // lstat of a random file or directory
+    LOAD_LS,        // ls -lR of a random directory
+    LOAD_SEQ,       // a random file read start to end
+    LOAD_RAND,      // 4 KB read at a random offset
+    LOAD_CLASSES
+};
+
+static const char* const class_names[LOAD_CLASSES] = { "stat", "ls", "seq", "rand" };
+
+struct load_stats {
+    uint64_t ops;
+    uint64_t errors;
+    uint64_t bytes;
+    uint64_t max_ns;
+    uint64_t hist[LOAD_BUCKETS];
+};
+
+struct load_client {
+    pthread_t thread;
+    uint64_t rnd;
+    struct load_stats stats[LOAD_CLASSES];
+};
+
+struct load_node {
+    char* path;
+    off_t size;
+};
+
+static struct load_node* files;
+static size_t nfiles, files_cap;
+static struct load_node* dirs;
+static size_t ndirs, dirs_cap;
+static unsigned int weights[LOAD_CLASSES] = { 40, 10, 20, 30 };
+static unsigned int weight_sum;
+static volatile int stop;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static uint64_t rnd(uint64_t* state)
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1DULL;
+}
+
+static size_t bucket_of(uint64_t ns)
+{
+    int e;
+
+    if(ns < (1 << LOAD_SUB_BITS))
+        return ns;
+    e = 63 - __builtin_clzll(ns);
+    return ((e - LOAD_SUB_BITS + 1) << LOAD_SUB_BITS) + ((ns >> (e - LOAD_SUB_BITS)) & ((1 << LOAD_SUB_BITS) - 1));
+}
+
+// Middle of a bucket, in ns
+static double bucket_value(size_t b)
+{
+    size_t e = (b >> LOAD_SUB_BITS) + LOAD_SUB_BITS - 1;
+    double low, width;
+
+    if(b < (1 << LOAD_SUB_BITS))
+        return b;
+    width = (double)(1ULL << (e - LOAD_SUB_BITS));
+    low = (double)(1ULL << e) + (b & ((1 << LOAD_SUB_BITS) - 1)) * width;
+    return low + width / 2;
+}
+
+static double percentile(const struct load_stats* s, double q)
+{
+    uint64_t want = (uint64_t)(q * s->ops), seen = 0;
+    size_t b;
+
+    for(b = 0 ; b < LOAD_BUCKETS ; b++) {
+        seen += s->hist[b];
+        if(seen > want)
+            return bucket_value(b);
+    }
+    return s->max_ns;
+}
+
+static void record(struct load_stats* s, uint64_t start, int ok, uint64_t bytes)
+{
+    uint64_t ns = now_ns() - start;
+
+    s->ops++;
+    s->bytes += bytes;
+    if(!ok)
+        s->errors++;
+    if(ns > s->max_ns)
+        s->max_ns = ns;
+    s->hist[bucket_of(ns)]++;
+}
+
+static void add_node(struct load_node** nodes, size_t* count, size_t* cap, const char* path, off_t size)
+{
+    if(*count == *cap) {
+        *cap = *cap ? *cap * 2 : 256;
+        *nodes = realloc(*nodes, *cap * sizeof(struct load_node));
+        if(*nodes == NULL)
+            err(1, "realloc(nodes)");
+    }
+    (*nodes)[*count].path = strdup(path);
+    (*nodes)[*count].size = size;
+    if((*nodes)[*count].path == NULL)
+        err(1, "strdup");
+    (*count)++;
+}
+
+/**
+ * ls -lR: lists dir and stats every entry, then descends
+ * @collect also remembers every file and directory seen
+ * @returns 0 if everything could be listed and stat'ed
+ */
+static int walk(const char* dir, int collect)
+{
+    char path[PATH_MAX];
+    struct dirent* de;
+    struct stat st;
+    DIR* d = opendir(dir);
+    int ret = 0;
+
+    if(d == NULL)
+        return -1;
+    while((de = readdir(d)) != NULL) {
+        if(strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+        if(fstatat(dirfd(d), de->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+            ret = -1;
+            continue;
+        }
+        if(S_ISDIR(st.st_mode)) {
+            if(collect)
+                add_node(&dirs, &ndirs, &dirs_cap, path, 0);
+            if(walk(path, collect) != 0)
+                ret = -1;
+        } else if(S_ISREG(st.st_mode) && collect) {
+            add_node(&files, &nfiles, &files_cap, path, st.st_size);
+        }
+    }
+    closedir(d);
+    return ret;
+}
+
+static void* client(void* arg)
+{
+    struct load_client* c = arg;
+    char* buf = malloc(LOAD_SEQ_CHUNK);
+    struct load_node* f;
+    struct stat st;
+    uint64_t start, bytes;
+    unsigned int pick, k;
+    int fd, rfd = -1, rleft = 0, ok;
+    off_t offs, rsize = 0;
+    ssize_t n;
+
+    if(buf == NULL)
+        err(1, "malloc");
+    while(!stop) {
+        pick = rnd(&c->rnd) % weight_sum;
+        for(k = 0 ; pick >= weights[k] ; k++)
+            pick -= weights[k];
+
+        bytes = 0;
+        switch(k) {
+        case LOAD_STAT:
+            pick = rnd(&c->rnd) % (nfiles + ndirs);
+            start = now_ns();
+            ok = lstat(pick < nfiles ? files[pick].path : dirs[pick - nfiles].path, &st) == 0;
+            break;
+        case LOAD_LS:
+            start = now_ns();
+            ok = walk(dirs[rnd(&c->rnd) % ndirs].path, 0) == 0;
+            break;
+        case LOAD_SEQ:
+            f = &files[rnd(&c->rnd) % nfiles];
+            start = now_ns();
+            fd = open(f->path, O_RDONLY);
+            ok = fd >= 0;
+            while(ok && (n = read(fd, buf, LOAD_SEQ_CHUNK)) != 0) {
+                if(n < 0)
+                    ok = 0;
+                else
+                    bytes += n;
+            }
+            if(fd >= 0)
+                close(fd);
+            break;
+        default:
+            // the file is opened outside the timed part
+            if(rleft-- <= 0) {
+                if(rfd >= 0)
+                    close(rfd);
+                do {
+                    f = &files[rnd(&c->rnd) % nfiles];
+                } while(f->size < LOAD_RAND_SIZE);
+                rfd = open(f->path, O_RDONLY);
+                rleft = LOAD_RAND_PER_FILE - 1;
+                rsize = f->size;
+            }
+            offs = (rnd(&c->rnd) % (rsize / LOAD_RAND_SIZE)) * LOAD_RAND_SIZE;
+            start = now_ns();
+            n = rfd >= 0 ? pread(rfd, buf, LOAD_RAND_SIZE, offs) : -1;
+            ok = n == LOAD_RAND_SIZE;
+            bytes = n > 0 ? n : 0;
+            break;
+        }
+        record(&c->stats[k], start, ok, bytes);
+    }
+    if(rfd >= 0)
+        close(rfd);
+    free(buf);
+    return NULL;
+}
+
+static int is_mounted(const char* mnt, dev_t parent_dev)
+{
+    struct stat st;
+
+    return stat(mnt, &st) == 0 && st.st_dev != parent_dev;
+}
+
+// Starts vfat in the foreground on mnt and waits until the mount shows up
+static pid_t mount_image(const char* vfat, const char* image, const char* mnt,
+                         int single, const char* opts)
+{
+    char parent[PATH_MAX];
+    const char* args[8];
+    struct stat st;
+    pid_t pid;
+    int i, n = 0;
+
+    snprintf(parent, sizeof(parent), "%s/..", mnt);
+    if(stat(parent, &st) != 0)
+        err(1, "stat(%s)", parent);
+    pid = fork();
+    if(pid < 0)
+        err(1, "fork");
+    if(pid == 0) {
+        // vfat_init() reports the geometry on stdout, keep it out of the results
+        if(freopen("/dev/null", "w", stdout) == NULL)
+            err(1, "freopen");
+        args[n++] = vfat;
+        args[n++] = image;
+        args[n++] = mnt;
+        args[n++] = "-f";
+        if(single)
+            args[n++] = "-s";
+        if(opts != NULL) {
+            args[n++] = "-o";
+            args[n++] = opts;
+        }
+        args[n] = NULL;
+        execv(vfat, (char* const*) args);
+        err(1, "exec %s", vfat);
+    }
+    for(i = 0 ; i < 1000 ; i++) {
+        if(is_mounted(mnt, st.st_dev))
+            return pid;
+        if(waitpid(pid, NULL, WNOHANG) == pid)
+            errx(1, "%s exited before mounting %s", vfat, mnt);
+        usleep(10000);
+    }
+    kill(pid, SIGTERM);
+    errx(1, "%s did not mount %s", vfat, mnt);
+}
+
+static void unmount_image(const char* mnt, pid_t pid)
+{
+    pid_t um = fork();
+
+    if(um == 0) {
+        execlp("fusermount", "fusermount", "-u", mnt, (char*) NULL);
+        err(1, "exec fusermount");
+    }
+    if(um > 0)
+        waitpid(um, NULL, 0);
+    waitpid(pid, NULL, 0);
+}
+
+// -m stat=40,ls=10,seq=20,rand=30, classes left out get no load
+static void parse_mix(char* mix)
+{
+    char *tok, *saveptr, *eq;
+    int k;
+
+    memset(weights, 0, sizeof(weights));
+    for(tok = strtok_r(mix, ",", &saveptr) ; tok != NULL ; tok = strtok_r(NULL, ",", &saveptr)) {
+        eq = strchr(tok, '=');
+        if(eq == NULL)
+            errx(1, "bad mix entry %s", tok);
+        *eq = '\0';
+        for(k = 0 ; k < LOAD_CLASSES && strcmp(tok, class_names[k]) != 0 ; k++)
+            ;
+        if(k == LOAD_CLASSES)
+            errx(1, "unknown operation class %s", tok);
+        weights[k] = strtoul(eq + 1, NULL, 0);
+    }
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+        "usage: loadgen [-c clients] [-t seconds] [-m stat=N,ls=N,seq=N,rand=N]\n"
+        "               [-i image [-b vfat_binary] [-s] [-o mount_options]] mountpoint\n");
+    exit(1);
+}
+
+int main(int argc, char** argv)
+{
+    static struct load_client clients[LOAD_MAX_CLIENTS];
+    const char *image = NULL, *vfat = "./vfat", *opts = NULL, *mnt;
+    struct load_stats total;
+    unsigned int nclients = 4, i, k;
+    double seconds = 10, elapsed;
+    uint64_t start;
+    size_t b;
+    pid_t pid = -1;
+    int ch, single = 0;
+
+    while((ch = getopt(argc, argv, "c:t:m:i:b:so:")) != -1) {
+        switch(ch) {
+        case 'c': nclients = strtoul(optarg, NULL, 0); break;
+        case 't': seconds = strtod(optarg, NULL); break;
+        case 'm': parse_mix(optarg); break;
+        case 'i': image = optarg; break;
+        case 'b': vfat = optarg; break;
+        case 's': single = 1; break;
+        case 'o': opts = optarg; break;
+        default: usage();
+        }
+    }
+    if(optind != argc - 1 || nclients == 0 || nclients > LOAD_MAX_CLIENTS)
+        usage();
+    mnt = argv[optind];
+    for(k = 0, weight_sum = 0 ; k < LOAD_CLASSES ; k++)
+        weight_sum += weights[k];
+    if(weight_sum == 0)
+        errx(1, "the mix has no operations");
+
+    if(image != NULL)
+        pid = mount_image(vfat, image, mnt, single, opts);
+    add_node(&dirs, &ndirs, &dirs_cap, mnt, 0);
+    walk(mnt, 1);
+    if(nfiles == 0 && (weights[LOAD_SEQ] || weights[LOAD_RAND]))
+        errx(1, "no files under %s", mnt);
+    for(i = 0 ; i < nfiles && weights[LOAD_RAND] ; i++) {
+        if(files[i].size >= LOAD_RAND_SIZE)
+            break;
+    }
+    if(weights[LOAD_RAND] && i == nfiles)
+        errx(1, "no file under %s is large enough for random reads", mnt);
+
+    printf("{\"mount\":\"%s\",\"image\":\"%s\",\"fuse\":\"%s\",\"clients\":%u,\"seconds\":%.1f,\"dirs\":%zu,\"files\":%zu}\n",
+           mnt, image ? image : "", image ? (single ? "single" : "multi") : "", nclients, seconds, ndirs, nfiles);
+    fflush(stdout);
+
+    stop = 0;
+    start = now_ns();
+    for(i = 0 ; i < nclients ; i++) {
+        clients[i].rnd = 0x9E3779B97F4A7C15ULL * (i + 1);
+        if(pthread_create(&clients[i].thread, NULL, client, &clients[i]) != 0)
+            err(1, "pthread_create");
+    }
+    usleep((useconds_t)(seconds * 1e6));
+    stop = 1;
+    for(i = 0 ; i < nclients ; i++)
+        pthread_join(clients[i].thread, NULL);
+    elapsed = (now_ns() - start) / 1e9;
+
+    for(k = 0 ; k < LOAD_CLASSES ; k++) {
+        memset(&total, 0, sizeof(total));
+        for(i = 0 ; i < nclients ; i++) {
+            struct load_stats* s = &clients[i].stats[k];
+
+            total.ops += s->ops;
+            total.errors += s->errors;
+            total.bytes += s->bytes;
+            if(s->max_ns > total.max_ns)
+                total.max_ns = s->max_ns;
+            for(b = 0 ; b < LOAD_BUCKETS ; b++)
+                total.hist[b] += s->hist[b];
+        }
+        if(total.ops == 0)
+            continue;
+        printf("{\"op\":\"%s\",\"ops\":%llu,\"errors\":%llu,\"ops_per_sec\":%.1f,\"mb_per_sec\":%.1f,"
+               "\"p50_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f,\"max_us\":%.1f}\n",
+               class_names[k], (unsigned long long) total.ops, (unsigned long long) total.errors,
+               total.ops / elapsed, total.bytes / elapsed / (1024 * 1024),
+               percentile(&total, 0.5) / 1e3, percentile(&total, 0.99) / 1e3,
+               percentile(&total, 0.999) / 1e3, total.max_ns / 1e3);
+    }
+
+    if(pid > 0)
+        unmount_image(mnt, pid);
+    return 0;
+}
@@ -0,0 +1,357 @@
+// Builds a deterministic FAT32 image for the benchmarks: the same options
+// and seed always give the same tree, names, contents and cluster layout.
+#define FUSE_USE_VERSION 26
+#include <endian.h>
+#include <err.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "vfat.h"
+
+#define BPS         512
+#define RESERVED    32
+#define NFATS       2
+#define EOC         0x0FFFFFFF
+// 1 January 2020, 12:00
+#define FIXED_DATE  ((40 << 9) | (1 << 5) | 1)
+#define FIXED_TIME  (12 << 11)
+
+static struct {
+    size_t size_mb;
+    unsigned int spc;
+    unsigned int depth;
+    unsigned int fanout;
+    unsigned int files;
+    size_t file_size;
+    unsigned int lfn_pct;
+    unsigned int frag_pct;
+    uint64_t seed;
+} opt = { 300, 8, 3, 4, 16, 32768, 50, 0, 1 };
+
+static int fd;
+static uint32_t* fat;
+static uint32_t nclusters;          // data clusters, numbered from 2
+static uint32_t used;
+static uint32_t cursor = 3;         // next cluster of contiguous allocation
+static size_t cluster_size;
+static off_t data_offset;
+static uint32_t serial;             // makes every name unique
+static uint64_t rnd_state;
+static size_t nfiles, ndirs;
+
+// xorshift64*, good enough and the same everywhere
+static uint64_t rnd(void)
+{
+    rnd_state ^= rnd_state >> 12;
+    rnd_state ^= rnd_state << 25;
+    rnd_state ^= rnd_state >> 27;
+    return rnd_state * 0x2545F4914F6CDD1DULL;
+}
+
+// Next cluster of a chain, a random one for frag_pct percent of the picks
+static uint32_t pick_cluster(void)
+{
+    uint32_t c;
+    int jump = opt.frag_pct != 0 && rnd() % 100 < opt.frag_pct;
+
+    if(used == nclusters)
+        errx(1, "image is full, use a larger -s or a smaller tree");
+    c = jump ? 2 + rnd() % nclusters : cursor;
+    for( ; ; c++) {
+        if(c >= nclusters + 2)
+            c = 2;
+        if(fat[c] == 0)
+            break;
+    }
+    if(!jump)
+        cursor = c + 1;
+    used++;
+    return c;
+}
+
+// Appends count clusters to the chain ending in last (0 for a new chain)
+static uint32_t alloc_chain(uint32_t last, size_t count)
+{
+    uint32_t first = 0, c;
+
+    while(count-- > 0) {
+        c = pick_cluster();
+        fat[c] = EOC;
+        if(last != 0)
+            fat[last] = c;
+        else
+            first = c;
+        last = c;
+    }
+    return first;
+}
+
+static off_t cluster_offset(uint32_t c)
+{
+    return data_offset + (off_t)(c - 2) * cluster_size;
+}
+
+static void write_cluster(uint32_t c, const void* buf)
+{
+    if(pwrite(fd, buf, cluster_size, cluster_offset(c)) != (ssize_t) cluster_size)
+        err(1, "write cluster %u", c);
+}
+
+static uint8_t lfn_checksum(const char* nameext)
+{
+    uint8_t sum = 0;
+    int i;
+
+    for(i = 0 ; i < 11 ; i++)
+        sum = ((sum & 1) ? 0x80 : 0) + (sum >> 1) + (uint8_t) nameext[i];
+    return sum;
+}
+
+// Directory contents being built
+struct dirbuf {
+    struct fat32_direntry* ent;
+    size_t count;
+    size_t cap;
+};
+
+static struct fat32_direntry* dir_add(struct dirbuf* d)
+{
+    if(d->count == d->cap) {
+        d->cap = d->cap ? d->cap * 2 : 64;
+        d->ent = realloc(d->ent, d->cap * sizeof(struct fat32_direntry));
+        if(d->ent == NULL)
+            err(1, "realloc(directory)");
+    }
+    memset(&d->ent[d->count], 0, sizeof(struct fat32_direntry));
+    return &d->ent[d->count++];
+}
+
+static void dir_short(struct dirbuf* d, const char* nameext, uint8_t attr, uint32_t cluster, uint32_t size)
+{
+    struct fat32_direntry* e = dir_add(d);
+
+    memcpy(e->nameext, nameext, 11);
+    e->attr = attr;
+    e->ctime_time = e->mtime_time = htole16(FIXED_TIME);
+    e->ctime_date = e->mtime_date = e->atime_date = htole16(FIXED_DATE);
+    e->cluster_hi = htole16(cluster >> 16);
+    e->cluster_lo = htole16(cluster & 0xFFFF);
+    e->size = htole32(size);
+}
+
+// LFN entries for an ASCII name, followed by its short entry
+static void dir_long(struct dirbuf* d, const char* name, const char* nameext,
+                     uint8_t attr, uint32_t cluster, uint32_t size)
+{
+    size_t len = strlen(name), n = (len + 12) / 13, k, i;
+    uint8_t csum = lfn_checksum(nameext);
+
+    for(k = n ; k > 0 ; k--) {
+        struct fat32_direntry_long* l = (struct fat32_direntry_long*) dir_add(d);
+        uint16_t units[13];
+
+        for(i = 0 ; i < 13 ; i++) {
+            size_t pos = (k - 1) * 13 + i;
+            units[i] = htole16(pos < len ? (uint8_t) name[pos] : pos == len ? 0 : 0xFFFF);
+        }
+        l->seq = k | (k == n ? VFAT_LFN_SEQ_START : 0);
+        l->attr = VFAT_ATTR_LFN;
+        l->csum = csum;
+        memcpy(l->name1, units, sizeof(l->name1));
+        memcpy(l->name2, units + 5, sizeof(l->name2));
+        memcpy(l->name3, units + 11, sizeof(l->name3));
+    }
+    dir_short(d, nameext, attr, cluster, size);
+}
+
+static void add_entry(struct dirbuf* d, int is_dir, uint32_t cluster, uint32_t size)
+{
+    char nameext[12], name[64];
+    unsigned int id = ++serial;
+
+    snprintf(nameext, sizeof(nameext), "%c%07u%s", is_dir ? 'D' : 'F', id, is_dir ? "   " : "DAT");
+    if(rnd() % 100 < opt.lfn_pct) {
+        snprintf(name, sizeof(name), is_dir ? "directory number %u" : "benchmark file number %u.dat", id);
+        dir_long(d, name, nameext, is_dir ? ATTR_DIRECTORY : ATTR_ARCHIVE, cluster, size);
+    } else {
+        dir_short(d, nameext, is_dir ? ATTR_DIRECTORY : ATTR_ARCHIVE, cluster, size);
+    }
+}
+
+// A file of file_size bytes, its contents derived from its first cluster
+static uint32_t make_file(char* buf)
+{
+    size_t n = (opt.file_size + cluster_size - 1) / cluster_size, i, j;
+    uint32_t first, c;
+
+    if(n == 0)
+        return 0;
+    first = alloc_chain(0, n);
+    for(i = 0, c = first ; i < n ; i++, c = fat[c]) {
+        for(j = 0 ; j < cluster_size / 8 ; j++)
+            ((uint64_t*) buf)[j] = (first * 0x9E3779B97F4A7C15ULL) ^ (i * cluster_size + j * 8);
+        if(i == n - 1 && opt.file_size % cluster_size != 0)
+            memset(buf + opt.file_size % cluster_size, 0, cluster_size - opt.file_size % cluster_size);
+        write_cluster(c, buf);
+    }
+    nfiles++;
+    return first;
+}
+
+// Fills directory self (its first cluster already allocated) and its subtree
+static void make_dir(uint32_t self, uint32_t parent, unsigned int depth, char* buf)
+{
+    struct dirbuf d = { NULL, 0, 0 };
+    uint32_t c, last;
+    unsigned int i;
+    size_t need, have, k;
+
+    if(self == 2) {
+        dir_short(&d, "BENCH      ", ATTR_VOLUME_ID, 0, 0);
+    } else {
+        dir_short(&d, ".          ", ATTR_DIRECTORY, self, 0);
+        // ".." of a top level directory points to cluster 0
+        dir_short(&d, "..         ", ATTR_DIRECTORY, parent == 2 ? 0 : parent, 0);
+    }
+    for(i = 0 ; i < opt.files ; i++)
+        add_entry(&d, 0, make_file(buf), opt.file_size);
+    for(i = 0 ; depth < opt.depth && i < opt.fanout ; i++) {
+        c = alloc_chain(0, 1);
+        add_entry(&d, 1, c, 0);
+        make_dir(c, self, depth + 1, buf);
+    }
+    ndirs++;
+
+    // Grow the chain to fit, then write it out
+    need = (d.count * sizeof(struct fat32_direntry) + cluster_size - 1) / cluster_size;
+    for(have = 1, last = self ; have < need ; have++) {
+        alloc_chain(last, 1);
+        last = fat[last];
+    }
+    for(k = 0, c = self ; k < need ; k++, c = fat[c]) {
+        size_t off = k * cluster_size, len = d.count * sizeof(struct fat32_direntry) - off;
+
+        if(len > cluster_size)
+            len = cluster_size;
+        memset(buf, 0, cluster_size);
+        memcpy(buf, (char*) d.ent + off, len);
+        write_cluster(c, buf);
+    }
+    free(d.ent);
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+        "usage: mkfatimg [-s size_mb] [-c sectors_per_cluster] [-d depth] [-f fanout]\n"
+        "                [-n files_per_dir] [-z file_size] [-l lfn_percent]\n"
+        "                [-F fragmentation_percent] [-S seed] image\n");
+    exit(1);
+}
+
+int main(int argc, char** argv)
+{
+    struct fat_boot_header bs;
+    struct fat_fsinfo fsi;
+    uint32_t total, spf, k;
+    char* buf;
+    int ch;
+
+    while((ch = getopt(argc, argv, "s:c:d:f:n:z:l:F:S:")) != -1) {
+        switch(ch) {
+        case 's': opt.size_mb = strtoul(optarg, NULL, 0); break;
+        case 'c': opt.spc = strtoul(optarg, NULL, 0); break;
+        case 'd': opt.depth = strtoul(optarg, NULL, 0); break;
+        case 'f': opt.fanout = strtoul(optarg, NULL, 0); break;
+        case 'n': opt.files = strtoul(optarg, NULL, 0); break;
+        case 'z': opt.file_size = strtoul(optarg, NULL, 0); break;
+        case 'l': opt.lfn_pct = strtoul(optarg, NULL, 0); break;
+        case 'F': opt.frag_pct = strtoul(optarg, NULL, 0); break;
+        case 'S': opt.seed = strtoull(optarg, NULL, 0); break;
+        default: usage();
+        }
+    }
+    if(optind != argc - 1)
+        usage();
+    if(opt.spc == 0 || (opt.spc & (opt.spc - 1)) != 0 || opt.spc * BPS > VFAT_MAX_CLUSTER_SIZE)
+        errx(1, "sectors per cluster must be a power of two up to %d", VFAT_MAX_CLUSTER_SIZE / BPS);
+    rnd_state = opt.seed * 0x9E3779B97F4A7C15ULL + 1;
+
+    // Smallest FAT that covers the clusters left next to it
+    total = opt.size_mb * 1024 * 1024 / BPS;
+    for(spf = 1 ; ; spf++) {
+        nclusters = (total - RESERVED - NFATS * spf) / opt.spc;
+        if((nclusters + 2) * 4 <= spf * BPS)
+            break;
+    }
+    if(nclusters < 65525)
+        errx(1, "%u clusters is FAT16, use a larger -s or a smaller -c", nclusters);
+    cluster_size = opt.spc * BPS;
+    data_offset = (off_t)(RESERVED + NFATS * spf) * BPS;
+
+    fat = calloc(spf * BPS / 4, sizeof(uint32_t));
+    buf = malloc(cluster_size);
+    if(fat == NULL || buf == NULL)
+        err(1, "malloc");
+    fd = open(argv[optind], O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0)
+        err(1, "open(%s)", argv[optind]);
+    if(ftruncate(fd, (off_t) total * BPS) != 0)
+        err(1, "ftruncate(%s)", argv[optind]);
+
+    fat[0] = 0x0FFFFFF8;
+    fat[1] = EOC;
+    fat[2] = EOC;
+    used = 1;
+    make_dir(2, 0, 0, buf);
+
+    memset(&bs, 0, sizeof(bs));
+    memcpy(bs.jmp_boot, "\xEB\x58\x90", 3);
+    memcpy(bs.oemname, "MSWIN4.1", 8);
+    bs.bytes_per_sector = htole16(BPS);
+    bs.sectors_per_cluster = opt.spc;
+    bs.reserved_sectors = htole16(RESERVED);
+    bs.fat_count = NFATS;
+    bs.media_info = 0xF8;
+    bs.sectors_per_track = htole16(63);
+    bs.head_count = htole16(255);
+    bs.total_sectors = htole32(total);
+    bs.sectors_per_fat = htole32(spf);
+    bs.root_cluster = htole32(2);
+    bs.fsinfo_sector = htole16(1);
+    bs.backup_sector = htole16(6);
+    bs.drive_number = 0x80;
+    bs.ext_sig = 0x29;
+    bs.serial = htole32((uint32_t) opt.seed);
+    memcpy(bs.label, "BENCH      ", 11);
+    memcpy(bs.fat_name, "FAT32   ", 8);
+    bs.signature = htole16(0xAA55);
+
+    memset(&fsi, 0, sizeof(fsi));
+    fsi.lead_sig = htole32(FSINFO_LEAD_SIG);
+    fsi.struc_sig = htole32(FSINFO_STRUC_SIG);
+    fsi.free_count = htole32(nclusters - used);
+    fsi.next_free = htole32(cursor);
+    fsi.trail_sig = htole32(FSINFO_TRAIL_SIG);
+
+    for(k = 0 ; k < spf * BPS / 4 ; k++)
+        fat[k] = htole32(fat[k]);
+    if(pwrite(fd, &bs, sizeof(bs), 0) != sizeof(bs) ||
+       pwrite(fd, &fsi, sizeof(fsi), BPS) != sizeof(fsi) ||
+       pwrite(fd, &bs, sizeof(bs), 6 * BPS) != sizeof(bs))
+        err(1, "write boot sectors");
+    for(k = 0 ; k < NFATS ; k++) {
+        if(pwrite(fd, fat, spf * BPS, (off_t)(RESERVED + k * spf) * BPS) != (ssize_t) spf * BPS)
+            err(1, "write FAT");
+    }
+    if(close(fd) != 0)
+        err(1, "close(%s)", argv[optind]);
+
+    printf("%s: %u clusters of %zu bytes, %zu directories, %zu files, %u clusters used\n",
+           argv[optind], nclusters, cluster_size, ndirs, nfiles, used);
+    return 0;
+}
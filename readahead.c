@@ -0,0 +1,242 @@
+#include <sys/types.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <err.h>
+
+#include "vfat.h"
+#include "readahead.h"
+
+// Files are looked up by their first cluster, a colliding slot is replaced
+static struct vfat_readahead* ra_table[VFAT_RA_SLOTS];
+static pthread_mutex_t ra_table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Prefetch requests, served in order by a single background thread
+static struct vfat_readahead* ra_queue_head;
+static struct vfat_readahead* ra_queue_tail;
+static pthread_mutex_t ra_queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ra_queue_cond = PTHREAD_COND_INITIALIZER;
+static pthread_once_t ra_thread_once = PTHREAD_ONCE_INIT;
+
+static void ra_unref(struct vfat_readahead* ra)
+{
+    int last;
+
+    pthread_mutex_lock(&ra_table_lock);
+    last = (--ra->refs == 0);
+    pthread_mutex_unlock(&ra_table_lock);
+    if(!last)
+        return;
+    pthread_mutex_destroy(&ra->lock);
+    pthread_cond_destroy(&ra->done);
+    free(ra->buf);
+    free(ra);
+}
+
+// Background prefetcher: follows the file's extents into a fresh buffer and
+// swaps it in once complete, readers never see a half-filled buffer
+static void* ra_thread(void* unused)
+{
+    for(;;) {
+        struct vfat_readahead* ra;
+        char* buf;
+        off_t start;
+        size_t len;
+        ssize_t got;
+
+        pthread_mutex_lock(&ra_queue_lock);
+        while(ra_queue_head == NULL)
+            pthread_cond_wait(&ra_queue_cond, &ra_queue_lock);
+        ra = ra_queue_head;
+        ra_queue_head = ra->queue_next;
+        if(ra_queue_head == NULL)
+            ra_queue_tail = NULL;
+        pthread_mutex_unlock(&ra_queue_lock);
+
+        pthread_mutex_lock(&ra->lock);
+        start = ra->want_start;
+        len = ra->want_len;
+        pthread_mutex_unlock(&ra->lock);
+
+        buf = malloc(len);
+        got = buf ? vfat_read_file(ra->first_cluster, buf, len, start) : -1;
+
+        pthread_mutex_lock(&ra->lock);
+        if(got > 0) {
+            // keep the part of the old buffer the reader has not consumed yet
+            off_t keep = ra->next_offs > ra->buf_start ? ra->next_offs : ra->buf_start;
+            off_t old_end = ra->buf_start + ra->buf_len;
+            if(ra->buf != NULL && old_end == start && keep < old_end) {
+                char* joined = malloc(old_end - keep + got);
+                if(joined != NULL) {
+                    memcpy(joined, ra->buf + (keep - ra->buf_start), old_end - keep);
+                    memcpy(joined + (old_end - keep), buf, got);
+                    free(buf);
+                    buf = joined;
+                    got += old_end - keep;
+                    start = keep;
+                }
+            }
+            free(ra->buf);
+            ra->buf = buf;
+            ra->buf_start = start;
+            ra->buf_len = got;
+        } else {
+            free(buf);
+        }
+        ra->pending = 0;
+        pthread_cond_broadcast(&ra->done);
+        pthread_mutex_unlock(&ra->lock);
+        ra_unref(ra);
+    }
+    return NULL;
+}
+
+static void ra_start_thread(void)
+{
+    pthread_t tid;
+
+    if(pthread_create(&tid, NULL, ra_thread, NULL) != 0)
+        err(1, "pthread_create(readahead)");
+    pthread_detach(tid);
+}
+
+// Queues a prefetch, called with ra->lock held
+static void ra_schedule(struct vfat_readahead* ra, off_t start, size_t len)
+{
+    pthread_once(&ra_thread_once, ra_start_thread);
+
+    ra->pending = 1;
+    ra->want_start = start;
+    ra->want_len = len;
+    pthread_mutex_lock(&ra_table_lock);
+    ra->refs++;
+    pthread_mutex_unlock(&ra_table_lock);
+
+    pthread_mutex_lock(&ra_queue_lock);
+    ra->queue_next = NULL;
+    if(ra_queue_tail)
+        ra_queue_tail->queue_next = ra;
+    else
+        ra_queue_head = ra;
+    ra_queue_tail = ra;
+    pthread_cond_signal(&ra_queue_cond);
+    pthread_mutex_unlock(&ra_queue_lock);
+}
+
+// Readahead state of a file, release it with vfat_readahead_put()
+struct vfat_readahead* vfat_readahead_get(uint32_t first_cluster, off_t file_size)
+{
+    struct vfat_readahead** slot = &ra_table[first_cluster % VFAT_RA_SLOTS];
+    struct vfat_readahead* ra;
+    struct vfat_readahead* old = NULL;
+
+    pthread_mutex_lock(&ra_table_lock);
+    ra = *slot;
+    if(ra == NULL || ra->first_cluster != first_cluster || ra->file_size != file_size) {
+        old = ra;
+        ra = calloc(1, sizeof(struct vfat_readahead));
+        if(ra == NULL)
+            err(1, "calloc(readahead)");
+        ra->first_cluster = first_cluster;
+        ra->file_size = file_size;
+        ra->next_offs = -1;
+        ra->refs = 1;
+        pthread_mutex_init(&ra->lock, NULL);
+        pthread_cond_init(&ra->done, NULL);
+        *slot = ra;
+    }
+    ra->refs++;
+    pthread_mutex_unlock(&ra_table_lock);
+
+    if(old != NULL)
+        ra_unref(old);
+    return ra;
+}
+
+void vfat_readahead_put(struct vfat_readahead* ra)
+{
+    ra_unref(ra);
+}
+
+/**
+ * Serves the start of [offs, offs + size) from prefetched data. Waits for an
+ * in-flight prefetch that covers offs instead of reading the same data twice.
+ * @returns bytes copied to buf, the caller reads the rest from the device
+ */
+size_t vfat_readahead_copy(struct vfat_readahead* ra, char* buf, size_t size, off_t offs)
+{
+    size_t n = 0;
+
+    pthread_mutex_lock(&ra->lock);
+    while(ra->pending && offs >= ra->want_start && offs < ra->want_start + (off_t) ra->want_len)
+        pthread_cond_wait(&ra->done, &ra->lock);
+
+    if(ra->buf != NULL && offs >= ra->buf_start && offs < ra->buf_start + (off_t) ra->buf_len) {
+        n = ra->buf_start + ra->buf_len - offs;
+        if(n > size)
+            n = size;
+        memcpy(buf, ra->buf + (offs - ra->buf_start), n);
+    }
+    pthread_mutex_unlock(&ra->lock);
+    return n;
+}
+
+// Adapts the window to the access pattern and keeps the prefetcher ahead of
+// a sequential reader
+void vfat_readahead_account(struct vfat_readahead* ra, size_t size, off_t offs)
+{
+    off_t end = offs + size;
+    off_t ahead;
+
+    pthread_mutex_lock(&ra->lock);
+    if(offs == ra->next_offs) {
+        // sequential hit: grow the window
+        if(ra->window < VFAT_RA_MIN)
+            ra->window = VFAT_RA_MIN;
+        else if(ra->window < VFAT_RA_MAX)
+            ra->window *= 2;
+    } else if(ra->next_offs >= 0) {
+        // random access: shrink, and stop prefetching below the minimum
+        ra->window /= 2;
+        if(ra->window < VFAT_RA_MIN)
+            ra->window = 0;
+    }
+    ra->next_offs = end;
+
+    // refill once less than half a window is buffered ahead of the reader
+    if(ra->window > 0 && !ra->pending && end < ra->file_size) {
+        ahead = 0;
+        if(ra->buf != NULL && end >= ra->buf_start && end < ra->buf_start + (off_t) ra->buf_len)
+            ahead = ra->buf_start + ra->buf_len - end;
+        if(ahead < (off_t) ra->window / 2) {
+            off_t start = end + ahead;
+            size_t len = ra->window;
+            if(start < ra->file_size) {
+                if(len > ra->file_size - start)
+                    len = ra->file_size - start;
+                ra_schedule(ra, start, len);
+            }
+        }
+    }
+    pthread_mutex_unlock(&ra->lock);
+}
+
+// Drops prefetched data of a file that was written to. A prefetch still in
+// flight lands in the detached state and is thrown away with it.
+void vfat_readahead_invalidate(uint32_t first_cluster)
+{
+    struct vfat_readahead** slot = &ra_table[first_cluster % VFAT_RA_SLOTS];
+    struct vfat_readahead* old = NULL;
+
+    pthread_mutex_lock(&ra_table_lock);
+    if(*slot != NULL && (*slot)->first_cluster == first_cluster) {
+        old = *slot;
+        *slot = NULL;
+    }
+    pthread_mutex_unlock(&ra_table_lock);
+
+    if(old != NULL)
+        ra_unref(old);
+}
@@ -0,0 +1,36 @@
+#ifndef H_READAHEAD
+#define H_READAHEAD
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+// Sequential-access detection and prefetched data of one file
+struct vfat_readahead {
+    uint32_t    first_cluster;  // identifies the file
+    int         refs;           // table, readers and the prefetcher each hold one
+    off_t       file_size;
+    off_t       next_offs;      // where a sequential reader continues
+    size_t      window;         // current readahead window, 0 while random
+    char*       buf;            // prefetched data [buf_start, buf_start + buf_len)
+    off_t       buf_start;
+    size_t      buf_len;
+    int         pending;        // a prefetch of [want_start, +want_len) is queued
+    off_t       want_start;
+    size_t      want_len;
+    pthread_mutex_t lock;
+    pthread_cond_t  done;
+    struct vfat_readahead* queue_next;
+};
+
+#define VFAT_RA_SLOTS       32
+#define VFAT_RA_MIN         (128 * 1024)
+#define VFAT_RA_MAX         (2 * 1024 * 1024)
+
+struct vfat_readahead* vfat_readahead_get(uint32_t first_cluster, off_t file_size);
+void vfat_readahead_put(struct vfat_readahead* ra);
+size_t vfat_readahead_copy(struct vfat_readahead* ra, char* buf, size_t size, off_t offs);
+void vfat_readahead_account(struct vfat_readahead* ra, size_t size, off_t offs);
+void vfat_readahead_invalidate(uint32_t first_cluster);
+
+#endif
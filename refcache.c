@@ -0,0 +1,80 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include "refcache.h"
+
+// Drops one reference, called with the cache lock held
+static void refcache_unref(struct vfat_refcache* c, struct vfat_cached* obj)
+{
+    if(obj != NULL && --obj->refs == 0)
+        c->destroy(obj);
+}
+
+// Object for key, built on first use. Release it with vfat_refcache_put().
+struct vfat_cached* vfat_refcache_get(struct vfat_refcache* c, uint32_t key)
+{
+    struct vfat_cached** slot = &c->slots[key % c->nslots];
+    struct vfat_cached* obj;
+    unsigned long gen;
+
+    pthread_mutex_lock(&c->lock);
+    if(*slot != NULL && (*slot)->key == key) {
+        obj = *slot;
+        obj->refs++;
+        pthread_mutex_unlock(&c->lock);
+        return obj;
+    }
+    gen = c->gen;
+    pthread_mutex_unlock(&c->lock);
+
+    // Build without holding the lock, other readers keep going
+    obj = c->build(key);
+    obj->key = key;
+
+    pthread_mutex_lock(&c->lock);
+    if(gen != c->gen) {
+        obj->refs = 0;      // changed under us, only the caller gets it
+    } else if(*slot != NULL && (*slot)->key == key) {
+        // somebody else built it meanwhile
+        c->destroy(obj);
+        obj = *slot;
+    } else {
+        refcache_unref(c, *slot);
+        obj->refs = 1;
+        *slot = obj;
+    }
+    obj->refs++;
+    pthread_mutex_unlock(&c->lock);
+    return obj;
+}
+
+void vfat_refcache_put(struct vfat_refcache* c, struct vfat_cached* obj)
+{
+    pthread_mutex_lock(&c->lock);
+    refcache_unref(c, obj);
+    pthread_mutex_unlock(&c->lock);
+}
+
+/**
+ * Records that what key describes changed. A cached object is swapped for
+ * what replace makes of it (called with the lock held), or dropped if
+ * replace is NULL or returns NULL. Readers keep the old one until they put it.
+ */
+void vfat_refcache_update(struct vfat_refcache* c, uint32_t key, vfat_refcache_replace_t replace, void* arg)
+{
+    struct vfat_cached** slot = &c->slots[key % c->nslots];
+    struct vfat_cached* obj = NULL;
+
+    pthread_mutex_lock(&c->lock);
+    c->gen++;
+    if(*slot != NULL && (*slot)->key == key) {
+        if(replace != NULL && (obj = replace(*slot, arg)) != NULL) {
+            obj->key = key;
+            obj->refs = 1;
+        }
+        refcache_unref(c, *slot);
+        *slot = obj;
+    }
+    pthread_mutex_unlock(&c->lock);
+}
@@ -0,0 +1,36 @@
+#ifndef H_REFCACHE
+#define H_REFCACHE
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+// First member of every object kept in a struct vfat_refcache
+struct vfat_cached {
+    uint32_t key;       // cluster the object describes
+    int      refs;      // the cache holds one reference while cached
+};
+
+// Direct-mapped cache of refcounted objects, looked up by cluster. A
+// colliding slot is simply replaced. Objects are built without the lock
+// held; one built while the cache was updated is used once but not cached.
+struct vfat_refcache {
+    struct vfat_cached** slots;
+    size_t nslots;
+    struct vfat_cached* (*build)(uint32_t key);
+    void (*destroy)(struct vfat_cached* obj);
+    unsigned long gen;  // bumped by every update
+    pthread_mutex_t lock;
+};
+
+#define VFAT_REFCACHE_INIT(table, build, destroy) \
+    { (table), sizeof(table) / sizeof((table)[0]), (build), (destroy), 0, PTHREAD_MUTEX_INITIALIZER }
+
+// Makes the replacement of a cached object, NULL drops it
+typedef struct vfat_cached* (*vfat_refcache_replace_t)(const struct vfat_cached* old, void* arg);
+
+struct vfat_cached* vfat_refcache_get(struct vfat_refcache* c, uint32_t key);
+void vfat_refcache_put(struct vfat_refcache* c, struct vfat_cached* obj);
+void vfat_refcache_update(struct vfat_refcache* c, uint32_t key, vfat_refcache_replace_t replace, void* arg);
+
+#endif
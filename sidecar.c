@@ -0,0 +1,523 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <err.h>
+
+#include "vfat.h"
+#include "dev.h"
+#include "extent.h"
+#include "dirindex.h"
+#include "sidecar.h"
+
+// Persistent index of the directory tree and of every chain, kept next to
+// the image (-o index=FILE). It is mapped at mount and serves directory
+// listings and extent maps without touching the device. The file is only
+// trusted for the image it was built from (serial, size and mtime), a
+// missing or stale one is rebuilt in the background after mount. A block
+// device has no mtime that follows its contents, its index is rebuilt on
+// every mount. The first change to the volume drops it for the rest of the
+// mount.
+
+#define SIDECAR_MAGIC   "VFATIDX"
+#define SIDECAR_VERSION 1
+
+struct sidecar_header {
+    char     magic[8];
+    uint32_t version;
+    uint32_t serial;            // volume serial of the boot sector
+    uint64_t image_size;
+    int64_t  image_mtime_sec;
+    int64_t  image_mtime_nsec;
+    uint32_t cluster_size;
+    uint32_t count_of_cluster;
+    uint64_t ndirs;
+    uint64_t nentries;
+    uint64_t nchains;
+    uint64_t nextents;
+    uint64_t names_len;
+    uint64_t dirs_off;          // struct sidecar_dir[ndirs], by cluster
+    uint64_t entries_off;       // struct vfat_sidecar_entry[nentries]
+    uint64_t chains_off;        // struct sidecar_chain[nchains], by first cluster
+    uint64_t extents_off;       // struct vfat_extent[nextents]
+    uint64_t names_off;         // NUL terminated names
+    uint64_t file_size;
+};
+
+struct sidecar_dir {
+    uint32_t cluster;
+    uint32_t count;
+    uint64_t first_entry;
+};
+
+struct sidecar_chain {
+    uint32_t first_cluster;
+    uint32_t nclusters;
+    uint32_t count;
+    uint32_t pad;
+    uint64_t first_extent;
+};
+
+// The mapped index, hdr is NULL while there is none to use
+static const struct sidecar_header* hdr;
+static const struct sidecar_dir* dirs;
+static const struct vfat_sidecar_entry* entries;
+static const struct sidecar_chain* chains;
+static const struct vfat_extent* extents;
+static const char* names;
+static int dropped;             // the volume changed since mount
+static int need_build;
+static const char* index_path;
+// What the index has to match, taken at mount
+static struct sidecar_header key;
+
+static int table_fits(uint64_t offs, uint64_t count, size_t size, uint64_t file_size)
+{
+    return offs % 8 == 0 && offs <= file_size && count <= (file_size - offs) / size;
+}
+
+// The header matches the image and every table lies inside the file
+static int hdr_valid(const struct sidecar_header* h, uint64_t size)
+{
+    if(size < sizeof(*h) || memcmp(h->magic, SIDECAR_MAGIC, sizeof(h->magic)) != 0 ||
+       h->version != SIDECAR_VERSION || h->serial != key.serial ||
+       h->image_size != key.image_size || h->image_mtime_sec != key.image_mtime_sec ||
+       h->image_mtime_nsec != key.image_mtime_nsec || h->cluster_size != key.cluster_size ||
+       h->count_of_cluster != key.count_of_cluster || h->file_size != size)
+        return 0;
+    // every table inside the file, the name table NUL terminated
+    if(!table_fits(h->dirs_off, h->ndirs, sizeof(struct sidecar_dir), size) ||
+       !table_fits(h->entries_off, h->nentries, sizeof(struct vfat_sidecar_entry), size) ||
+       !table_fits(h->chains_off, h->nchains, sizeof(struct sidecar_chain), size) ||
+       !table_fits(h->extents_off, h->nextents, sizeof(struct vfat_extent), size) ||
+       !table_fits(h->names_off, h->names_len, 1, size) || h->names_len == 0 ||
+       ((const char*) h)[h->names_off + h->names_len - 1] != '\0')
+        return 0;
+    return 1;
+}
+
+// Position of first_cluster in the sorted chain table, nchains if missing
+static size_t chain_find(const struct sidecar_chain* chs, size_t nchains, uint32_t first_cluster)
+{
+    size_t lo = 0, hi, mid;
+
+    for(hi = nchains ; lo < hi ;) {
+        mid = lo + (hi - lo) / 2;
+        if(chs[mid].first_cluster < first_cluster)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo < nchains && chs[lo].first_cluster == first_cluster ? lo : nchains;
+}
+
+/**
+ * Checks what the tables point at: extents stay on the volume and every
+ * entry location lies inside its directory's chain. Writes go where these
+ * say, a damaged file must not pass.
+ */
+static int tables_valid(const struct sidecar_header* h)
+{
+    const struct sidecar_dir* ds = (const void*)((const char*) h + h->dirs_off);
+    const struct vfat_sidecar_entry* es = (const void*)((const char*) h + h->entries_off);
+    const struct sidecar_chain* chs = (const void*)((const char*) h + h->chains_off);
+    const struct vfat_extent* exs = (const void*)((const char*) h + h->extents_off);
+    uint64_t end = (uint64_t) h->count_of_cluster + 2, slots, total, i, j;
+    size_t c;
+
+    for(i = 0 ; i < h->nextents ; i++) {
+        if(exs[i].disk_cluster < 2 || exs[i].length == 0 ||
+           (uint64_t) exs[i].disk_cluster + exs[i].length > end)
+            return 0;
+    }
+    for(i = 0 ; i < h->nchains ; i++) {
+        if(chs[i].first_extent > h->nextents || chs[i].count > h->nextents - chs[i].first_extent)
+            return 0;
+        for(j = 0, total = 0 ; j < chs[i].count ; j++) {
+            if(exs[chs[i].first_extent + j].file_cluster != total)
+                return 0;
+            total += exs[chs[i].first_extent + j].length;
+        }
+        if(total != chs[i].nclusters)
+            return 0;
+    }
+    for(i = 0 ; i < h->ndirs ; i++) {
+        if(ds[i].first_entry > h->nentries || ds[i].count > h->nentries - ds[i].first_entry)
+            return 0;
+        c = chain_find(chs, h->nchains, ds[i].cluster);
+        if(c == h->nchains)
+            return 0;
+        slots = (uint64_t) chs[c].nclusters * (h->cluster_size / 32);
+        for(j = ds[i].first_entry ; j < ds[i].first_entry + ds[i].count ; j++) {
+            if(es[j].loc.dir != ds[i].cluster || es[j].loc.first > es[j].loc.slot ||
+               es[j].loc.slot >= slots)
+                return 0;
+        }
+    }
+    return 1;
+}
+
+// Maps the index file if it belongs to the mounted image
+static int sidecar_map(const char* path)
+{
+    const struct sidecar_header* h;
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+
+    if(fd < 0)
+        return -1;
+    if(fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(*h)) {
+        close(fd);
+        return -1;
+    }
+    h = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(h == MAP_FAILED)
+        return -1;
+    if(!hdr_valid(h, st.st_size) || !tables_valid(h)) {
+        munmap((void*) h, st.st_size);
+        return -1;
+    }
+    dirs = (const void*)((const char*) h + h->dirs_off);
+    entries = (const void*)((const char*) h + h->entries_off);
+    chains = (const void*)((const char*) h + h->chains_off);
+    extents = (const void*)((const char*) h + h->extents_off);
+    names = (const char*) h + h->names_off;
+    __atomic_store_n(&hdr, h, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/**
+ * Called by vfat_init(), maps the index at path if it is up to date.
+ * Otherwise vfat_sidecar_start() rebuilds it.
+ */
+void vfat_sidecar_init(const char* path, uint32_t serial)
+{
+    struct stat st;
+
+    if(path == NULL)
+        return;
+    if(fstat(vfat_info.fd, &st) != 0)
+        err(1, "fstat(%s)", vfat_info.dev);
+    index_path = path;
+    memcpy(key.magic, SIDECAR_MAGIC, sizeof(key.magic));
+    key.version = SIDECAR_VERSION;
+    key.serial = serial;
+    key.image_size = vfat_dev_size();
+    key.image_mtime_sec = st.st_mtim.tv_sec;
+    key.image_mtime_nsec = st.st_mtim.tv_nsec;
+    key.cluster_size = vfat_info.cluster_size;
+    key.count_of_cluster = vfat_info.count_of_cluster;
+    if(!vfat_dev_is_file()) {
+        need_build = 1;
+        return;
+    }
+    if(sidecar_map(path) != 0) {
+        warnx("index %s is missing or stale, rebuilding it", path);
+        need_build = 1;
+    }
+}
+
+// The index does not describe the volume any more
+void vfat_sidecar_drop(void)
+{
+    __atomic_store_n(&dropped, 1, __ATOMIC_RELEASE);
+}
+
+static const struct sidecar_header* sidecar_get(void)
+{
+    if(__atomic_load_n(&dropped, __ATOMIC_ACQUIRE))
+        return NULL;
+    return __atomic_load_n(&hdr, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Entries of the directory starting at cluster, in on-disk order
+ * @returns their number, -1 if the index does not know the directory
+ */
+int vfat_sidecar_dir(uint32_t cluster, const struct vfat_sidecar_entry** ents)
+{
+    const struct sidecar_header* h = sidecar_get();
+    size_t lo = 0, hi, mid;
+
+    if(h == NULL)
+        return -1;
+    for(hi = h->ndirs ; lo < hi ;) {
+        mid = lo + (hi - lo) / 2;
+        if(dirs[mid].cluster < cluster)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if(lo == h->ndirs || dirs[lo].cluster != cluster ||
+       dirs[lo].first_entry + dirs[lo].count > h->nentries)
+        return -1;
+    *ents = &entries[dirs[lo].first_entry];
+    return dirs[lo].count;
+}
+
+const char* vfat_sidecar_name(const struct vfat_sidecar_entry* e)
+{
+    const struct sidecar_header* h = __atomic_load_n(&hdr, __ATOMIC_ACQUIRE);
+
+    return e->name < h->names_len ? names + e->name : "";
+}
+
+// struct stat of an entry, as fill_stat() would give it
+void vfat_sidecar_stat(const struct vfat_sidecar_entry* e, struct stat* st)
+{
+    memset(st, 0, sizeof(struct stat));
+    st->st_ino = e->ino;
+    st->st_mode = e->mode;
+    st->st_size = e->size;
+    st->st_nlink = 1;
+    st->st_uid = vfat_info.mount_uid;
+    st->st_gid = vfat_info.mount_gid;
+    st->st_blocks = 1;
+    st->st_atime = e->atime;
+    st->st_mtime = e->mtime;
+    st->st_ctime = e->ctime;
+}
+
+/**
+ * Extents of the chain starting at first_cluster
+ * @extents, @count may be NULL when only the length is wanted
+ * @returns 0, or -1 if the index does not know the chain
+ */
+int vfat_sidecar_chain(uint32_t first_cluster, const struct vfat_extent** ext,
+                       size_t* count, uint32_t* nclusters)
+{
+    const struct sidecar_header* h = sidecar_get();
+    size_t i;
+
+    if(h == NULL)
+        return -1;
+    i = chain_find(chains, h->nchains, first_cluster);
+    if(i == h->nchains)
+        return -1;
+    if(ext != NULL)
+        *ext = &extents[chains[i].first_extent];
+    if(count != NULL)
+        *count = chains[i].count;
+    *nclusters = chains[i].nclusters;
+    return 0;
+}
+
+// Growable array of the builder
+struct buf {
+    char* data;
+    size_t len;
+    size_t alloc;
+};
+
+static void* buf_add(struct buf* b, const void* data, size_t len)
+{
+    void* p;
+
+    if(b->len + len > b->alloc) {
+        b->alloc = b->alloc ? b->alloc * 2 : 4096;
+        while(b->alloc < b->len + len)
+            b->alloc *= 2;
+        b->data = realloc(b->data, b->alloc);
+        if(b->data == NULL)
+            err(1, "realloc(index)");
+    }
+    p = b->data + b->len;
+    memcpy(p, data, len);
+    b->len += len;
+    return p;
+}
+
+struct build {
+    struct buf dirs, entries, chains, extents, names, queue;
+    uint64_t* seen;             // directory clusters already queued
+};
+
+// Records the chain starting at first_cluster
+static void build_chain(struct build* b, uint32_t first_cluster)
+{
+    struct vfat_extent_map* map = vfat_extent_map_get(first_cluster);
+    struct sidecar_chain c;
+
+    memset(&c, 0, sizeof(c));
+    c.first_cluster = first_cluster;
+    c.nclusters = map->nclusters;
+    c.count = map->count;
+    c.first_extent = b->extents.len / sizeof(struct vfat_extent);
+    buf_add(&b->extents, map->extents, map->count * sizeof(struct vfat_extent));
+    buf_add(&b->chains, &c, sizeof(c));
+    vfat_extent_map_put(map);
+}
+
+static void build_dir(struct build* b, uint32_t cluster)
+{
+    struct vfat_dir_index* idx = vfat_dir_index_get(cluster);
+    struct sidecar_dir d;
+    struct vfat_sidecar_entry e;
+    uint32_t ino;
+    size_t i;
+
+    d.cluster = cluster;
+    d.count = idx->count;
+    d.first_entry = b->entries.len / sizeof(struct vfat_sidecar_entry);
+    buf_add(&b->dirs, &d, sizeof(d));
+    for(i = 0 ; i < idx->count ; i++) {
+        const struct vfat_dir_name* n = &idx->entries[i];
+
+        memset(&e, 0, sizeof(e));
+        e.name = b->names.len;
+        e.hash = n->hash;
+        e.ino = ino = (uint32_t) n->st.st_ino;
+        e.mode = n->st.st_mode;
+        e.size = n->st.st_size;
+        e.atime = n->st.st_atime;
+        e.mtime = n->st.st_mtime;
+        e.ctime = n->st.st_ctime;
+        e.loc = n->loc;
+        buf_add(&b->entries, &e, sizeof(e));
+        buf_add(&b->names, n->name, strlen(n->name) + 1);
+
+        if(ino < 2 || ino >= vfat_info.count_of_cluster + 2)
+            continue;
+        if(S_ISDIR(n->st.st_mode)) {
+            // "." and ".." and anything seen before are not walked again
+            if(b->seen[ino / 64] & (1ULL << (ino % 64)))
+                continue;
+            b->seen[ino / 64] |= 1ULL << (ino % 64);
+            buf_add(&b->queue, &ino, sizeof(ino));
+        } else {
+            build_chain(b, ino);
+        }
+    }
+    vfat_dir_index_put(idx);
+    build_chain(b, cluster);
+}
+
+static int cmp_dir(const void* a, const void* b)
+{
+    uint32_t x = ((const struct sidecar_dir*) a)->cluster, y = ((const struct sidecar_dir*) b)->cluster;
+
+    return x < y ? -1 : x > y;
+}
+
+static int cmp_chain(const void* a, const void* b)
+{
+    uint32_t x = ((const struct sidecar_chain*) a)->first_cluster, y = ((const struct sidecar_chain*) b)->first_cluster;
+
+    return x < y ? -1 : x > y;
+}
+
+static int write_all(int fd, const void* data, size_t len, off_t offs)
+{
+    ssize_t n;
+
+    while(len > 0) {
+        n = pwrite(fd, data, len, offs);
+        if(n <= 0)
+            return -1;
+        data = (const char*) data + n;
+        len -= n;
+        offs += n;
+    }
+    return 0;
+}
+
+// Writes the index next to the image, replacing the old one at once
+static int build_write(struct build* b)
+{
+    struct sidecar_header h = key;
+    char tmp[4096];
+    int fd, ret;
+
+    h.ndirs = b->dirs.len / sizeof(struct sidecar_dir);
+    h.nentries = b->entries.len / sizeof(struct vfat_sidecar_entry);
+    h.nchains = b->chains.len / sizeof(struct sidecar_chain);
+    h.nextents = b->extents.len / sizeof(struct vfat_extent);
+    h.names_len = b->names.len;
+    h.dirs_off = sizeof(h);
+    h.entries_off = h.dirs_off + b->dirs.len;
+    h.chains_off = h.entries_off + b->entries.len;
+    h.extents_off = h.chains_off + b->chains.len;
+    // keep the name table 8 byte aligned for the tables before it
+    h.names_off = (h.extents_off + b->extents.len + 7) & ~7ULL;
+    h.file_size = h.names_off + b->names.len;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", index_path);
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0)
+        return -1;
+    ret = write_all(fd, &h, sizeof(h), 0) || write_all(fd, b->dirs.data, b->dirs.len, h.dirs_off) ||
+          write_all(fd, b->entries.data, b->entries.len, h.entries_off) ||
+          write_all(fd, b->chains.data, b->chains.len, h.chains_off) ||
+          write_all(fd, b->extents.data, b->extents.len, h.extents_off) ||
+          write_all(fd, b->names.data, b->names.len, h.names_off) ? -1 : 0;
+    if(close(fd) != 0)
+        ret = -1;
+    if(ret == 0 && rename(tmp, index_path) != 0)
+        ret = -1;
+    if(ret != 0)
+        unlink(tmp);
+    return ret;
+}
+
+// Walks the whole tree once through the dir index and the extent maps
+static void* sidecar_build_thread(void* arg)
+{
+    struct build b;
+    size_t next;
+    uint32_t cluster;
+    uint32_t root = vfat_info.root_cluster;
+
+    memset(&b, 0, sizeof(b));
+    b.seen = calloc((vfat_info.count_of_cluster + 2 + 63) / 64, sizeof(uint64_t));
+    if(b.seen == NULL)
+        err(1, "calloc(index)");
+    b.seen[root / 64] |= 1ULL << (root % 64);
+    buf_add(&b.queue, &root, sizeof(root));
+    buf_add(&b.names, "", 1);
+
+    for(next = 0 ; next < b.queue.len / sizeof(uint32_t) ; next++) {
+        if(__atomic_load_n(&dropped, __ATOMIC_ACQUIRE))
+            break;
+        memcpy(&cluster, b.queue.data + next * sizeof(uint32_t), sizeof(cluster));
+        build_dir(&b, cluster);
+    }
+
+    if(!__atomic_load_n(&dropped, __ATOMIC_ACQUIRE) && b.names.len <= UINT32_MAX) {
+        qsort(b.dirs.data, b.dirs.len / sizeof(struct sidecar_dir), sizeof(struct sidecar_dir), cmp_dir);
+        qsort(b.chains.data, b.chains.len / sizeof(struct sidecar_chain), sizeof(struct sidecar_chain), cmp_chain);
+        if(build_write(&b) != 0)
+            warn("write index %s", index_path);
+        // a change during the write makes the new file stale as well, the
+        // image mtime moved on with it
+        else if(!__atomic_load_n(&dropped, __ATOMIC_ACQUIRE))
+            sidecar_map(index_path);
+    }
+    free(b.dirs.data);
+    free(b.entries.data);
+    free(b.chains.data);
+    free(b.extents.data);
+    free(b.names.data);
+    free(b.queue.data);
+    free(b.seen);
+    return NULL;
+}
+
+// Called once FUSE runs, starts the rebuild vfat_sidecar_init() asked for
+void vfat_sidecar_start(void)
+{
+    pthread_t t;
+
+    if(!need_build)
+        return;
+    need_build = 0;
+    if(pthread_create(&t, NULL, sidecar_build_thread, NULL) != 0)
+        err(1, "pthread_create(index)");
+    pthread_detach(t);
+}
@@ -0,0 +1,33 @@
+#ifndef H_SIDECAR
+#define H_SIDECAR
+
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include "vfat.h"
+#include "extent.h"
+
+// A directory entry as stored in the index file
+struct vfat_sidecar_entry {
+    uint32_t name;          // offset into the name table
+    uint32_t hash;          // the dir index hash of name
+    uint32_t ino;           // first cluster
+    uint32_t mode;
+    uint64_t size;
+    int64_t  atime;
+    int64_t  mtime;
+    int64_t  ctime;
+    struct vfat_dirent_loc loc;
+    uint32_t pad;
+};
+
+void vfat_sidecar_init(const char* path, uint32_t serial);
+void vfat_sidecar_start(void);
+void vfat_sidecar_drop(void);
+int vfat_sidecar_dir(uint32_t cluster, const struct vfat_sidecar_entry** entries);
+const char* vfat_sidecar_name(const struct vfat_sidecar_entry* e);
+void vfat_sidecar_stat(const struct vfat_sidecar_entry* e, struct stat* st);
+int vfat_sidecar_chain(uint32_t first_cluster, const struct vfat_extent** extents,
+                       size_t* count, uint32_t* nclusters);
+
+#endif
@@ -0,0 +1,213 @@
+#include <stdint.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "stats.h"
+
+// Counters live in per-thread shards and are only summed up when read,
+// the hot paths never write to a cache line another thread is using
+static struct vfat_stats_shard shards[VFAT_STATS_SHARDS];
+static unsigned int shards_handed_out;
+__thread struct vfat_stats_shard* vfat_stats_mine;
+__thread uint64_t vfat_stats_local[VFAT_CNT_MAX];
+
+static const char* const counter_names[VFAT_CNT_MAX] = {
+    [VFAT_CNT_FAT_LOOKUPS]      = "fat_lookups",
+    [VFAT_CNT_DEV_READS]        = "dev_reads",
+    [VFAT_CNT_DEV_READ_BYTES]   = "dev_read_bytes",
+    [VFAT_CNT_DEV_WRITES]       = "dev_writes",
+    [VFAT_CNT_DEV_WRITE_BYTES]  = "dev_write_bytes",
+    [VFAT_CNT_CACHE_HITS]       = "cache_hits",
+    [VFAT_CNT_CACHE_MISSES]     = "cache_misses",
+    [VFAT_CNT_READDIR_ENTRIES]  = "readdir_entries",
+    [VFAT_CNT_URING_BATCHES]    = "uring_batches",
+};
+
+static const char* const counter_help[VFAT_CNT_MAX] = {
+    [VFAT_CNT_FAT_LOOKUPS]      = "FAT entries looked up",
+    [VFAT_CNT_DEV_READS]        = "Read requests sent to the device",
+    [VFAT_CNT_DEV_READ_BYTES]   = "Bytes read from the device",
+    [VFAT_CNT_DEV_WRITES]       = "Write requests sent to the device",
+    [VFAT_CNT_DEV_WRITE_BYTES]  = "Bytes written to the device",
+    [VFAT_CNT_CACHE_HITS]       = "Cluster cache hits",
+    [VFAT_CNT_CACHE_MISSES]     = "Cluster cache misses",
+    [VFAT_CNT_READDIR_ENTRIES]  = "Directory entries parsed",
+    [VFAT_CNT_URING_BATCHES]    = "Device reads submitted together through io_uring",
+};
+
+static const char* const op_names[VFAT_OP_MAX] = {
+    [VFAT_OP_GETATTR]   = "getattr",
+    [VFAT_OP_READDIR]   = "readdir",
+    [VFAT_OP_READ]      = "read",
+    [VFAT_OP_RESOLVE]   = "resolve",
+};
+
+// Hands the calling thread its shard, round robin
+struct vfat_stats_shard* vfat_stats_shard(void)
+{
+    unsigned int n = __atomic_fetch_add(&shards_handed_out, 1, __ATOMIC_RELAXED);
+
+    vfat_stats_mine = &shards[n % VFAT_STATS_SHARDS];
+    return vfat_stats_mine;
+}
+
+// Records an operation that started at start_ns
+void vfat_stats_op(enum vfat_op op, uint64_t start_ns)
+{
+    struct vfat_stats_shard* s = vfat_stats_mine ? vfat_stats_mine : vfat_stats_shard();
+    uint64_t ns = vfat_stats_start() - start_ns;
+    uint64_t us = ns / 1000;
+    int b = us ? 64 - __builtin_clzll(us) : 0;
+
+    if(b >= VFAT_HIST_BUCKETS)
+        b = VFAT_HIST_BUCKETS - 1;
+    __atomic_fetch_add(&s->hist[op][b], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&s->sum_ns[op], ns, __ATOMIC_RELAXED);
+}
+
+// Sum over all shards
+static void stats_sum(struct vfat_stats_shard* total)
+{
+    size_t i, j, k;
+
+    memset(total, 0, sizeof(*total));
+    for(i = 0 ; i < VFAT_STATS_SHARDS ; i++) {
+        for(j = 0 ; j < VFAT_CNT_MAX ; j++)
+            total->counter[j] += __atomic_load_n(&shards[i].counter[j], __ATOMIC_RELAXED);
+        for(j = 0 ; j < VFAT_OP_MAX ; j++) {
+            for(k = 0 ; k < VFAT_HIST_BUCKETS ; k++)
+                total->hist[j][k] += __atomic_load_n(&shards[i].hist[j][k], __ATOMIC_RELAXED);
+            total->sum_ns[j] += __atomic_load_n(&shards[i].sum_ns[j], __ATOMIC_RELAXED);
+        }
+    }
+}
+
+// Appends to buf[len..size), output that does not fit is cut off. Shared by
+// every text file of the debug file system.
+size_t vfat_stats_put(char* buf, size_t size, size_t len, const char* fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    if(len >= size)
+        return len;
+    va_start(ap, fmt);
+    n = vsnprintf(buf + len, size - len, fmt, ap);
+    va_end(ap);
+    if(n < 0)
+        return len;
+    return len + n < size ? len + n : size - 1;
+}
+
+// Upper bound in microseconds of the bucket holding the q-th quantile
+static uint64_t quantile_us(const uint64_t* hist, uint64_t count, double q)
+{
+    uint64_t seen = 0, want = (uint64_t)(q * count);
+    int b;
+
+    for(b = 0 ; b < VFAT_HIST_BUCKETS ; b++) {
+        seen += hist[b];
+        if(seen > want)
+            break;
+    }
+    return 1ULL << (b < VFAT_HIST_BUCKETS ? b : VFAT_HIST_BUCKETS - 1);
+}
+
+static uint64_t hist_count(const uint64_t* hist)
+{
+    uint64_t n = 0;
+    int b;
+
+    for(b = 0 ; b < VFAT_HIST_BUCKETS ; b++)
+        n += hist[b];
+    return n;
+}
+
+/**
+ * "name value" lines of all counters
+ * @returns length of the text, at most size - 1
+ */
+size_t vfat_stats_counters(char* buf, size_t size)
+{
+    struct vfat_stats_shard total;
+    size_t len = 0;
+    int i;
+
+    stats_sum(&total);
+    buf[0] = '\0';
+    for(i = 0 ; i < VFAT_CNT_MAX ; i++)
+        len = vfat_stats_put(buf, size, len, "%s %llu\n", counter_names[i], (unsigned long long) total.counter[i]);
+    return len;
+}
+
+/**
+ * Per operation: count, mean and quantiles in microseconds, then the
+ * non-empty histogram buckets
+ * @returns length of the text, at most size - 1
+ */
+size_t vfat_stats_latency(char* buf, size_t size)
+{
+    struct vfat_stats_shard total;
+    size_t len = 0;
+    uint64_t count;
+    int op, b;
+
+    stats_sum(&total);
+    buf[0] = '\0';
+    for(op = 0 ; op < VFAT_OP_MAX ; op++) {
+        count = hist_count(total.hist[op]);
+        len = vfat_stats_put(buf, size, len, "%s count %llu avg_us %.1f p50_us %llu p90_us %llu p99_us %llu\n",
+                  op_names[op], (unsigned long long) count,
+                  count ? total.sum_ns[op] / 1000.0 / count : 0.0,
+                  (unsigned long long) quantile_us(total.hist[op], count, 0.5),
+                  (unsigned long long) quantile_us(total.hist[op], count, 0.9),
+                  (unsigned long long) quantile_us(total.hist[op], count, 0.99));
+        for(b = 0 ; b < VFAT_HIST_BUCKETS ; b++) {
+            if(total.hist[op][b] == 0)
+                continue;
+            if(b < VFAT_HIST_BUCKETS - 1)
+                len = vfat_stats_put(buf, size, len, "  lt_us %llu %llu\n", 1ULL << b, (unsigned long long) total.hist[op][b]);
+            else
+                len = vfat_stats_put(buf, size, len, "  more %llu\n", (unsigned long long) total.hist[op][b]);
+        }
+    }
+    return len;
+}
+
+/**
+ * Counters and histograms in the Prometheus text exposition format
+ * @returns length of the text, at most size - 1
+ */
+size_t vfat_stats_prometheus(char* buf, size_t size)
+{
+    struct vfat_stats_shard total;
+    size_t len = 0;
+    uint64_t cum;
+    int i, op, b;
+
+    stats_sum(&total);
+    buf[0] = '\0';
+    for(i = 0 ; i < VFAT_CNT_MAX ; i++) {
+        len = vfat_stats_put(buf, size, len, "# HELP vfat_%s_total %s\n# TYPE vfat_%s_total counter\nvfat_%s_total %llu\n",
+                  counter_names[i], counter_help[i], counter_names[i], counter_names[i],
+                  (unsigned long long) total.counter[i]);
+    }
+    len = vfat_stats_put(buf, size, len, "# HELP vfat_op_duration_seconds Latency of file system operations\n"
+                              "# TYPE vfat_op_duration_seconds histogram\n");
+    for(op = 0 ; op < VFAT_OP_MAX ; op++) {
+        for(b = 0, cum = 0 ; b < VFAT_HIST_BUCKETS - 1 ; b++) {
+            cum += total.hist[op][b];
+            len = vfat_stats_put(buf, size, len, "vfat_op_duration_seconds_bucket{op=\"%s\",le=\"%g\"} %llu\n",
+                      op_names[op], (double)(1ULL << b) / 1e6, (unsigned long long) cum);
+        }
+        cum += total.hist[op][b];
+        len = vfat_stats_put(buf, size, len, "vfat_op_duration_seconds_bucket{op=\"%s\",le=\"+Inf\"} %llu\n"
+                                  "vfat_op_duration_seconds_sum{op=\"%s\"} %.9f\n"
+                                  "vfat_op_duration_seconds_count{op=\"%s\"} %llu\n",
+                  op_names[op], (unsigned long long) cum,
+                  op_names[op], total.sum_ns[op] / 1e9,
+                  op_names[op], (unsigned long long) cum);
+    }
+    return len;
+}
@@ -0,0 +1,72 @@
+#ifndef H_STATS
+#define H_STATS
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+// Event counters, exported under /.debug/stats
+enum vfat_counter {
+    VFAT_CNT_FAT_LOOKUPS,
+    VFAT_CNT_DEV_READS,
+    VFAT_CNT_DEV_READ_BYTES,
+    VFAT_CNT_DEV_WRITES,
+    VFAT_CNT_DEV_WRITE_BYTES,
+    VFAT_CNT_CACHE_HITS,
+    VFAT_CNT_CACHE_MISSES,
+    VFAT_CNT_READDIR_ENTRIES,
+    VFAT_CNT_URING_BATCHES,
+    VFAT_CNT_MAX
+};
+
+// Operations with a latency histogram
+enum vfat_op {
+    VFAT_OP_GETATTR,
+    VFAT_OP_READDIR,
+    VFAT_OP_READ,
+    VFAT_OP_RESOLVE,
+    VFAT_OP_MAX
+};
+
+// Bucket i counts operations that took less than 2^i microseconds, the
+// last one everything slower
+#define VFAT_HIST_BUCKETS   24
+// Threads are spread over this many shards so they rarely share a counter
+#define VFAT_STATS_SHARDS   64
+
+struct vfat_stats_shard {
+    uint64_t counter[VFAT_CNT_MAX];
+    uint64_t hist[VFAT_OP_MAX][VFAT_HIST_BUCKETS];
+    uint64_t sum_ns[VFAT_OP_MAX];
+} __attribute__((aligned(64)));
+
+extern __thread struct vfat_stats_shard* vfat_stats_mine;
+// What this thread alone counted, the tracer charges it to operations
+extern __thread uint64_t vfat_stats_local[VFAT_CNT_MAX];
+struct vfat_stats_shard* vfat_stats_shard(void);
+
+static inline void vfat_count(enum vfat_counter c, uint64_t n)
+{
+    struct vfat_stats_shard* s = vfat_stats_mine ? vfat_stats_mine : vfat_stats_shard();
+
+    __atomic_fetch_add(&s->counter[c], n, __ATOMIC_RELAXED);
+    vfat_stats_local[c] += n;
+}
+
+// Start time of an operation for vfat_stats_op()
+static inline uint64_t vfat_stats_start(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+void vfat_stats_op(enum vfat_op op, uint64_t start_ns);
+size_t vfat_stats_counters(char* buf, size_t size);
+size_t vfat_stats_latency(char* buf, size_t size);
+size_t vfat_stats_prometheus(char* buf, size_t size);
+size_t vfat_stats_put(char* buf, size_t size, size_t len, const char* fmt, ...)
+    __attribute__((format(printf, 4, 5)));
+
+#endif
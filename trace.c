@@ -0,0 +1,226 @@
+#include <sys/types.h>
+#include <sys/syscall.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <err.h>
+
+#include "vfat.h"
+#include "stats.h"
+#include "trace.h"
+
+// Room one event takes in the JSON dump, its path escaped in the worst case
+#define TRACE_JSON_EVENT_MAX    (320 + 6 * VFAT_TRACE_PATH)
+
+struct trace_event {
+    uint64_t seq;               // odd while the owner is writing the event
+    const char* op;             // string literal, never freed
+    pid_t tid;
+    int32_t ret;
+    uint64_t start_ns;
+    uint64_t dur_ns;
+    uint32_t fat_lookups;
+    uint32_t clusters;          // cluster cache lookups
+    uint32_t syscalls;          // device reads and writes
+    uint64_t bytes;             // moved to or from the device
+    char path[VFAT_TRACE_PATH];
+};
+
+// Written by its owner thread only, the dump reads it without locking
+struct trace_ring {
+    int in_use;
+    pid_t tid;
+    uint64_t head;              // events written so far
+    struct trace_event ev[VFAT_TRACE_EVENTS];
+};
+
+static struct trace_ring* rings[VFAT_TRACE_THREADS];
+static unsigned int nrings;     // rings[] allocated so far
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+static __thread struct trace_ring* mine;
+static __thread int untraced;   // every ring was taken when this thread asked
+
+// Thread exit, the ring keeps its events until another thread takes it
+static void ring_release(void* ring)
+{
+    pthread_mutex_lock(&ring_lock);
+    ((struct trace_ring*) ring)->in_use = 0;
+    pthread_mutex_unlock(&ring_lock);
+}
+
+static void ring_key_create(void)
+{
+    if(pthread_key_create(&ring_key, ring_release) != 0)
+        err(1, "pthread_key_create(trace)");
+}
+
+// Gives the calling thread a ring, once per thread
+static struct trace_ring* ring_claim(void)
+{
+    struct trace_ring* r = NULL;
+    unsigned int i;
+
+    pthread_once(&ring_key_once, ring_key_create);
+    pthread_mutex_lock(&ring_lock);
+    for(i = 0 ; i < nrings ; i++) {
+        if(!rings[i]->in_use) {
+            r = rings[i];
+            break;
+        }
+    }
+    if(r == NULL && nrings < VFAT_TRACE_THREADS) {
+        r = calloc(1, sizeof(struct trace_ring));
+        if(r == NULL)
+            err(1, "calloc(trace ring)");
+        rings[nrings] = r;
+        __atomic_store_n(&nrings, nrings + 1, __ATOMIC_RELEASE);
+    }
+    if(r != NULL) {
+        r->in_use = 1;
+        r->tid = syscall(SYS_gettid);
+    }
+    pthread_mutex_unlock(&ring_lock);
+
+    if(r == NULL)
+        untraced = 1;
+    else
+        pthread_setspecific(ring_key, r);
+    mine = r;
+    return r;
+}
+
+// Starts timing an operation of the calling thread
+void vfat_trace_begin(struct vfat_trace_span* sp)
+{
+    memcpy(sp->base, vfat_stats_local, sizeof(sp->base));
+    sp->start_ns = vfat_stats_start();
+}
+
+/**
+ * Records the operation begun with sp in the thread's ring, and logs it when
+ * it took longer than -o trace_slow_ms
+ * @op name of the operation, a string literal
+ */
+void vfat_trace_end(struct vfat_trace_span* sp, const char* op, const char* path, int ret)
+{
+    struct trace_ring* r = mine;
+    struct trace_event* e;
+    uint64_t d[VFAT_CNT_MAX];
+    uint64_t dur = vfat_stats_start() - sp->start_ns;
+    size_t len, i;
+
+    for(i = 0 ; i < VFAT_CNT_MAX ; i++)
+        d[i] = vfat_stats_local[i] - sp->base[i];
+
+    if(vfat_info.trace_slow_ms != 0 && dur >= vfat_info.trace_slow_ms * 1000000ULL) {
+        warnx("slow %s %s: %.3f ms, returned %d, %llu FAT lookups, %llu clusters, %llu syscalls, %llu bytes",
+              op, path ? path : "-", dur / 1e6, ret,
+              (unsigned long long) d[VFAT_CNT_FAT_LOOKUPS],
+              (unsigned long long) (d[VFAT_CNT_CACHE_HITS] + d[VFAT_CNT_CACHE_MISSES]),
+              (unsigned long long) (d[VFAT_CNT_DEV_READS] + d[VFAT_CNT_DEV_WRITES]),
+              (unsigned long long) (d[VFAT_CNT_DEV_READ_BYTES] + d[VFAT_CNT_DEV_WRITE_BYTES]));
+    }
+
+    if(r == NULL) {
+        if(untraced || (r = ring_claim()) == NULL)
+            return;
+    }
+
+    // Seqlock: a dump that saw the event change under it skips it
+    e = &r->ev[r->head % VFAT_TRACE_EVENTS];
+    __atomic_store_n(&e->seq, e->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    e->op = op;
+    e->tid = r->tid;
+    e->ret = ret;
+    e->start_ns = sp->start_ns;
+    e->dur_ns = dur;
+    e->fat_lookups = d[VFAT_CNT_FAT_LOOKUPS];
+    e->clusters = d[VFAT_CNT_CACHE_HITS] + d[VFAT_CNT_CACHE_MISSES];
+    e->syscalls = d[VFAT_CNT_DEV_READS] + d[VFAT_CNT_DEV_WRITES];
+    e->bytes = d[VFAT_CNT_DEV_READ_BYTES] + d[VFAT_CNT_DEV_WRITE_BYTES];
+    if(path == NULL)
+        path = "";
+    len = strlen(path);
+    if(len >= VFAT_TRACE_PATH) {
+        // keep the tail, starting at a whole UTF-8 character
+        path += len - (VFAT_TRACE_PATH - 1);
+        while((*path & 0xC0) == 0x80)
+            path++;
+        len = strlen(path);
+    }
+    memcpy(e->path, path, len + 1);
+    __atomic_store_n(&e->seq, e->seq + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
+
+// Upper bound of the length of vfat_trace_json() output
+size_t vfat_trace_max_len(void)
+{
+    return (size_t) __atomic_load_n(&nrings, __ATOMIC_ACQUIRE) * VFAT_TRACE_EVENTS * TRACE_JSON_EVENT_MAX + 64;
+}
+
+// Path as the inside of a JSON string
+static size_t put_path(char* buf, size_t size, size_t len, const char* path)
+{
+    for( ; *path ; path++) {
+        if(*path == '"' || *path == '\\')
+            len = vfat_stats_put(buf, size, len, "\\%c", *path);
+        else if((unsigned char) *path < 0x20)
+            len = vfat_stats_put(buf, size, len, "\\u%04x", (unsigned char) *path);
+        else
+            len = vfat_stats_put(buf, size, len, "%c", *path);
+    }
+    return len;
+}
+
+/**
+ * The events still in the rings as a Chrome trace (also read by Perfetto),
+ * one complete event per operation
+ * @returns length of the text, at most size - 1
+ */
+size_t vfat_trace_json(char* buf, size_t size)
+{
+    unsigned int n = __atomic_load_n(&nrings, __ATOMIC_ACQUIRE);
+    struct trace_event e;
+    uint64_t head, i, seq;
+    unsigned int k;
+    size_t len = 0;
+    int first = 1;
+
+    buf[0] = '\0';
+    len = vfat_stats_put(buf, size, len, "{\"traceEvents\":[");
+    for(k = 0 ; k < n ; k++) {
+        struct trace_ring* r = rings[k];
+
+        head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        for(i = head > VFAT_TRACE_EVENTS ? head - VFAT_TRACE_EVENTS : 0 ; i < head ; i++) {
+            struct trace_event* src = &r->ev[i % VFAT_TRACE_EVENTS];
+
+            seq = __atomic_load_n(&src->seq, __ATOMIC_ACQUIRE);
+            if(seq & 1)
+                continue;
+            memcpy(&e, src, sizeof(e));
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if(__atomic_load_n(&src->seq, __ATOMIC_RELAXED) != seq)
+                continue;
+            e.path[VFAT_TRACE_PATH - 1] = '\0';
+
+            len = vfat_stats_put(buf, size, len, "%s\n{\"name\":\"%s\",\"cat\":\"fuse\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,"
+                      "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"path\":\"",
+                      first ? "" : ",", e.op, (int) getpid(), (int) e.tid,
+                      e.start_ns / 1e3, e.dur_ns / 1e3);
+            len = put_path(buf, size, len, e.path);
+            len = vfat_stats_put(buf, size, len, "\",\"ret\":%d,\"fat_lookups\":%u,\"clusters\":%u,\"syscalls\":%u,\"bytes\":%llu}}",
+                      e.ret, e.fat_lookups, e.clusters, e.syscalls, (unsigned long long) e.bytes);
+            first = 0;
+        }
+    }
+    len = vfat_stats_put(buf, size, len, "\n],\"displayTimeUnit\":\"ms\"}\n");
+    return len;
+}
@@ -0,0 +1,29 @@
+#ifndef H_TRACE
+#define H_TRACE
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "stats.h"
+
+// Events kept per thread, older ones are overwritten
+#define VFAT_TRACE_EVENTS       1024
+// Threads traced at the same time, a ring is reused once its thread exits
+#define VFAT_TRACE_THREADS      64
+// Bytes of the path kept per event, longer paths keep their tail
+#define VFAT_TRACE_PATH         48
+// Operations slower than this are logged (-o trace_slow_ms=N, 0 = off)
+#define VFAT_TRACE_SLOW_MS      100
+
+// An operation in progress, from vfat_trace_begin() to vfat_trace_end()
+struct vfat_trace_span {
+    uint64_t start_ns;
+    uint64_t base[VFAT_CNT_MAX];
+};
+
+void vfat_trace_begin(struct vfat_trace_span* sp);
+void vfat_trace_end(struct vfat_trace_span* sp, const char* op, const char* path, int ret);
+size_t vfat_trace_max_len(void);
+size_t vfat_trace_json(char* buf, size_t size);
+
+#endif
@@ -0,0 +1,252 @@
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <err.h>
+
+#include "uring.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define VFAT_HAVE_URING
+#endif
+#endif
+
+#ifdef VFAT_HAVE_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+// Every thread that reads gets its own ring, so submitting and reaping need
+// no locking. The ring goes away with its thread. Talks to the kernel with
+// the raw syscalls, there is no library to link against.
+struct uring {
+    int fd;
+    unsigned int entries;
+    void* sq_map;
+    size_t sq_map_len;
+    void* cq_map;               // sq_map when the kernel maps both at once
+    size_t cq_map_len;
+    struct io_uring_sqe* sqes;
+    unsigned int* sq_head;
+    unsigned int* sq_tail;
+    unsigned int* sq_mask;
+    unsigned int* sq_array;
+    unsigned int* cq_head;
+    unsigned int* cq_tail;
+    unsigned int* cq_mask;
+    struct io_uring_cqe* cqes;
+};
+
+static int uring_off;           // the kernel has no io_uring for us
+static pthread_key_t uring_key;
+static pthread_once_t uring_key_once = PTHREAD_ONCE_INIT;
+static __thread struct uring* mine;
+
+static void uring_free(void* data)
+{
+    struct uring* r = data;
+
+    if(r->sqes != NULL)
+        munmap(r->sqes, r->entries * sizeof(struct io_uring_sqe));
+    if(r->cq_map != NULL && r->cq_map != r->sq_map)
+        munmap(r->cq_map, r->cq_map_len);
+    if(r->sq_map != NULL)
+        munmap(r->sq_map, r->sq_map_len);
+    close(r->fd);
+    free(r);
+}
+
+static void uring_key_create(void)
+{
+    if(pthread_key_create(&uring_key, uring_free) != 0)
+        err(1, "pthread_key_create(uring)");
+}
+
+// Sets up the calling thread's ring, NULL if io_uring cannot be used
+static struct uring* uring_setup(void)
+{
+    struct io_uring_params p;
+    struct uring* r;
+    char* sq;
+    char* cq;
+
+    memset(&p, 0, sizeof(p));
+    r = calloc(1, sizeof(struct uring));
+    if(r == NULL)
+        return NULL;
+    r->fd = syscall(__NR_io_uring_setup, VFAT_URING_DEPTH, &p);
+    if(r->fd < 0) {
+        free(r);
+        return NULL;
+    }
+    r->entries = p.sq_entries;
+    r->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    r->cq_map_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if(p.features & IORING_FEAT_SINGLE_MMAP) {
+        if(r->cq_map_len > r->sq_map_len)
+            r->sq_map_len = r->cq_map_len;
+        r->cq_map_len = r->sq_map_len;
+    }
+    r->sq_map = mmap(NULL, r->sq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     r->fd, IORING_OFF_SQ_RING);
+    if(r->sq_map == MAP_FAILED) {
+        r->sq_map = NULL;
+        goto fail;
+    }
+    if(p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_map = r->sq_map;
+    } else {
+        r->cq_map = mmap(NULL, r->cq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         r->fd, IORING_OFF_CQ_RING);
+        if(r->cq_map == MAP_FAILED) {
+            r->cq_map = NULL;
+            goto fail;
+        }
+    }
+    r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if(r->sqes == MAP_FAILED) {
+        r->sqes = NULL;
+        goto fail;
+    }
+
+    sq = r->sq_map;
+    cq = r->cq_map;
+    r->sq_head = (unsigned int*)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned int*)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned int*)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned int*)(sq + p.sq_off.array);
+    r->cq_head = (unsigned int*)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned int*)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned int*)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    return r;
+
+fail:
+    uring_free(r);
+    return NULL;
+}
+
+static struct uring* uring_get(void)
+{
+    if(mine != NULL || __atomic_load_n(&uring_off, __ATOMIC_RELAXED))
+        return mine;
+    pthread_once(&uring_key_once, uring_key_create);
+    mine = uring_setup();
+    if(mine == NULL) {
+        // the first thread to find out tells, the rest stay quiet
+        if(!__atomic_exchange_n(&uring_off, 1, __ATOMIC_RELAXED))
+            warnx("io_uring is not available, reading with preadv");
+        return NULL;
+    }
+    pthread_setspecific(uring_key, mine);
+    return mine;
+}
+
+// Takes the completions that have arrived, returns how many
+static unsigned int uring_reap(struct uring* r, struct vfat_uring_read* reads)
+{
+    unsigned int head = *r->cq_head, n = 0;
+
+    while(head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe* cqe = &r->cqes[head & *r->cq_mask];
+
+        reads[cqe->user_data].res = cqe->res < 0 ? -1 : cqe->res;
+        head++;
+        n++;
+    }
+    __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    return n;
+}
+
+/**
+ * Waits for the reads the kernel already has, they still write into the
+ * callers' buffers. Completions land in the ring whether or not the wait
+ * itself works, so a failing io_uring_enter only turns the wait into polling.
+ */
+static void uring_settle(struct uring* r, struct vfat_uring_read* reads, unsigned int inflight)
+{
+    while(inflight > 0) {
+        inflight -= uring_reap(r, reads);
+        if(inflight > 0 &&
+           syscall(__NR_io_uring_enter, r->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 &&
+           errno != EINTR)
+            sched_yield();
+    }
+}
+
+/**
+ * Reads a batch with up to VFAT_URING_DEPTH of them in flight at once,
+ * all completions are reaped before returning
+ * @returns 0 with every res filled in, -1 if io_uring cannot be used and
+ *          nothing was submitted, the caller reads the batch itself then.
+ *          Reads the ring failed to pass on get res -1.
+ */
+int vfat_uring_readv(int fd, struct vfat_uring_read* reads, size_t count)
+{
+    struct uring* r = uring_get();
+    size_t next = 0, reaped = 0, i;
+    unsigned int inflight = 0, tail, unsubmitted, n;
+    int ret;
+
+    if(r == NULL)
+        return -1;
+
+    while(reaped < count) {
+        // queue as many reads as the ring has room for
+        tail = *r->sq_tail;
+        while(next < count && inflight < r->entries) {
+            unsigned int idx = tail & *r->sq_mask;
+            struct io_uring_sqe* sqe = &r->sqes[idx];
+
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = IORING_OP_READV;
+            sqe->fd = fd;
+            sqe->off = reads[next].offset;
+            sqe->addr = (uintptr_t) reads[next].iov;
+            sqe->len = reads[next].niov;
+            sqe->user_data = next;
+            r->sq_array[idx] = idx;
+            tail++;
+            next++;
+            inflight++;
+        }
+        __atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+
+        // the kernel moves sq_head past every entry it took
+        unsubmitted = tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+        ret = syscall(__NR_io_uring_enter, r->fd, unsubmitted, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if(ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            // the entries the kernel did not take are taken back
+            __atomic_store_n(r->sq_tail, tail - unsubmitted, __ATOMIC_RELEASE);
+            if(reaped == 0 && inflight == unsubmitted)
+                return -1;
+            // a read error, not the mount's: the rest fails, the caller
+            // gets a short read
+            for(i = next - unsubmitted ; i < count ; i++)
+                reads[i].res = -1;
+            uring_settle(r, reads, inflight - unsubmitted);
+            return 0;
+        }
+
+        n = uring_reap(r, reads);
+        inflight -= n;
+        reaped += n;
+    }
+    return 0;
+}
+
+#else
+
+int vfat_uring_readv(int fd, struct vfat_uring_read* reads, size_t count)
+{
+    return -1;
+}
+
+#endif
@@ -0,0 +1,21 @@
+#ifndef H_URING
+#define H_URING
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+// One vectored read of a batch
+struct vfat_uring_read {
+    off_t   offset;
+    const struct iovec* iov;
+    unsigned int niov;
+    ssize_t res;                // bytes read, -1 on error
+};
+
+// Reads in flight per thread
+#define VFAT_URING_DEPTH    64
+
+int vfat_uring_readv(int fd, struct vfat_uring_read* reads, size_t count);
+
+#endif
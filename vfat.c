@@ -6,34 +6,60 @@
 #include <endian.h>
 #include <err.h>
 #include <errno.h>
+#include <ctype.h>
 #include <fcntl.h>
-#include <iconv.h>
+#include <pthread.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/statvfs.h>
 #include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
 
 #include "vfat.h"
 #include "util.h"
+#include "extent.h"
+#include "io.h"
+#include "readahead.h"
+#include "cache.h"
+#include "dcache.h"
+#include "dirindex.h"
+#include "sidecar.h"
+#include "fatrun.h"
+#include "dev.h"
+#include "dirscan.h"
+#include "freespace.h"
+#include "fat.h"
+#include "dirwrite.h"
 #include "debugfs.h"
+#include "stats.h"
+#include "trace.h"
 
 #define DEBUG_PRINT(...) printf(__VA_ARGS__)
 
-iconv_t iconv_utf16;
+struct vfat_data vfat_info;
 char* DEBUGFS_PATH = "/.debug";
 
+// Paths under DEBUGFS_PATH are served by debugfs.c
+static int is_debugfs(const char *path)
+{
+    size_t len = strlen(DEBUGFS_PATH);
+
+    return strncmp(path, DEBUGFS_PATH, len) == 0 && (path[len] == '\0' || path[len] == '/');
+}
+
 
 static void
 vfat_init(const char *dev)
 {
     struct fat_boot_header s;
+    struct fat_fsinfo fsinfo;
     //int i;
-    uint8_t fat_0;
+    uint32_t* fat_mirror;
+    size_t i;
 
-    iconv_utf16 = iconv_open("utf-8", "utf-16"); // from utf-16 to utf-8
     // These are useful so that we can setup correct permissions in the mounted directories
     vfat_info.mount_uid = getuid();
     vfat_info.mount_gid = getgid();
@@ -41,10 +67,8 @@ vfat_init(const char *dev)
     // Use mount time as mtime and ctime for the filesystem root entry (e.g. "/")
     vfat_info.mount_time = time(NULL);
 
-    vfat_info.fd = open(dev, O_RDONLY);
-    if (vfat_info.fd < 0)
-        err(1, "open(%s)", dev);
-    if (pread(vfat_info.fd, &s, sizeof(s), 0) != sizeof(s))
+    vfat_dev_open(dev);
+    if (vfat_dev_read(&s, sizeof(s), 0) != sizeof(s))
         err(1, "read super block");
  
     /*** Check this volume is FAT32 ***/ 
@@ -66,7 +90,7 @@ vfat_init(const char *dev)
         err(1, "sectors_per_cluster is wrong!!\n");
 
     // bytes per cluster size check ( x < (32 * 1024) )
-    if(s.sectors_per_cluster * s.bytes_per_sector > 32 * 1024)
+    if(s.sectors_per_cluster * s.bytes_per_sector > VFAT_MAX_CLUSTER_SIZE)
         err(1, "bytes_per_cluster is too large!!\n");
 
     // reserved_sectors check(should not be zero)
@@ -136,20 +160,53 @@ vfat_init(const char *dev)
     vfat_info.fat_begin_offset = s.reserved_sectors * s.bytes_per_sector;
     //DEBUG_PRINT("FAT begin offset = 0x%x\n", vfat_info.fat_begin_offset);
     
-    // fd move to FAT area
-    if(lseek(vfat_info.fd, vfat_info.fat_begin_offset, SEEK_SET) == -1)
-        err(1, "lseek(%u)", vfat_info.fat_begin_offset);
-
-    // read the first(0) FAT(1bytes) to compares 'Media info'    
-    if(read(vfat_info.fd, &fat_0, sizeof(uint8_t)) != sizeof(uint8_t))
-        err(1, "read(%lu)", sizeof(uint8_t));
+    vfat_info.fat_count = s.fat_count;
+    // Bit 7 of fat_flags set means mirroring is off and only FAT[flags & 0xF] is live
+    if(s.fat_flags & 0x80)
+        vfat_info.active_fat = s.fat_flags & 0x0F;
+    else
+        vfat_info.active_fat = 0;
+    if(vfat_info.active_fat >= vfat_info.fat_count)
+        err(1, "active FAT %lu does not exist!!\n", vfat_info.active_fat);
+    vfat_info.fat_mirrored = !(s.fat_flags & 0x80);
+
+    // Map the active FAT once, chain lookups are plain memory loads after this.
+    // Writable mounts load a private copy that is written back in batches.
+    if(vfat_info.fat_compact && !vfat_info.read_only) {
+        warnx("fat=compact needs a read-only mount, keeping the whole FAT");
+        vfat_info.fat_compact = 0;
+    }
+    if(vfat_info.read_only)
+        vfat_info.fat = mmap_file(vfat_info.fd,
+            vfat_info.fat_begin_offset + vfat_info.active_fat * vfat_info.fat_size * vfat_info.bytes_per_sector,
+            vfat_info.fat_size * vfat_info.bytes_per_sector);
+    else
+        vfat_fat_load();
 
-    if(fat_0 != s.media_info)
+    // the first(0) FAT entry holds 'Media info' in its low byte
+    if((uint8_t)le32toh(vfat_info.fat[0]) != s.media_info)
         err(1, "Media info is different in FAT[0]!!\n");
-    
-    // fd init... to start of file
-    if(lseek(vfat_info.fd, 0, SEEK_SET) == -1)
-        err(1, "lseek(0)");
+
+    // check(compare) FAT#1 with FAT#2 once, instead of on every lookup
+    if(!(s.fat_flags & 0x80)) {
+        fat_mirror = mmap_file(vfat_info.fd,
+            vfat_info.fat_begin_offset + vfat_info.fat_size * vfat_info.bytes_per_sector,
+            vfat_info.fat_size * vfat_info.bytes_per_sector);
+        for(i = 0 ; i < vfat_info.count_of_cluster + 2 && i < vfat_info.fat_entries ; i++) {
+            if((le32toh(vfat_info.fat[i]) & 0x0FFFFFFF) != (le32toh(fat_mirror[i]) & 0x0FFFFFFF))
+                err(1, "FAT is corrupted!! FAT#1 and FAT#2 differ at %lu\n", i);
+        }
+        unmap(fat_mirror, vfat_info.fat_size * vfat_info.bytes_per_sector);
+    }
+
+    // -o fat=compact: encode the FAT as runs and let go of the mapping
+    if(vfat_info.fat_compact) {
+        vfat_fatrun_build(vfat_info.fat, vfat_info.fat_entries);
+        unmap(vfat_info.fat, vfat_info.fat_size * vfat_info.bytes_per_sector);
+        vfat_info.fat = NULL;
+        DEBUG_PRINT("Compact FAT : %lu bytes instead of %lu\n", vfat_fatrun_bytes(),
+                    vfat_info.fat_size * vfat_info.bytes_per_sector);
+    }
 
     // First Data Sector
     vfat_info.first_data_sector = s.reserved_sectors + (s.fat_count * vfat_info.fat_size) + vfat_info.root_dir_sectors;
@@ -163,6 +220,22 @@ vfat_init(const char *dev)
     vfat_info.direntry_per_cluster = (vfat_info.cluster_size * vfat_info.bytes_per_sector) / 32; 
     DEBUG_PRINT("Directory Entry per Cluster : 0x%x\n", vfat_info.direntry_per_cluster);
     
+    vfat_cache_init(vfat_info.cache_mb * 1024 * 1024);
+
+    // FSInfo free cluster hint, only believed if all signatures are in place
+    vfat_info.fsinfo_free = vfat_info.fsinfo_next_free = FSINFO_UNKNOWN;
+    if(s.fsinfo_sector != 0 && s.fsinfo_sector < s.reserved_sectors) {
+        if(vfat_dev_read(&fsinfo, sizeof(fsinfo), s.fsinfo_sector * s.bytes_per_sector) != sizeof(fsinfo))
+            err(1, "read FSInfo sector");
+        if(le32toh(fsinfo.lead_sig) == FSINFO_LEAD_SIG && le32toh(fsinfo.struc_sig) == FSINFO_STRUC_SIG &&
+           le32toh(fsinfo.trail_sig) == FSINFO_TRAIL_SIG) {
+            vfat_info.fsinfo_sector = s.fsinfo_sector;
+            if(le32toh(fsinfo.free_count) <= vfat_info.count_of_cluster)
+                vfat_info.fsinfo_free = le32toh(fsinfo.free_count);
+            vfat_info.fsinfo_next_free = le32toh(fsinfo.next_free);
+        }
+    }
+
     /* XXX add your code here */
     vfat_info.root_inode.st_ino = le32toh(s.root_cluster);
     vfat_info.root_inode.st_mode = 0555 | S_IFDIR;
@@ -172,6 +245,7 @@ vfat_init(const char *dev)
     vfat_info.root_inode.st_size = 0;
     vfat_info.root_inode.st_atime = vfat_info.root_inode.st_mtime = vfat_info.root_inode.st_ctime = vfat_info.mount_time;
 
+    vfat_sidecar_init(vfat_info.index_path, le32toh(s.serial));
 }
 
 unsigned char ChkSum(unsigned char * pFcbName){
@@ -185,216 +259,215 @@ unsigned char ChkSum(unsigned char * pFcbName){
     return (sum);
 }
 
-/* XXX add your code here */
-// Find cluster[n]'s offset
-void seek_cluster(uint32_t cluster_num)
+int vfat_next_cluster(uint32_t cluster_num)
 {
-    uint32_t first_sector_of_cluster;
+    // FAT is mapped in vfat_init(), so this is a single memory load
+    if(cluster_num >= vfat_info.fat_entries)
+        err(1, "cluster %u is out of FAT range!!\n", cluster_num);
+    vfat_count(VFAT_CNT_FAT_LOOKUPS, 1);
+
+    if(vfat_info.fat_compact)
+        return vfat_fatrun_next(cluster_num);
+    return le32toh(__atomic_load_n(&vfat_info.fat[cluster_num], __ATOMIC_RELAXED)) & 0x0FFFFFFF;
+}
 
-    if(cluster_num < 2)
-        err(1, "cluster number should be greater than 2!\n");
-    // ((n-2) * BPB_SecPerClus) + FirstDataSector
-    first_sector_of_cluster = ((cluster_num - 2) * vfat_info.sectors_per_cluster) + vfat_info.first_data_sector;
+// Per-thread scratch space of the readdir pipeline, reused for every cluster
+static __thread char dir_cluster_buf[VFAT_MAX_CLUSTER_SIZE];
+static __thread char dir_name_buf[VFAT_NAME_MAX_UTF8];
 
-    if(lseek(vfat_info.fd, first_sector_of_cluster * vfat_info.bytes_per_sector, SEEK_SET) == -1)
-        err(1, "lseek cluster_num %d\n", cluster_num);
-}
+static void fill_stat(const struct fat32_direntry *dir_entry, struct stat *stat_str);
 
-int vfat_next_cluster(uint32_t cluster_num)
-{
-    /* TODO: Read FAT to actually get the next cluster */
-    uint32_t fat_offset = vfat_info.fat_begin_offset;
-    uint32_t next_cluster;
-    uint32_t next_cluster_check;    // compare with FAT#2(backup)
-    
-    // Move fd to cluster area in FAT#1
-    if(lseek(vfat_info.fd, fat_offset + cluster_num * sizeof(uint32_t), SEEK_SET) == -1)
-        err(1, "lseek(%lu)", fat_offset + cluster_num * sizeof(uint32_t));
-    
-    if(read(vfat_info.fd, &next_cluster, sizeof(uint32_t)) != sizeof(uint32_t))
-        err(1, "read(%lu)", sizeof(uint32_t));
+// Characters allowed in a short name. Everything else is shown as '_'
+// instead of failing the whole directory.
+static const uint8_t short_name_ok[256] = {
+    ['!'] = 1, ['#'] = 1, ['$'] = 1, ['%'] = 1, ['&'] = 1, ['\''] = 1,
+    ['('] = 1, [')'] = 1, ['-'] = 1, ['@'] = 1, ['^'] = 1, ['_'] = 1,
+    ['`'] = 1, ['{'] = 1, ['}'] = 1, ['~'] = 1, [' '] = 1,
+    ['0' ... '9'] = 1, ['A' ... 'Z'] = 1, ['a' ... 'z'] = 1,
+    [0x80 ... 0xFF] = 1,    // OEM code page
+};
 
-    // check(compare) with FAT#2,
-    if(lseek(vfat_info.fd, fat_offset + vfat_info.fat_size * vfat_info.bytes_per_sector + cluster_num * sizeof(uint32_t), SEEK_SET) == -1)
-        err(1, "lseek(%d)", fat_offset);
+// Long file name being assembled, kept across cluster boundaries
+struct lfn_state {
+    uint16_t name[VFAT_LFN_MAX_UNITS];
+    int      valid;         // entries so far form a consistent chain
+    int      expect;        // seq number of the next entry, 0 once complete
+    int      units;         // UTF-16 units covered by the chain
+    uint8_t  csum;
+    uint32_t first;         // directory slot of the chain's first entry
+};
 
-    if(read(vfat_info.fd, &next_cluster_check, sizeof(uint32_t)) != sizeof(uint32_t))
-        err(1, "read(%lu)", sizeof(uint32_t));
+// One walk over a directory, the position survives cluster boundaries
+struct dir_walk {
+    struct lfn_state lfn;
+    uint32_t dir;           // first cluster of the directory
+    uint32_t base;          // slot number of the first slot in the current cluster
+    vfat_dirent_fill_t fill;
+    void*    filldata;
+};
 
-    if(next_cluster_check == next_cluster){
-        if(next_cluster == 0x0FFFFFFF)
-            return 0x0FFFFFFF;   // no next cluster. I am the end.
-        return next_cluster;
-    }
-    else {
-        err(1, "FAT is corrupted!!\n");
-    } // FAT#1 != FAT#2
-}
-
-// Read cluster and parse directory entries..
-static int read_cluster(uint32_t cluster_num, fuse_fill_dir_t filler, void *fillerdata){
-    uint8_t check_sum = '\0'; 
-    int i, j, seq_num = 0;
-    size_t in_byte_size = 2*260;
-    size_t out_byte_size = 260;
-
-    char * buf = calloc(260*2, sizeof(char));   // max name size = 13byte * 20entries = 260. one char 2byte(Unicode) 
-    char * char_buf = calloc(260, sizeof(char));
-
-    struct fat32_direntry short_entry;
-    struct fat32_direntry_long long_entry;
-
-    memset(buf, 0, 2*260);
-
-    seek_cluster(cluster_num);
-    // Loop read 32byte repeatly
-    for(i = 0 ; i < vfat_info.cluster_size ; i+=32){
-        if(read(vfat_info.fd, &short_entry, 32) != 32)
-            err(1, "read(short_dir)");
-        // first two entry is . and ..   (root cluster has no . and ..) 
-        if(i < 64 && cluster_num != 2){
-            char * filename = (i == 0) ? "." : "..";    // . -> .. 
-            setStat(short_entry,filename,filler,fillerdata,
-                (((uint32_t)short_entry.cluster_hi) << 16) | ((uint32_t)short_entry.cluster_lo));
-            continue;
-        }
-        
-        if((uint8_t)short_entry.nameext[0] == 0xE5)   // Deleted file entry
-            continue;
-        else if(short_entry.nameext[0] == 0x05){    // Japan??
-            short_entry.nameext[0] = (char)0xE5;
+// Converts up to units UTF-16 units (stopping at NUL) to NUL terminated UTF-8
+static void utf16_to_utf8(const uint16_t *in, int units, char *out)
+{
+    int i;
+
+    for(i = 0 ; i < units && in[i] != 0 ; i++) {
+        uint32_t c = le16toh(in[i]);
+
+        if(c >= 0xD800 && c < 0xDC00 && i + 1 < units) {
+            uint32_t lo = le16toh(in[i + 1]);
+            if(lo >= 0xDC00 && lo < 0xE000) {
+                c = 0x10000 + ((c - 0xD800) << 10) + (lo - 0xDC00);
+                i++;
+            } else {
+                c = 0xFFFD;
+            }
+        } else if(c >= 0xD800 && c < 0xE000) {
+            c = 0xFFFD;     // lone surrogate
         }
-        else if(short_entry.nameext[0] == 0x00){
-            // There are no allocated directory entries after.
-            free(buf);
-            free(char_buf);
-            return 0;
+
+        if(c < 0x80) {
+            *out++ = c;
+        } else if(c < 0x800) {
+            *out++ = 0xC0 | (c >> 6);
+            *out++ = 0x80 | (c & 0x3F);
+        } else if(c < 0x10000) {
+            *out++ = 0xE0 | (c >> 12);
+            *out++ = 0x80 | ((c >> 6) & 0x3F);
+            *out++ = 0x80 | (c & 0x3F);
+        } else {
+            *out++ = 0xF0 | (c >> 18);
+            *out++ = 0x80 | ((c >> 12) & 0x3F);
+            *out++ = 0x80 | ((c >> 6) & 0x3F);
+            *out++ = 0x80 | (c & 0x3F);
         }
+    }
+    *out = '\0';
+}
+
+// Copies the 13 name characters of one LFN entry to their place in the name
+static void lfn_store(struct lfn_state *lfn, const struct fat32_direntry_long *e)
+{
+    uint16_t *dst = lfn->name + ((e->seq & VFAT_LFN_SEQ_MASK) - 1) * 13;
+
+    memcpy(dst, e->name1, sizeof(e->name1));
+    memcpy(dst + 5, e->name2, sizeof(e->name2));
+    memcpy(dst + 11, e->name3, sizeof(e->name3));
+}
+
+// Feeds one LFN entry, found at directory slot, to the name assembler
+static void lfn_feed(struct lfn_state *lfn, const struct fat32_direntry_long *e, uint32_t slot)
+{
+    int seq = e->seq & VFAT_LFN_SEQ_MASK;
+
+    if(seq == 0 || seq * 13 > VFAT_LFN_MAX_UNITS) {
+        lfn->valid = 0;
+    } else if(e->seq & VFAT_LFN_SEQ_START) {
+        // The last part of the name comes first on disk
+        lfn->valid = 1;
+        lfn->csum = e->csum;
+        lfn->expect = seq - 1;
+        lfn->units = seq * 13;
+        lfn->first = slot;
+        lfn_store(lfn, e);
+    } else if(lfn->valid && seq == lfn->expect && e->csum == lfn->csum) {
+        lfn->expect--;
+        lfn_store(lfn, e);
+    } else {
+        lfn->valid = 0;     // orphaned or out of order, fall back to the 8.3 name
+    }
+}
 
-        //DEBUG_PRINT("File name : %s\n", short_entry.nameext);
-        // Long File Name 
-        if((short_entry.attr & VFAT_ATTR_LFN) == VFAT_ATTR_LFN){    //mask
-            long_entry = *((struct fat32_direntry_long * )&short_entry);
-            if((long_entry.seq & VFAT_LFN_SEQ_START) == 0x40){     // sequnce mask with 0x40
-                seq_num = (long_entry.seq & VFAT_LFN_SEQ_MASK) - 1;  // 0x3f is LONG_NAME_MASK
-                check_sum = long_entry.csum;
-                // get long file name
-                for(j = 0 ; j < 13 ; j++){
-                    if(j < 5 && long_entry.name1[j] != 0xFFFF){
-                        buf[j*2] = long_entry.name1[j];
-                        buf[j*2 + 1] = long_entry.name1[j] >> 8;    // why ??
-                    }
-                    else if(j < 11 && long_entry.name2[j-5] != 0xFFFF){
-                        buf[j*2] = long_entry.name2[j-5];
-                        buf[j*2 + 1] = long_entry.name2[j-5] >> 8;
-                    }
-                    else if(j < 13 && long_entry.name3[j-11] != 0xFFFF){
-                        buf[j*2] = long_entry.name3[j-11];
-                        buf[j*2 + 1] = long_entry.name3[j-11] >> 8;
-                    }
-                }
+// Parse one directory cluster held in memory. Returns 0 when the end of the
+// directory (or a full filler) was reached, 1 when the next cluster follows.
+static int read_cluster(const char *cluster_buf, struct dir_walk *walk)
+{
+    struct lfn_state *lfn = &walk->lfn;
+    struct vfat_dirscan scan;
+    struct vfat_dirent_loc loc;
+    struct stat st;
+    size_t w, prev = 0;
+
+    // Classify every slot up front, then only visit the interesting ones.
+    // Runs of free or deleted slots are skipped a whole word at a time.
+    vfat_dirscan(cluster_buf, vfat_info.cluster_size / 32, &scan);
+
+    for(w = 0 ; w * 64 < scan.nslots ; w++) {
+        uint64_t todo = scan.lfn[w] | scan.volume[w] | scan.live[w];
+
+        while(todo) {
+            size_t i = w * 64 + __builtin_ctzll(todo);
+            uint64_t bit = todo & -todo;
+            const struct fat32_direntry *short_entry = (const struct fat32_direntry *)(cluster_buf + i * 32);
+            const char *filename;
+
+            todo &= todo - 1;
+            // a deleted slot in between breaks any pending long name
+            if(vfat_dirscan_any(scan.deleted, prev, i))
+                lfn->valid = 0;
+            prev = i + 1;
+
+            // Long File Name
+            if(scan.lfn[w] & bit) {
+                lfn_feed(lfn, (const struct fat32_direntry_long *) short_entry, walk->base + i);
+                continue;
             }
-            else if(check_sum == long_entry.csum && long_entry.seq == seq_num){  // ord num is not 0x4~ 1st enctry
-                seq_num = -1;
-                char tmp[260*2];
-                memset(tmp, 0, 260 * 2);
-
-                for(j = 0 ; j < 260 * 2 ; j++){
-                    tmp[j] = buf[j];
-                }
-
-                memset(buf, 0, 260*2);
-
-                for(j = 0 ; j < 260 ; j++){
-                    if(j < 5 && long_entry.name1[j] != 0xFFFF){
-                        buf[j*2] = long_entry.name1[j];
-                        buf[j*2 + 1] = long_entry.name1[j] >> 8;    // why ??
-                    }
-                    else if(j < 11 && long_entry.name2[j-5] != 0xFFFF){
-                        buf[j*2] = long_entry.name2[j-5];
-                        buf[j*2 + 1] = long_entry.name2[j-5] >> 8;
-                    }
-                    else if(j < 13 && long_entry.name3[j-11] != 0xFFFF){
-                        buf[j*2] = long_entry.name3[j-11];
-                        buf[j*2 + 1] = long_entry.name3[j-11] >> 8;
-                    }// At first entry, take the precede entries's file name
-                    else if(j >= 13 && ((uint16_t *)tmp)[j-13] != 0xFFFF){
-                        buf[j*2] = tmp[(j-13) * 2];
-                        buf[j*2 + 1] = tmp[(j-13) * 2 + 1];
-                    }
-                }
+            if(scan.volume[w] & bit) {
+                lfn->valid = 0;
+                continue;
             }
-            else{   // Error field. Init all vars.
-                seq_num = 0;
-                check_sum = '\0';
-                memset(buf, 0, 260*2);
-                err(1, "Error!! Bad sequence number or checksum!!\n");
+
+            loc.dir = walk->dir;
+            loc.slot = loc.first = walk->base + i;
+            if(short_entry->nameext[0] == '.') {    // "." and ".." of a subdirectory
+                filename = short_entry->nameext[1] == '.' ? ".." : ".";
+            } else if(lfn->valid && lfn->expect == 0 &&
+                      lfn->csum == ChkSum((unsigned char *) short_entry->nameext)) {
+                utf16_to_utf8(lfn->name, lfn->units, dir_name_buf);
+                filename = dir_name_buf;
+                loc.first = lfn->first;
+            } else {
+                filename = GetFileName(short_entry->nameext, short_entry->res, dir_name_buf);
             }
-        }
-        else if((short_entry.attr & ATTR_VOLUME_ID) == ATTR_VOLUME_ID){
-            seq_num = 0;
-            check_sum = '\0';
-            memset(buf, 0, 260*2);
-        } // For Short entries..?
-        else if(check_sum == ChkSum((unsigned char *)&(short_entry.nameext)) && seq_num == 0){
-            char * buf_pointer = buf;
-            char * char_buf_pointer = char_buf;
-            iconv(iconv_utf16, &buf_pointer, &in_byte_size, &char_buf_pointer, &out_byte_size);
-            in_byte_size = 2 * 260;
-            out_byte_size = 260;
-            char * filename = char_buf;
-            setStat(short_entry,filename,filler,fillerdata,
-                (((uint32_t)short_entry.cluster_hi) << 16) | ((uint32_t)short_entry.cluster_lo));
-            check_sum = '\0';
-            memset(buf, 0, 260);
-        }
-        else{
-            char * filename = char_buf;
-            GetFileName(short_entry.nameext, filename);
-            setStat(short_entry,filename,filler,fillerdata,
-                (((uint32_t)short_entry.cluster_hi) << 16) | ((uint32_t)short_entry.cluster_lo));
+            lfn->valid = 0;
+
+            fill_stat(short_entry, &st);
+            vfat_count(VFAT_CNT_READDIR_ENTRIES, 1);
+            if(walk->fill(walk->filldata, filename, &st, &loc) != 0)
+                return 0;
         }
     }
+    if(vfat_dirscan_any(scan.deleted, prev, scan.nslots))
+        lfn->valid = 0;
 
-
-    free(buf);
-    free(char_buf);
+    if(scan.end)    // There are no allocated directory entries after.
+        return 0;
     return 1;   // directory is not finished.
 }
-void
-setStat(struct fat32_direntry dir_entry, char* buffer, fuse_fill_dir_t filler, void *fillerdata, uint32_t cluster_no){
-    struct stat* stat_str = malloc(sizeof(struct stat));
+
+// struct stat of a short entry, st_ino is the first cluster
+static void fill_stat(const struct fat32_direntry *dir_entry, struct stat *stat_str)
+{
     memset(stat_str, 0, sizeof(struct stat));
     
     stat_str->st_dev = 0; // Ignored by FUSE
-    stat_str->st_ino = cluster_no; // Ignored by FUSE unless overridden
-    if((dir_entry.attr & ATTR_READ_ONLY) == ATTR_READ_ONLY){
+    stat_str->st_ino = (((uint32_t) le16toh(dir_entry->cluster_hi)) << 16) | le16toh(dir_entry->cluster_lo);
+    if((dir_entry->attr & ATTR_READ_ONLY) == ATTR_READ_ONLY){
         stat_str->st_mode = S_IRUSR | S_IRGRP | S_IROTH;
     }
     else{
         stat_str->st_mode = S_IRWXU | S_IRWXG | S_IRWXO;
     }
     
-    if((dir_entry.attr & ATTR_DIRECTORY) == ATTR_DIRECTORY) {
+    if((dir_entry->attr & ATTR_DIRECTORY) == ATTR_DIRECTORY) {
         stat_str->st_mode |= S_IFDIR;
-        int cnt = 0;
-        uint32_t next_cluster_no = cluster_no;
-        off_t pos = lseek(vfat_info.fd, 0, SEEK_CUR);
-        
-        while(next_cluster_no < (uint32_t) 0x0FFFFFF8) {
-            cnt++;
-            next_cluster_no = vfat_next_cluster(0x0FFFFFFF & next_cluster_no);
-        }
-                
-        if(lseek(vfat_info.fd, pos, SEEK_SET) == -1) {
-            err(1, "Couldn't return to initial position: %lx", pos);
-        }
-        
-        stat_str->st_size = cnt * vfat_info.sectors_per_cluster * vfat_info.bytes_per_sector;
+        // Directory sizes need a chain walk, vfat_fuse_getattr() fills them
+        // in through vfat_dir_size() only when somebody asks
+        stat_str->st_size = 0;
     }
     else {
         stat_str->st_mode |= S_IFREG;
-        stat_str->st_size = dir_entry.size;
+        stat_str->st_size = le32toh(dir_entry->size);
     }
     stat_str->st_nlink = 1;
     stat_str->st_uid = vfat_info.mount_uid;
@@ -402,83 +475,78 @@ setStat(struct fat32_direntry dir_entry, char* buffer, fuse_fill_dir_t filler, v
     stat_str->st_rdev = 0;
     stat_str->st_blksize = 0; // Ignored by FUSE
     stat_str->st_blocks = 1;
-    stat_str->st_atime = conv_time(dir_entry.atime_date, 0);
-    stat_str->st_mtime = conv_time(dir_entry.mtime_date, dir_entry.mtime_time);
-    stat_str->st_ctime = conv_time(dir_entry.ctime_date, dir_entry.ctime_time);
-    filler(fillerdata, buffer, stat_str, 0);
-    free(stat_str);
+    stat_str->st_atime = conv_time(le16toh(dir_entry->atime_date), 0);
+    stat_str->st_mtime = conv_time(le16toh(dir_entry->mtime_date), le16toh(dir_entry->mtime_time));
+    stat_str->st_ctime = conv_time(le16toh(dir_entry->ctime_date), le16toh(dir_entry->ctime_time));
 }
-// Handle file name from directory entry
-char * GetFileName(char * nameext, char * filename){
 
-    if(nameext[0] == 0x20)  // 0x20 is space ' '
-        err(1, "filename[0] is 0x20!!\n");
+int
+setStat(const struct fat32_direntry *dir_entry, const char *buffer, fuse_fill_dir_t filler, void *fillerdata, uint32_t cluster_no){
+    struct stat stat_str;
+
+    fill_stat(dir_entry, &stat_str);
+    stat_str.st_ino = cluster_no;
+    return filler(fillerdata, buffer, &stat_str, 0);
+}
 
-    uint32_t FilenameCnt = 0;
+// Handle file name from directory entry: "NAME    EXT" -> "NAME.EXT"
+// case_flags is the NT reserved byte, 0x08 = lower case base, 0x10 = lower case extension
+char * GetFileName(const char * nameext, uint8_t case_flags, char * filename){
+    char * out = filename;
+    int name_len = 8, ext_len = 3;
     int i;
 
-    bool before_extension = true;
-    bool in_spaces = false;
-    bool in_extention = false;
-    // Check invalid chars
-    for(i = 0 ; i < 11 ; i++){
-        if(nameext[i] < 0x20 || nameext[i] == 0x22 || nameext[i] == 0x2A || nameext[i] == 0x2B ||
-            nameext[i] == 0x2C || nameext[i] == 0x2E || nameext[i] == 0x2F || nameext[i] == 0x3A ||
-            nameext[i] == 0x3B || nameext[i] == 0x3C || nameext[i] == 0x3D || nameext[i] == 0x3E ||
-            nameext[i] == 0x3F || nameext[i] == 0x5B || nameext[i] == 0x5C || nameext[i] == 0x5D ||
-            nameext[i] == 0x7C) {
-                err(1, "invalid character in filename %x at %d\n", nameext[i] & 0xFF, i);
-        }
-
-        if(before_extension){       // Before Extention 
-            if(nameext[i] == 0x20){ // remain space are filled with 0x20
-                before_extension = false;
-                in_spaces = true;
-                filename[FilenameCnt++] = '.';  // Extention
-            }
-            else if(i == 8){    // If all spaces are filled with character.
-                before_extension = false;   
-                in_spaces = true;
-                filename[FilenameCnt++] = '.';      // 9's letter is '.'
-                filename[FilenameCnt++] = nameext[i];   // First extention word
-                in_extention = true;
-            }
-            else{
-                filename[FilenameCnt++] = nameext[i];
-            }
-        }
-        else if(in_spaces){ // padded(with space) part
-            if(nameext[i] == 0x20){
-                in_spaces = false;
-                in_extention = true;
-                filename[FilenameCnt++] = nameext[i];
-            }
-        }
-        else if(in_extention){  // after 9th letter
-            if(nameext[i] == 0x20){
-                break;
-            }
-            else{
-                filename[FilenameCnt++] = nameext[i];
-            }
-        }
+    // trailing spaces are padding
+    while(name_len > 0 && nameext[name_len - 1] == ' ')
+        name_len--;
+    while(ext_len > 0 && nameext[8 + ext_len - 1] == ' ')
+        ext_len--;
+
+    for(i = 0 ; i < name_len ; i++) {
+        uint8_t c = (uint8_t) nameext[i];
+        if(i == 0 && c == 0x05)     // 0x05 stands for a leading 0xE5
+            c = 0xE5;
+        if(!short_name_ok[c])
+            c = '_';
+        *out++ = (case_flags & 0x08) ? tolower(c) : c;
     }
-
-    if(filename[FilenameCnt - 1] == '.'){
-        filename--;
+    if(ext_len > 0) {
+        *out++ = '.';
+        for(i = 8 ; i < 8 + ext_len ; i++) {
+            uint8_t c = (uint8_t) nameext[i];
+            if(!short_name_ok[c])
+                c = '_';
+            *out++ = (case_flags & 0x10) ? tolower(c) : c;
+        }
     }
-    filename[FilenameCnt] = '\0';   // Fill last word with NULL
-    //DEBUG_PRINT("filename : %s\n", filename);
+    *out = '\0';
     return filename;
 }
 
+// FAT stores local time. Entries of one directory share few distinct dates,
+// so each thread remembers the midnight of the date it converted last and
+// only the time of day is added per entry.
 time_t conv_time(uint16_t date_entry, uint16_t time_entry){
-    struct tm * time_info;  // tm struct define in <time.h>
-
-    time_t raw_time;
-
-    time(&raw_time);    // Get raw current time
-    time_info = localtime(&raw_time);   // parse the raw time
+    static __thread uint16_t cached_date = 0xFFFF;
+    static __thread time_t cached_midnight;
+
+    if(date_entry != cached_date) {
+        struct tm tm_buf;       // tm struct define in <time.h>
+        memset(&tm_buf, 0, sizeof(tm_buf));
+        /* 
+        0-4 bit Day 1-31
+        5-8 bit Month 1-12
+        9-15 bit Year from 1980(when bits are all 0)
+        0000000 0000 00000
+        YEAR    MONT DAY
+        */
+        tm_buf.tm_mday = (date_entry & 0x1f); // 0000 0000 0001 1111
+        tm_buf.tm_mon = ((date_entry & 0x1E0) >> 5) - 1;   // 0000 0001 1110 0000, tm_mon counts from 0
+        tm_buf.tm_year = ((date_entry & 0xFE00) >> 9) + 80;     // 1111 1110 0000 0000
+        tm_buf.tm_isdst = -1;
+        cached_midnight = mktime(&tm_buf);
+        cached_date = date_entry;
+    }
     /* 
     0-4 bit 2senond count 0 ~ 58
     5-10 bit minute 0~59
@@ -486,76 +554,80 @@ time_t conv_time(uint16_t date_entry, uint16_t time_entry){
     00000 000000 00000
     HOUR  MINUTE SECOND
     */
-    time_info->tm_sec = (time_entry & 0x1f) << 1;   // masking with 0000 0000 0001 1111. shift << 1  for LSB bit
-    time_info->tm_min = (time_entry & 0x7E0) >> 5;  // masking with 0000 0111 1110 0000
-    time_info->tm_hour = (time_entry & 0xF800) >> 11; // masking with 1111 1000 0000 0000 
-    /* 
-    0-4 bit Day 1-31
-    5-8 bit Month 1-12
-    9-15 bit Year from 1980(when bits are all 0)
-    0000000 0000 00000
-    YEAR    MONT DAY
-    */
-    time_info->tm_mday = (date_entry & 0x1f); // 0000 0000 0001 1111
-    time_info->tm_mon = (date_entry & 0x1E0) >> 5;   // 0000 0001 1110 0000
-    time_info->tm_year = ((date_entry & 0xFE00) >> 9) + 80;     // 1111 1110 0000 0000
-
-    return mktime(time_info);
+    return cached_midnight
+        + ((time_entry & 0xF800) >> 11) * 3600  // masking with 1111 1000 0000 0000
+        + ((time_entry & 0x7E0) >> 5) * 60      // masking with 0000 0111 1110 0000
+        + ((time_entry & 0x1f) << 1);           // masking with 0000 0000 0001 1111. shift << 1  for LSB bit
 }
 
-int vfat_readdir(uint32_t first_cluster, fuse_fill_dir_t filler, void *fillerdata)
+// Inverse of conv_time(), time_entry may be NULL
+void pack_time(time_t t, uint16_t *date_entry, uint16_t *time_entry)
 {
-    struct stat st; // we can reuse same stat entry over and over again
+    struct tm tm_buf;
+
+    localtime_r(&t, &tm_buf);
+    if(tm_buf.tm_year < 80) {    // FAT dates start in 1980
+        tm_buf.tm_year = 80;
+        tm_buf.tm_mon = 0;
+        tm_buf.tm_mday = 1;
+        tm_buf.tm_hour = tm_buf.tm_min = tm_buf.tm_sec = 0;
+    }
+    *date_entry = ((tm_buf.tm_year - 80) << 9) | ((tm_buf.tm_mon + 1) << 5) | tm_buf.tm_mday;
+    if(time_entry != NULL)
+        *time_entry = (tm_buf.tm_hour << 11) | (tm_buf.tm_min << 5) | (tm_buf.tm_sec >> 1);
+}
 
+/**
+ * Calls fill for every entry of the directory starting at first_cluster,
+ * together with where the entry is stored
+ * @returns 0
+ */
+int vfat_readdir_loc(uint32_t first_cluster, vfat_dirent_fill_t fill, void *filldata)
+{
+    struct dir_walk walk;
     uint32_t next_cluster_num = first_cluster;
-    bool eof = false;
-    int end_of_read;
-
-    memset(&st, 0, sizeof(st));
-    st.st_uid = vfat_info.mount_uid;
-    st.st_gid = vfat_info.mount_gid;
-    st.st_nlink = 1;
-
-    while(!eof){
-        end_of_read = read_cluster(next_cluster_num, filler, fillerdata);
-
-        if(end_of_read == 0)
-            eof = true;
-        else{
-            next_cluster_num = 0x0FFFFFFF & vfat_next_cluster(next_cluster_num);
-            if(next_cluster_num >= (uint32_t)0xFFFFFF8){
-                eof = true;
-            }
-        }
+    size_t hops = 0;
+
+    walk.lfn.valid = 0;
+    walk.dir = first_cluster;
+    walk.base = 0;
+    walk.fill = fill;
+    walk.filldata = filldata;
+    // read_cluster() parses straight out of the per-thread cluster buffer,
+    // nothing is allocated per cluster or per entry
+    while(next_cluster_num >= 2 && next_cluster_num < (uint32_t) 0x0FFFFFF8 &&
+          hops++ <= vfat_info.count_of_cluster) {
+        if(vfat_cache_read_cluster(next_cluster_num, dir_cluster_buf) != 0)
+            err(1, "pread cluster_num %d\n", next_cluster_num);
+        if(read_cluster(dir_cluster_buf, &walk) == 0)
+            break;
+        walk.base += vfat_info.cluster_size / 32;
+        next_cluster_num = vfat_next_cluster(next_cluster_num);
     }
-
-    /* XXX add your code here */
     return 0;
 }
 
-
-// Used by vfat_search_entry()
-struct vfat_search_data {
-    const char*  name;
-    int          found;
-    struct stat* st;
+struct filler_args {
+    fuse_fill_dir_t filler;
+    void* fillerdata;
 };
 
-
-// You can use this in vfat_resolve as a callback function for vfat_readdir
-// This way you can get the struct stat of the subdirectory/file.
-int vfat_search_entry(void *data, const char *name, const struct stat *st, off_t offs)
+static int fill_from_filler(void *data, const char *name, const struct stat *st,
+                            const struct vfat_dirent_loc *unused_loc)
 {
-    struct vfat_search_data *sd = data;
+    struct filler_args *args = data;
 
-    if (strcmp(sd->name, name) != 0) return 0;
+    return args->filler(args->fillerdata, name, st, 0);
+}
 
-    sd->found = 1;
-    *sd->st = *st;
+int vfat_readdir(uint32_t first_cluster, fuse_fill_dir_t filler, void *fillerdata)
+{
+    struct filler_args args = { filler, fillerdata };
 
-    return 1;
+    return vfat_readdir_loc(first_cluster, fill_from_filler, &args);
 }
 
+
 /**
  * Fills in stat info for a file/directory given the path
  * @path full path to a file, directories separated by slash
@@ -564,57 +636,120 @@ int vfat_search_entry(void *data, const char *name, const struct stat *st, off_t
 */
 int vfat_resolve(const char *path, struct stat *st)
 {
-    /* TODO: Add your code here.
-        You should tokenize the path (by slash separator) and then
-        for each token search the directory for the file/dir with that name.
-        You may find it useful to use following functions:
-        - strtok to tokenize by slash. See manpage
-        - vfat_readdir in conjuction with vfat_search_entry
-    */
-    struct vfat_search_data sd;
-    int i;
-    const char *final_name;
-    char *token = NULL, *path_copy;
+    return vfat_resolve_loc(path, st, NULL);
+}
 
-    path_copy = malloc(strlen(path) + 1);
-    strncpy(path_copy, path, strlen(path) + 1);
+/**
+ * vfat_resolve() that also tells where the entry of the last component is
+ * @loc may be NULL, loc->dir is 0 for the root directory
+ */
+int vfat_resolve_loc(const char *path, struct stat *st, struct vfat_dirent_loc *loc)
+{
+    uint32_t parent = vfat_info.root_cluster;
+    char *token, *saveptr, *path_copy;
+    struct vfat_dirent_loc cur_loc;
+    unsigned long gen = vfat_dcache_generation();
+    uint64_t start = vfat_stats_start();
+    int ret = 0;
+
+    path_copy = strdup(path);
+    if(path_copy == NULL)
+        return -ENOMEM;
+    *st = vfat_info.root_inode;
+    memset(&cur_loc, 0, sizeof(cur_loc));
+
+    // Walk the path one component at a time, each directory is only looked
+    // up in its name index when (parent cluster, name) is not in the dentry cache
+    for(token = strtok_r(path_copy, "/", &saveptr); token != NULL; token = strtok_r(NULL, "/", &saveptr)) {
+        if(!S_ISDIR(st->st_mode)) {
+            ret = -ENOTDIR;
+            break;
+        }
 
-    memset(&sd, 0, sizeof(struct vfat_search_data));
-    sd.st = st;
+        ret = vfat_dcache_lookup(parent, token, st, &cur_loc);
+        if(ret == VFAT_DCACHE_MISS) {
+            ret = vfat_dir_index_lookup(parent, token, st, &cur_loc);
+            vfat_dcache_insert(parent, token, ret == 0 ? st : NULL, &cur_loc, gen);
+        }
+        if(ret != 0)
+            break;
 
-    for(i = strlen(path); path[i] != '/'; i--);
-    final_name = path + i + 1;
+        // ".." of a top level directory points to cluster 0, which is the root
+        parent = st->st_ino ? (uint32_t) st->st_ino : vfat_info.root_cluster;
+    }
 
-    token = strtok(path_copy, "/");
-    sd.name = token;
+    free(path_copy);
+    if(loc != NULL)
+        *loc = cur_loc;
+    vfat_stats_op(VFAT_OP_RESOLVE, start);
+    return ret;
+}
 
-    vfat_readdir(vfat_info.root_cluster, vfat_search_entry, &sd);
+// Directory sizes already computed, a colliding slot is simply replaced
+static struct {
+    uint32_t cluster;
+    off_t    size;
+} dir_size_memo[VFAT_DIRSIZE_SLOTS];
+static pthread_mutex_t dir_size_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long dir_size_gen;     // bumped by vfat_dir_size_invalidate()
 
-    if(sd.found == 1) {
-        while(strcmp(sd.name, final_name) != 0) {
-            token = strtok(NULL, "/");
-            if(token == NULL) {
-                free(path_copy);
-                return -ENOENT;
-            }
-            sd.name = token;
-            sd.found = 0;
-            vfat_readdir(((uint32_t) (sd.st)->st_ino), vfat_search_entry, &sd);
-            if(sd.found != 1) {
-                free(path_copy);
-                return -ENOENT;
-            }
-        }
-        free(path_copy);
-        return 0;
+// Size of a directory (its chain length in bytes), memoized per first cluster
+off_t vfat_dir_size(uint32_t cluster_no)
+{
+    size_t slot;
+    off_t size;
+    uint32_t next_cluster_no, nclusters;
+    size_t cnt = 0;
+    unsigned long gen;
+
+    // ".." of a top level directory points to cluster 0, which is the root
+    if(cluster_no == 0)
+        cluster_no = vfat_info.root_cluster;
+    slot = cluster_no % VFAT_DIRSIZE_SLOTS;
+
+    pthread_mutex_lock(&dir_size_lock);
+    if(dir_size_memo[slot].cluster == cluster_no) {
+        size = dir_size_memo[slot].size;
+        pthread_mutex_unlock(&dir_size_lock);
+        return size;
+    }
+    gen = dir_size_gen;
+    pthread_mutex_unlock(&dir_size_lock);
+
+    if(vfat_sidecar_chain(cluster_no, NULL, NULL, &nclusters) == 0) {
+        cnt = nclusters;
     } else {
-        free(path_copy);
-        return -ENOENT;
+        next_cluster_no = cluster_no;
+        while(next_cluster_no >= 2 && next_cluster_no < (uint32_t) 0x0FFFFFF8 && cnt <= vfat_info.count_of_cluster) {
+            cnt++;
+            next_cluster_no = vfat_next_cluster(next_cluster_no);
+        }
     }
+    size = (off_t) cnt * vfat_info.cluster_size;
+
+    pthread_mutex_lock(&dir_size_lock);
+    if(gen == dir_size_gen) {
+        dir_size_memo[slot].cluster = cluster_no;
+        dir_size_memo[slot].size = size;
+    }
+    pthread_mutex_unlock(&dir_size_lock);
+    return size;
+}
+
+// Forgets the size of a directory whose chain changed
+void vfat_dir_size_invalidate(uint32_t cluster_no)
+{
+    size_t slot = cluster_no % VFAT_DIRSIZE_SLOTS;
+
+    pthread_mutex_lock(&dir_size_lock);
+    dir_size_gen++;
+    if(dir_size_memo[slot].cluster == cluster_no)
+        dir_size_memo[slot].cluster = 0;
+    pthread_mutex_unlock(&dir_size_lock);
 }
 
 // Get file attributes
-int vfat_fuse_getattr(const char *path, struct stat *st)
+static int getattr(const char *path, struct stat *st)
 {
        // No such file
     if (strcmp(path, "/") == 0) {
@@ -625,17 +760,7 @@ int vfat_fuse_getattr(const char *path, struct stat *st)
         st->st_uid = vfat_info.mount_uid;
         st->st_gid = vfat_info.mount_gid;
         st->st_rdev = 0;
-        int cnt = 0;
-        uint32_t next_cluster_no = vfat_info.root_cluster;
-        off_t pos = lseek(vfat_info.fd, 0, SEEK_CUR);
-        while(next_cluster_no < (uint32_t) 0x0FFFFFF8) {
-            cnt++;
-            next_cluster_no = vfat_next_cluster(0x0FFFFFFF & next_cluster_no);
-        }
-        if(lseek(vfat_info.fd, pos, SEEK_SET) == -1) {
-            err(1, "Couldn't return to initial position: %lx", pos);
-        }
-        st->st_size = cnt * vfat_info.cluster_size;
+        st->st_size = vfat_dir_size(vfat_info.root_cluster);
         st->st_blksize = 0; // Ignored by FUSE
         st->st_blocks = 1;
         return 0;
@@ -643,17 +768,25 @@ int vfat_fuse_getattr(const char *path, struct stat *st)
     if(vfat_resolve(path + 1, st) != 0) {
         return -ENOENT;
     } else {
+        if(S_ISDIR(st->st_mode))
+            st->st_size = vfat_dir_size((uint32_t) st->st_ino);
         return 0;
     }
-    /*
-    if (strncmp(path, DEBUGFS_PATH, strlen(DEBUGFS_PATH)) == 0) {
+}
+
+int vfat_fuse_getattr(const char *path, struct stat *st)
+{
+    uint64_t start;
+    int ret;
+
+    if (is_debugfs(path)) {
         // This is handled by debug virtual filesystem
         return debugfs_fuse_getattr(path + strlen(DEBUGFS_PATH), st);
-    } else {
-        // Normal file
-        return vfat_resolve(path, st);
     }
-    */
+    start = vfat_stats_start();
+    ret = getattr(path, st);
+    vfat_stats_op(VFAT_OP_GETATTR, start);
+    return ret;
 }
 
 // Extended attributes useful for debugging
@@ -675,122 +808,1687 @@ int vfat_fuse_getxattr(const char *path, const char* name, char* buf, size_t siz
     }
 }
 
-int vfat_fuse_readdir(
+static int list_dir(
         const char *path, void *buf,
         fuse_fill_dir_t filler, off_t unused_offs, struct fuse_file_info *unused_fi)
 {
-    struct stat st;     
+    struct stat st;
+    struct vfat_dir_index* idx;
+    size_t i;
+
     if(strcmp(path, "/") != 0) {
-        vfat_resolve(path+1, &st);
-        vfat_readdir((uint32_t)st.st_ino, filler, buf);
+        if(vfat_resolve(path+1, &st) != 0)
+            return -ENOENT;
+        if(!S_ISDIR(st.st_mode))
+            return -ENOTDIR;
+        idx = vfat_dir_index_get((uint32_t)st.st_ino);
     } else {
-        vfat_readdir(vfat_info.root_cluster, filler, buf);
+        idx = vfat_dir_index_get(vfat_info.root_cluster);
     }
-    /* TODO: Add your code here. You should reuse vfat_readdir and vfat_resolve functions
-    */
+
+    // The first listing parses the directory and builds its name index,
+    // later listings and lookups are served from the index
+    for(i = 0 ; i < idx->count ; i++) {
+        if(filler(buf, idx->entries[i].name, &idx->entries[i].st, 0) != 0)
+            break;
+    }
+    vfat_dir_index_put(idx);
     return 0;
 }
 
-int vfat_fuse_read(
-        const char *path, char *buf, size_t size, off_t offs,
-        struct fuse_file_info *unused)
+int vfat_fuse_readdir(
+        const char *path, void *buf,
+        fuse_fill_dir_t filler, off_t offs, struct fuse_file_info *fi)
 {
-    /*
-    if (strncmp(path, DEBUGFS_PATH, strlen(DEBUGFS_PATH)) == 0) {
+    uint64_t start;
+    int ret;
+
+    if (is_debugfs(path)) {
         // This is handled by debug virtual filesystem
-        return debugfs_fuse_read(path + strlen(DEBUGFS_PATH), buf, size, offs, unused);
-    }
-    TODO: Add your code here. Look at debugfs_fuse_read for example interaction.
-    */
-    struct stat st;
-    vfat_resolve(path+1, &st);
-    if(!(st.st_mode & S_IFREG)) {
-        DEBUG_PRINT("Trying to read a directory or not regular file\n");
-        return -1;
+        return debugfs_fuse_readdir(path + strlen(DEBUGFS_PATH), buf, filler, offs, fi);
     }
+    start = vfat_stats_start();
+    ret = list_dir(path, buf, filler, offs, fi);
+    vfat_stats_op(VFAT_OP_READDIR, start);
+    return ret;
+}
 
-    size_t cnt = 0;
-    uint32_t cluster_no = (uint32_t) st.st_ino;
+/**
+ * Splits a byte range of a file into one device segment per extent it touches
+ * @buf segment buffers point into it, NULL if only the device side is wanted
+ * @segsp gets a malloc'ed segment array the caller frees
+ * @returns number of segments, they cover less than size if the chain ends early
+ */
+static size_t vfat_file_segments(const struct vfat_extent_map *map, char *buf, size_t size, off_t offs,
+                                 struct vfat_io_seg **segsp)
+{
+    const struct vfat_extent* ext;
+    struct vfat_io_seg* segs;
+    size_t nsegs = 0, cnt = 0;
 
-    if(offs >= st.st_size) {
-        memset(buf, 0, size);
+    *segsp = segs = malloc((size / vfat_info.cluster_size + 2) * sizeof(struct vfat_io_seg));
+    if(segs == NULL)
         return 0;
+
+    // Map offset -> extent by binary search, one segment per contiguous run
+    while(cnt < size) {
+        off_t pos = offs + cnt;
+        off_t in_extent;
+        size_t len;
+
+        ext = vfat_extent_find(map, pos / vfat_info.cluster_size);
+        if(ext == NULL)
+            break;  // chain is shorter than the file size claims
+        in_extent = pos - (off_t) ext->file_cluster * vfat_info.cluster_size;
+        len = (size_t) ext->length * vfat_info.cluster_size - in_extent;
+        if(len > size - cnt)
+            len = size - cnt;
+
+        segs[nsegs].dev_offset = vfat_cluster_offset(ext->disk_cluster) + in_extent;
+        segs[nsegs].len = len;
+        segs[nsegs].buf = buf ? buf + cnt : NULL;
+        nsegs++;
+        cnt += len;
     }
+    return nsegs;
+}
+
+// Reads a byte range of the file mapped by map straight from the device
+static ssize_t vfat_read_extents(const struct vfat_extent_map *map, char *buf, size_t size, off_t offs)
+{
+    struct vfat_io_seg* segs;
+    size_t nsegs;
+    ssize_t ret;
+
+    if(size == 0)
+        return 0;
+
+    nsegs = vfat_file_segments(map, buf, size, offs, &segs);
+    if(segs == NULL)
+        return -1;
+
+    // Runs that sit close together on disk are fetched by one preadv
+    ret = vfat_read_segments(segs, nsegs);
+    free(segs);
+    if(ret == 0 && nsegs > 0)
+        return -1;
+    return ret;
+}
+
+/**
+ * Reads a byte range of the file starting at first_cluster
+ * @offs, @size range inside the file, the caller clamps it to the file size
+ * @returns bytes read, short only if the chain ends early, -1 on I/O error
+ */
+ssize_t vfat_read_file(uint32_t first_cluster, char *buf, size_t size, off_t offs)
+{
+    struct vfat_extent_map* map;
+    ssize_t ret;
+
+    if(size == 0)
+        return 0;
+    map = vfat_extent_map_get(first_cluster);
+    ret = vfat_read_extents(map, buf, size, offs);
+    vfat_extent_map_put(map);
+    return ret;
+}
+
+// Reads a small file cluster by cluster through the cluster cache
+static ssize_t vfat_read_file_cached(const struct vfat_extent_map *map, char *buf, size_t size, off_t offs)
+{
+    const struct vfat_extent* ext;
+    char* cluster_buf = malloc(vfat_info.cluster_size);
+    size_t cnt = 0;
 
-    while(offs >= vfat_info.cluster_size) {
-        cluster_no = vfat_next_cluster(cluster_no);
-        offs -= vfat_info.cluster_size;
+    if(cluster_buf == NULL)
+        return -1;
+    while(cnt < size) {
+        off_t pos = offs + cnt;
+        uint32_t file_cluster = pos / vfat_info.cluster_size;
+        size_t in_cluster = pos % vfat_info.cluster_size;
+        size_t len = vfat_info.cluster_size - in_cluster;
+
+        ext = vfat_extent_find(map, file_cluster);
+        if(ext == NULL)
+            break;
+        if(len > size - cnt)
+            len = size - cnt;
+        if(vfat_cache_read_cluster(ext->disk_cluster + (file_cluster - ext->file_cluster), cluster_buf) != 0)
+            break;
+        memcpy(buf + cnt, cluster_buf + in_cluster, len);
+        cnt += len;
     }
+    free(cluster_buf);
+    return (cnt == 0 && size > 0) ? -1 : (ssize_t) cnt;
+}
+
+// Files open through vfat_fuse_open(), found by where their entry is. All
+// handles of a file share one. A rename moves it along with the entry,
+// every change of the entry bumps gen.
+struct vfat_open_file {
+    struct vfat_dirent_loc loc;
+    unsigned long gen;
+    int refs;                   // handles on the file
+    int writers;                // of them opened for writing
+    int unlinked;               // the entry is gone, no longer hashed
+    uint32_t first_cluster;     // chain an unlinked file still holds
+    struct vfat_open_file* next;
+};
 
-    seek_cluster(cluster_no);
-    if(lseek(vfat_info.fd, offs, SEEK_CUR) == -1) {
-        err(1, "seek last part of offset failed\n");
+#define VFAT_OPEN_BUCKETS   64
+
+static struct vfat_open_file* open_files[VFAT_OPEN_BUCKETS];
+static pthread_mutex_t open_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct vfat_open_file** open_bucket(const struct vfat_dirent_loc *loc)
+{
+    return &open_files[(loc->dir * 2654435761u + loc->slot) % VFAT_OPEN_BUCKETS];
+}
+
+// The open file with its entry at loc or NULL, called with open_lock held
+static struct vfat_open_file* open_find(const struct vfat_dirent_loc *loc)
+{
+    struct vfat_open_file* f;
+
+    for(f = *open_bucket(loc) ; f != NULL ; f = f->next) {
+        if(f->loc.dir == loc->dir && f->loc.slot == loc->slot)
+            return f;
     }
+    return NULL;
+}
 
-    if(vfat_info.cluster_size - offs > size) {
-        if(read(vfat_info.fd, buf+cnt, size) != size) {
-            err(1, "read cluster-offs > size failed\n");
-        }
-        return 0; // TODO CHECK THIS
-    } else {
-        if(read(vfat_info.fd, buf+cnt, vfat_info.cluster_size - offs) != vfat_info.cluster_size-offs) {
-            err(1, "read cluster-offs <= size failed\n");
-        }
-        cnt += vfat_info.cluster_size - offs;
+// Unhashes an open file, called with open_lock held
+static void open_unhash(struct vfat_open_file* f)
+{
+    struct vfat_open_file** pp = open_bucket(&f->loc);
+
+    while(*pp != f)
+        pp = &(*pp)->next;
+    *pp = f->next;
+}
+
+// Takes a reference to the open file of the entry at loc
+static struct vfat_open_file* open_get(const struct vfat_dirent_loc *loc)
+{
+    struct vfat_open_file* f;
+
+    pthread_mutex_lock(&open_lock);
+    f = open_find(loc);
+    if(f == NULL && (f = calloc(1, sizeof(struct vfat_open_file))) != NULL) {
+        f->loc = *loc;
+        f->next = *open_bucket(loc);
+        *open_bucket(loc) = f;
     }
+    if(f != NULL)
+        f->refs++;
+    pthread_mutex_unlock(&open_lock);
+    return f;
+}
 
-    while(size - cnt > vfat_info.cluster_size) {
-        cluster_no = vfat_next_cluster(cluster_no);
-        seek_cluster(cluster_no);
-        DEBUG_PRINT("Read cluster_no %x\n", cluster_no);
-        if((cluster_no & 0x0fffffff) >= 0x0FFFFFF8) {
-            memset(buf+cnt, 0, size-cnt);
-            return cnt;
-        }
-        if(read(vfat_info.fd, buf+cnt, vfat_info.cluster_size) != vfat_info.cluster_size) {
-            err(1, "read cluster_size failed\n");
-        }
-        cnt += vfat_info.cluster_size;
+// Drops a reference, the last one of an unlinked file frees its chain
+static void open_put(struct vfat_open_file* f)
+{
+    uint32_t orphan = 0;
+
+    pthread_mutex_lock(&open_lock);
+    if(--f->refs == 0) {
+        if(f->unlinked)
+            orphan = f->first_cluster;
+        else
+            open_unhash(f);
+        free(f);
     }
+    pthread_mutex_unlock(&open_lock);
+    if(orphan != 0)
+        vfat_chain_reclaim(orphan);
+}
+
+// A handle opened for writing was released
+// @returns whether it was the file's last writer, loc gets the entry then
+static int open_writer_done(struct vfat_open_file* f, struct vfat_dirent_loc *loc)
+{
+    int last;
+
+    pthread_mutex_lock(&open_lock);
+    last = --f->writers == 0 && !f->unlinked;
+    *loc = f->loc;
+    pthread_mutex_unlock(&open_lock);
+    return last;
+}
+
+// The entry at loc changed, handles on it refresh on their next read
+static void open_changed(const struct vfat_dirent_loc *loc)
+{
+    struct vfat_open_file* f;
+
+    pthread_mutex_lock(&open_lock);
+    if((f = open_find(loc)) != NULL)
+        __atomic_store_n(&f->gen, f->gen + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&open_lock);
+}
 
-    cluster_no = vfat_next_cluster(cluster_no);
-    seek_cluster(cluster_no);
-    if((cluster_no & 0x0fffffff) >= 0x0FFFFFF8) {
-        memset(buf+cnt, 0, size-cnt);
-        return cnt;
+// The entry at from was moved to to by a rename
+static void open_moved(const struct vfat_dirent_loc *from, const struct vfat_dirent_loc *to)
+{
+    struct vfat_open_file* f;
+
+    pthread_mutex_lock(&open_lock);
+    if((f = open_find(from)) != NULL) {
+        open_unhash(f);
+        f->loc = *to;
+        f->next = *open_bucket(to);
+        *open_bucket(to) = f;
+        __atomic_store_n(&f->gen, f->gen + 1, __ATOMIC_RELEASE);
     }
+    pthread_mutex_unlock(&open_lock);
+}
 
-    if(cnt < size) {
-        if(read(vfat_info.fd, buf+cnt, size - cnt) != size - cnt) {
-            err(1, "read cluster_size failed\n");
-        }
-        cnt += size-cnt;
+/**
+ * The entry at loc was removed. An open file keeps reading its chain, which
+ * is only reclaimed once the last handle is released.
+ * @returns whether the file is open, the caller must not reclaim it then
+ */
+static int open_unlinked(const struct vfat_dirent_loc *loc, uint32_t first_cluster)
+{
+    struct vfat_open_file* f;
+
+    pthread_mutex_lock(&open_lock);
+    if((f = open_find(loc)) != NULL) {
+        open_unhash(f);
+        f->unlinked = 1;
+        f->first_cluster = first_cluster;
+        __atomic_store_n(&f->gen, f->gen + 1, __ATOMIC_RELEASE);
     }
+    pthread_mutex_unlock(&open_lock);
+    return f != NULL;
+}
 
+// What open() resolved, kept in fi->fh until release(). The handle follows
+// the file's entry, not its path: it is refreshed from the entry when that
+// changed, renames and changes to other files leave it alone.
+struct vfat_handle {
+    pthread_rwlock_t lock;      // readers share it, a refresh takes it alone
+    struct vfat_open_file* file;
+    int writable;               // opened for writing
+    int resolved;               // the fields below describe the file
+    unsigned long gen;          // file->gen they were taken at
+    struct stat st;
+    struct vfat_extent_map* map;    // NULL for an empty file
+    struct vfat_readahead* ra;      // NULL while reads go through the cache
+};
 
-    return cnt; // number of bytes read from the file
-          // must be size unless EOF reached, negative for an error
+static struct vfat_handle* file_handle(struct fuse_file_info *fi)
+{
+    return fi != NULL ? (struct vfat_handle*)(uintptr_t) fi->fh : NULL;
+}
+
+// Lets go of the map and readahead state, called with the handle held alone
+static void handle_drop(struct vfat_handle *h)
+{
+    if(h->map != NULL)
+        vfat_extent_map_put(h->map);
+    if(h->ra != NULL)
+        vfat_readahead_put(h->ra);
+    h->map = NULL;
+    h->ra = NULL;
+    h->resolved = 0;
+}
+
+// (Re)fills the handle from the file's entry, called with the handle held alone
+static int handle_resolve(struct vfat_handle *h)
+{
+    struct fat32_direntry e;
+    struct vfat_dirent_loc loc;
+    int unlinked;
+
+    pthread_mutex_lock(&open_lock);
+    h->gen = h->file->gen;
+    loc = h->file->loc;
+    unlinked = h->file->unlinked;
+    pthread_mutex_unlock(&open_lock);
+    // nothing changes an unlinked file, the handle keeps what it has
+    if(unlinked)
+        return h->resolved ? 0 : -ENOENT;
+
+    handle_drop(h);
+    if(vfat_dirent_read(loc.dir, loc.slot, &e) != 0)
+        return -EIO;
+    fill_stat(&e, &h->st);
+    if(!S_ISREG(h->st.st_mode))
+        return -EISDIR;
+    if(h->st.st_size > 0) {
+        h->map = vfat_extent_map_get((uint32_t) h->st.st_ino);
+        // Small (typically hot) files are kept in the cluster cache, they
+        // would only take a readahead slot away from large ones
+        if(h->st.st_size > VFAT_CACHE_SMALL_FILE || !vfat_cache_enabled())
+            h->ra = vfat_readahead_get((uint32_t) h->st.st_ino, h->st.st_size);
+    }
+    h->resolved = 1;
     return 0;
 }
 
-////////////// No need to modify anything below this point
-int
-vfat_opt_args(void *data, const char *arg, int key, struct fuse_args *oargs)
+// Resolves path once and pins the handle to the entry it names
+static int handle_open(struct vfat_handle *h, const char *path)
 {
-    if (key == FUSE_OPT_KEY_NONOPT && !vfat_info.dev) {
-        vfat_info.dev = strdup(arg);
-        return (0);
+    struct stat st;
+    struct vfat_dirent_loc loc;
+
+    if(vfat_resolve_loc(path+1, &st, &loc) != 0)
+        return -ENOENT;
+    if(!S_ISREG(st.st_mode)) {
+        DEBUG_PRINT("Trying to read a directory or not regular file\n");
+        return -EISDIR;
     }
-    return (1);
+    h->file = open_get(&loc);
+    if(h->file == NULL)
+        return -ENOMEM;
+    return handle_resolve(h);
 }
 
-struct fuse_operations vfat_available_ops = {
-    .getattr = vfat_fuse_getattr,
-    .getxattr = vfat_fuse_getxattr,
-    .readdir = vfat_fuse_readdir,
-    .read = vfat_fuse_read,
-};
+// Undoes handle_open()
+static void handle_close(struct vfat_handle *h)
+{
+    handle_drop(h);
+    if(h->file != NULL)
+        open_put(h->file);
+    h->file = NULL;
+}
+
+static struct vfat_handle* handle_new(void)
+{
+    struct vfat_handle* h = calloc(1, sizeof(struct vfat_handle));
+
+    if(h != NULL && pthread_rwlock_init(&h->lock, NULL) != 0) {
+        free(h);
+        return NULL;
+    }
+    return h;
+}
 
+static void handle_free(struct vfat_handle *h)
+{
+    handle_close(h);
+    pthread_rwlock_destroy(&h->lock);
+    free(h);
+}
+
+/**
+ * Takes the handle for reading, refreshing it first if the file's entry
+ * changed since
+ * @returns 0 with the handle held shared, -errno otherwise
+ */
+static int handle_hold(struct vfat_handle *h)
+{
+    int ret = 0;
+
+    pthread_rwlock_rdlock(&h->lock);
+    if(h->resolved && h->gen == __atomic_load_n(&h->file->gen, __ATOMIC_ACQUIRE))
+        return 0;
+    pthread_rwlock_unlock(&h->lock);
+
+    pthread_rwlock_wrlock(&h->lock);
+    if(!h->resolved || h->gen != __atomic_load_n(&h->file->gen, __ATOMIC_ACQUIRE))
+        ret = handle_resolve(h);
+    pthread_rwlock_unlock(&h->lock);
+    if(ret != 0)
+        return ret;
+
+    // another reader may have refreshed it again meanwhile, any result will do
+    pthread_rwlock_rdlock(&h->lock);
+    if(h->resolved)
+        return 0;
+    pthread_rwlock_unlock(&h->lock);
+    return -ENOENT;
+}
+
+static void handle_unhold(struct vfat_handle *h)
+{
+    pthread_rwlock_unlock(&h->lock);
+}
+
+static int read_file(
+        const struct vfat_handle *h, char *buf, size_t size, off_t offs)
+{
+    size_t cnt;
+    ssize_t ret;
+
+    if(offs >= h->st.st_size)
+        return 0;
+    if(size > h->st.st_size - offs)
+        size = h->st.st_size - offs;
+
+    // Small files are read through the cluster cache. So is a file with
+    // data written but not flushed yet, it has to be read from there too.
+    if(h->ra == NULL || vfat_cache_file_dirty((uint32_t) h->st.st_ino)) {
+        ret = vfat_read_file_cached(h->map, buf, size, offs);
+        return ret < 0 ? -EIO : ret;
+    }
+
+    // Take what the prefetcher already has, read the rest synchronously
+    cnt = vfat_readahead_copy(h->ra, buf, size, offs);
+    if(cnt < size) {
+        ret = vfat_read_extents(h->map, buf + cnt, size - cnt, offs + cnt);
+        if(ret < 0 && cnt == 0)
+            return -EIO;
+        if(ret > 0)
+            cnt += ret;
+    }
+    vfat_readahead_account(h->ra, size, offs);
+
+    return cnt; // number of bytes read from the file
+          // must be size unless EOF reached, negative for an error
+}
+
+int vfat_fuse_read(
+        const char *path, char *buf, size_t size, off_t offs,
+        struct fuse_file_info *fi)
+{
+    struct vfat_handle* h = file_handle(fi);
+    struct vfat_handle tmp;
+    uint64_t start;
+    int ret;
+
+    if (is_debugfs(path)) {
+        // This is handled by debug virtual filesystem
+        return debugfs_fuse_read(path + strlen(DEBUGFS_PATH), buf, size, offs, fi);
+    }
+    start = vfat_stats_start();
+    if(h != NULL) {
+        ret = handle_hold(h);
+        if(ret == 0) {
+            ret = read_file(h, buf, size, offs);
+            handle_unhold(h);
+        }
+    } else {
+        // not opened through us, resolve for this read only
+        memset(&tmp, 0, sizeof(tmp));
+        ret = handle_open(&tmp, path);
+        if(ret == 0)
+            ret = read_file(&tmp, buf, size, offs);
+        handle_close(&tmp);
+    }
+    vfat_stats_op(VFAT_OP_READ, start);
+    return ret;
+}
+
+// read_buf for data that has to go through our own memory anyway
+static int vfat_fuse_read_buf_mem(
+        const char *path, struct fuse_bufvec **bufp, size_t size, off_t offs,
+        struct fuse_file_info *fi)
+{
+    struct fuse_bufvec* bv = malloc(sizeof(struct fuse_bufvec));
+    char* mem = malloc(size ? size : 1);
+    int ret;
+
+    if(bv == NULL || mem == NULL) {
+        free(bv);
+        free(mem);
+        return -ENOMEM;
+    }
+    ret = vfat_fuse_read(path, mem, size, offs, fi);
+    if(ret < 0) {
+        free(bv);
+        free(mem);
+        return ret;
+    }
+    *bv = FUSE_BUFVEC_INIT(ret);
+    bv->buf[0].mem = mem;
+    *bufp = bv;
+    return 0;
+}
+
+/**
+ * Zero-copy read: instead of data, hands FUSE the device fd and offsets of the
+ * extents covering the range, so it can splice straight from the image
+ * @returns 0 on success, FUSE frees *bufp
+ */
+int vfat_fuse_read_buf(
+        const char *path, struct fuse_bufvec **bufp, size_t size, off_t offs,
+        struct fuse_file_info *fi)
+{
+    struct vfat_handle* h = file_handle(fi);
+    struct vfat_io_seg* segs;
+    struct fuse_bufvec* bv;
+    size_t nsegs, i;
+    uint64_t start;
+    int ret;
+
+    // FUSE cannot splice from an O_DIRECT descriptor
+    if(is_debugfs(path) || h == NULL || vfat_info.backend == VFAT_BACKEND_DIRECT)
+        return vfat_fuse_read_buf_mem(path, bufp, size, offs, fi);
+    start = vfat_stats_start();
+    ret = handle_hold(h);
+    if(ret != 0)
+        return ret;
+
+    if(offs >= h->st.st_size)
+        size = 0;
+    else if(size > h->st.st_size - offs)
+        size = h->st.st_size - offs;
+
+    // Small files live in the cluster cache, memory is the cheaper source
+    // there. Unflushed writes are only in memory, the device would hand out
+    // old data.
+    if(size == 0 || h->ra == NULL || vfat_cache_file_dirty((uint32_t) h->st.st_ino)) {
+        handle_unhold(h);
+        return vfat_fuse_read_buf_mem(path, bufp, size, offs, fi);
+    }
+
+    nsegs = vfat_file_segments(h->map, NULL, size, offs, &segs);
+    handle_unhold(h);
+    if(segs == NULL)
+        return -ENOMEM;
+    if(nsegs == 0) {
+        free(segs);
+        return -EIO;
+    }
+
+    bv = malloc(sizeof(struct fuse_bufvec) + (nsegs - 1) * sizeof(struct fuse_buf));
+    if(bv == NULL) {
+        free(segs);
+        return -ENOMEM;
+    }
+    bv->count = nsegs;
+    bv->idx = 0;
+    bv->off = 0;
+    for(i = 0 ; i < nsegs ; i++) {
+        bv->buf[i].size = segs[i].len;
+        bv->buf[i].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK | FUSE_BUF_FD_RETRY;
+        bv->buf[i].mem = NULL;
+        bv->buf[i].fd = vfat_info.fd;
+        bv->buf[i].pos = segs[i].dev_offset;
+    }
+    free(segs);
+    *bufp = bv;
+    // FUSE reads these from the device on our behalf
+    vfat_count(VFAT_CNT_DEV_READS, nsegs);
+    vfat_count(VFAT_CNT_DEV_READ_BYTES, size);
+    vfat_stats_op(VFAT_OP_READ, start);
+    return 0;
+}
+
+/**
+ * Resolves the path once for all reads through this open file, the handle
+ * goes to fi->fh. Files of the debug file system keep their own state there.
+ */
+int vfat_fuse_open(const char *path, struct fuse_file_info *fi)
+{
+    struct vfat_handle* h;
+    int ret;
+
+    if(is_debugfs(path))
+        return debugfs_fuse_open(path + strlen(DEBUGFS_PATH), fi);
+    fi->fh = 0;
+    if((h = handle_new()) == NULL)
+        return -ENOMEM;
+    ret = handle_open(h, path);
+    if(ret != 0) {
+        handle_free(h);
+        return ret;
+    }
+    if((fi->flags & O_ACCMODE) != O_RDONLY && !vfat_info.read_only) {
+        h->writable = 1;
+        pthread_mutex_lock(&open_lock);
+        h->file->writers++;
+        pthread_mutex_unlock(&open_lock);
+    }
+    fi->fh = (uintptr_t) h;
+    return 0;
+}
+
+// File system statistics for df, free space comes from FSInfo or the free bitmap
+int vfat_fuse_statfs(const char *path, struct statvfs *sv)
+{
+    size_t free_clusters = vfat_free_clusters();
+
+    memset(sv, 0, sizeof(struct statvfs));
+    sv->f_bsize = vfat_info.cluster_size;
+    sv->f_frsize = vfat_info.cluster_size;
+    sv->f_blocks = vfat_info.count_of_cluster;
+    sv->f_bfree = free_clusters;
+    sv->f_bavail = free_clusters;
+    sv->f_namemax = 255;
+    sv->f_flag = (vfat_info.read_only ? ST_RDONLY : 0) | ST_NOSUID;
+    return 0;
+}
+
+// All changes to the file system are made one at a time. Readers do not
+// take this lock, they see a change once its caches have been updated.
+static pthread_mutex_t vfat_write_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char zero_cluster[VFAT_MAX_CLUSTER_SIZE];
+static __thread char compose_buf[VFAT_MAX_CLUSTER_SIZE];
+
+static uint32_t entry_cluster(const struct fat32_direntry *e)
+{
+    return (((uint32_t) le16toh(e->cluster_hi)) << 16) | le16toh(e->cluster_lo);
+}
+
+// Reservations of free space are made for the entry a file is at
+static uint64_t entry_owner(const struct vfat_dirent_loc *loc)
+{
+    return ((uint64_t) loc->dir << 32) | loc->slot;
+}
+
+// Publishes a changed entry to the lookup caches, e == NULL if it is gone
+static void entry_changed(uint32_t dir, const char *name, const struct fat32_direntry *e,
+                          const struct vfat_dirent_loc *loc)
+{
+    struct stat st;
+
+    vfat_dir_index_invalidate(dir);
+    if(e != NULL) {
+        fill_stat(e, &st);
+        vfat_dcache_set(dir, name, &st, loc);
+        if(loc != NULL)
+            open_changed(loc);
+    } else {
+        vfat_dcache_set(dir, name, NULL, NULL);
+    }
+}
+
+/**
+ * Looks up the directory a new entry would go to
+ * @dir gets the directory's first cluster
+ * @name gets the last component of path
+ * @returns 0 on success, -errno otherwise
+ */
+static int resolve_parent(const char *path, uint32_t *dir, const char **name)
+{
+    struct stat st;
+    char *parent;
+    const char *slash = strrchr(path, '/');
+    int ret = 0;
+
+    *name = slash + 1;
+    if(**name == '\0')
+        return -EINVAL;
+    if(slash == path) {
+        *dir = vfat_info.root_cluster;
+        return 0;
+    }
+
+    parent = strndup(path + 1, slash - path - 1);
+    if(parent == NULL)
+        return -ENOMEM;
+    if(vfat_resolve(parent, &st) != 0)
+        ret = -ENOENT;
+    else if(!S_ISDIR(st.st_mode))
+        ret = -ENOTDIR;
+    else
+        *dir = st.st_ino ? (uint32_t) st.st_ino : vfat_info.root_cluster;
+    free(parent);
+    return ret;
+}
+
+// Records the extents of count clusters just linked behind a chain
+static void chain_grew(uint32_t first_cluster, uint32_t new_cluster, size_t count)
+{
+    uint32_t run_start = new_cluster, run_len = 1, c = new_cluster;
+    size_t i;
+
+    for(i = 1 ; i < count ; i++) {
+        uint32_t next = vfat_next_cluster(c);
+        if(next != c + 1) {
+            vfat_extent_map_grow(first_cluster, run_start, run_len);
+            run_start = next;
+            run_len = 0;
+        }
+        run_len++;
+        c = next;
+    }
+    vfat_extent_map_grow(first_cluster, run_start, run_len);
+}
+
+/**
+ * Copies buf (zeros if NULL) into a file's clusters through the cache
+ * @fresh_from file clusters from this one on were just allocated, partial
+ *             writes to them are padded with zeros instead of read first
+ * @returns 0 on success, -EIO otherwise
+ */
+static int file_write_range(uint32_t first_cluster, const char *buf, size_t size, off_t offs,
+                            uint32_t fresh_from)
+{
+    struct vfat_extent_map* map;
+    const struct vfat_extent* ext;
+    size_t cnt = 0;
+    int ret = 0;
+
+    vfat_cache_mark_file(first_cluster);
+    map = vfat_extent_map_get(first_cluster);
+    while(cnt < size) {
+        off_t pos = offs + cnt;
+        uint32_t file_cluster = pos / vfat_info.cluster_size;
+        size_t in_cluster = pos % vfat_info.cluster_size;
+        size_t len = vfat_info.cluster_size - in_cluster;
+        const char *src;
+        uint32_t cluster_no;
+
+        ext = vfat_extent_find(map, file_cluster);
+        if(ext == NULL) {
+            ret = -EIO;
+            break;
+        }
+        if(len > size - cnt)
+            len = size - cnt;
+        cluster_no = ext->disk_cluster + (file_cluster - ext->file_cluster);
+        src = buf ? buf + cnt : zero_cluster;
+
+        if(file_cluster >= fresh_from && len < vfat_info.cluster_size) {
+            memset(compose_buf, 0, vfat_info.cluster_size);
+            memcpy(compose_buf + in_cluster, src, len);
+            ret = vfat_cache_write(cluster_no, compose_buf, 0, vfat_info.cluster_size);
+        } else {
+            ret = vfat_cache_write(cluster_no, src, in_cluster, len);
+        }
+        if(ret != 0) {
+            ret = -EIO;
+            break;
+        }
+        cnt += len;
+    }
+    vfat_extent_map_put(map);
+    vfat_cache_mark_file(first_cluster);
+    return ret;
+}
+
+// Sets size, first cluster and modification time of an entry and publishes it
+static int file_entry_update(const char *name, const struct vfat_dirent_loc *loc,
+                             struct fat32_direntry *e, uint32_t first_cluster, off_t size)
+{
+    uint16_t date, time_entry;
+
+    vfat_dirent_set_cluster(e, first_cluster);
+    e->size = htole32((uint32_t) size);
+    e->attr |= ATTR_ARCHIVE;
+    pack_time(time(NULL), &date, &time_entry);
+    e->mtime_date = e->atime_date = htole16(date);
+    e->mtime_time = htole16(time_entry);
+    if(vfat_dirent_write(loc->dir, loc->slot, e) != 0)
+        return -EIO;
+    entry_changed(loc->dir, name, e, loc);
+    return 0;
+}
+
+/**
+ * Writes size bytes of buf (zeros if NULL) at offs into the file whose entry
+ * is at loc. Clusters are added as needed, a hole up to offs reads as zeros.
+ * @returns 0 on success, -errno otherwise
+ */
+static int file_write(const char *name, const struct vfat_dirent_loc *loc,
+                      const char *buf, size_t size, off_t offs)
+{
+    struct fat32_direntry e;
+    struct vfat_extent_map* map;
+    uint32_t first_cluster, last = 0, have = 0, need, extra = 0, c;
+    off_t old_size, new_size;
+    int ret;
+
+    if(vfat_dirent_read(loc->dir, loc->slot, &e) != 0)
+        return -EIO;
+    first_cluster = entry_cluster(&e);
+    old_size = le32toh(e.size);
+    new_size = offs + (off_t) size > old_size ? offs + (off_t) size : old_size;
+
+    if(first_cluster != 0) {
+        map = vfat_extent_map_get(first_cluster);
+        have = map->nclusters;
+        if(map->count > 0)
+            last = map->extents[map->count - 1].disk_cluster + map->extents[map->count - 1].length - 1;
+        vfat_extent_map_put(map);
+    }
+    need = (new_size + vfat_info.cluster_size - 1) / vfat_info.cluster_size;
+    if(need > have) {
+        // a file being written is likely to grow by as much again
+        if(buf != NULL)
+            extra = need < VFAT_RESERVE_MAX / vfat_info.cluster_size ? need : VFAT_RESERVE_MAX / vfat_info.cluster_size;
+        c = vfat_chain_alloc(have ? last : 0, need - have, extra, entry_owner(loc));
+        if(c == 0)
+            return -ENOSPC;
+        if(first_cluster == 0)
+            first_cluster = c;
+        chain_grew(first_cluster, c, need - have);
+    }
+
+    if(offs > old_size) {
+        ret = file_write_range(first_cluster, NULL, offs - old_size, old_size, have);
+        if(ret != 0)
+            return ret;
+    }
+    ret = file_write_range(first_cluster, buf, size, offs, have);
+    if(ret != 0)
+        return ret;
+
+    vfat_readahead_invalidate(first_cluster);
+    return file_entry_update(name, loc, &e, first_cluster, new_size);
+}
+
+// Cuts the file whose entry is at loc down to size bytes, or zero-extends it
+static int file_truncate(const char *name, const struct vfat_dirent_loc *loc, off_t size)
+{
+    struct fat32_direntry e;
+    struct vfat_extent_map* map;
+    const struct vfat_extent* ext;
+    uint32_t first_cluster, keep, c, cut = 0;
+    int ret;
+
+    if(vfat_dirent_read(loc->dir, loc->slot, &e) != 0)
+        return -EIO;
+    if(size >= le32toh(e.size))
+        return file_write(name, loc, NULL, size - le32toh(e.size), le32toh(e.size));
+
+    first_cluster = entry_cluster(&e);
+    keep = (size + vfat_info.cluster_size - 1) / vfat_info.cluster_size;
+    vfat_alloc_unreserve(entry_owner(loc));
+    if(first_cluster != 0) {
+        if(keep == 0) {
+            cut = first_cluster;
+        } else {
+            map = vfat_extent_map_get(first_cluster);
+            ext = vfat_extent_find(map, keep - 1);
+            c = ext ? ext->disk_cluster + (keep - 1 - ext->file_cluster) : 0;
+            vfat_extent_map_put(map);
+            if(c != 0) {
+                cut = vfat_next_cluster(c);
+                vfat_fat_set(c, VFAT_EOC);
+            }
+        }
+        vfat_extent_map_invalidate(first_cluster);
+        vfat_readahead_invalidate(first_cluster);
+    }
+    ret = file_entry_update(name, loc, &e, keep ? first_cluster : 0, size);
+    // the clusters cut off are freed in the background once the entry has
+    // let go of them
+    if(ret == 0 || keep != 0)
+        vfat_chain_reclaim(cut);
+    return ret;
+}
+
+int vfat_fuse_write(
+        const char *path, const char *buf, size_t size, off_t offs,
+        struct fuse_file_info *unused)
+{
+    struct stat st;
+    struct vfat_dirent_loc loc;
+    int ret;
+
+    if(vfat_info.read_only)
+        return -EROFS;
+    if(offs + size > 0xFFFFFFFFULL)     // sizes are 32 bit on FAT
+        return -EFBIG;
+
+    pthread_mutex_lock(&vfat_write_lock);
+    if(vfat_resolve_loc(path+1, &st, &loc) != 0)
+        ret = -ENOENT;
+    else if(!S_ISREG(st.st_mode))
+        ret = -EISDIR;
+    else
+        ret = file_write(strrchr(path, '/') + 1, &loc, buf, size, offs);
+    pthread_mutex_unlock(&vfat_write_lock);
+    return ret == 0 ? (int) size : ret;
+}
+
+int vfat_fuse_truncate(const char *path, off_t size)
+{
+    struct stat st;
+    struct vfat_dirent_loc loc;
+    int ret;
+
+    if(vfat_info.read_only)
+        return -EROFS;
+    if(size < 0 || size > 0xFFFFFFFFLL)
+        return -EFBIG;
+
+    pthread_mutex_lock(&vfat_write_lock);
+    if(vfat_resolve_loc(path+1, &st, &loc) != 0)
+        ret = -ENOENT;
+    else if(!S_ISREG(st.st_mode))
+        ret = -EISDIR;
+    else
+        ret = file_truncate(strrchr(path, '/') + 1, &loc, size);
+    pthread_mutex_unlock(&vfat_write_lock);
+    return ret;
+}
+
+// Adds a new entry to the parent of path, called with vfat_write_lock held
+static int entry_create(const char *path, struct fat32_direntry *e, struct vfat_dirent_loc *loc)
+{
+    struct stat st;
+    const char *name;
+    uint32_t dir;
+    int ret;
+
+    ret = resolve_parent(path, &dir, &name);
+    if(ret != 0)
+        return ret;
+    if(vfat_resolve(path+1, &st) == 0)
+        return -EEXIST;
+    if(strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+        return -EEXIST;
+
+    ret = vfat_dir_add(dir, name, e, loc);
+    if(ret == 0)
+        entry_changed(dir, name, e, loc);
+    return ret;
+}
+
+int vfat_fuse_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+    struct fat32_direntry e;
+    struct vfat_dirent_loc loc;
+    int ret;
+
+    if(vfat_info.read_only)
+        return -EROFS;
+    if(!S_ISREG(mode) && (mode & S_IFMT) != 0)
+        return -EPERM;
+
+    vfat_dirent_init(&e, ATTR_ARCHIVE | ((mode & S_IWUSR) ? 0 : ATTR_READ_ONLY), 0, time(NULL));
+    pthread_mutex_lock(&vfat_write_lock);
+    ret = entry_create(path, &e, &loc);
+    pthread_mutex_unlock(&vfat_write_lock);
+    // the new file is open as well
+    return ret == 0 ? vfat_fuse_open(path, fi) : ret;
+}
+
+int vfat_fuse_mkdir(const char *path, mode_t mode)
+{
+    struct fat32_direntry e, *dot;
+    struct vfat_dirent_loc loc;
+    const char *name;
+    uint32_t dir, c;
+    time_t now = time(NULL);
+    int ret;
+
+    if(vfat_info.read_only)
+        return -EROFS;
+
+    pthread_mutex_lock(&vfat_write_lock);
+    ret = resolve_parent(path, &dir, &name);
+    if(ret == 0) {
+        c = vfat_chain_alloc(0, 1, 0, 0);
+        if(c == 0)
+            ret = -ENOSPC;
+    }
+    if(ret == 0) {
+        // "." and ".." open the new directory, ".." of a top level one is 0
+        memset(compose_buf, 0, vfat_info.cluster_size);
+        dot = (struct fat32_direntry *) compose_buf;
+        vfat_dirent_init(&dot[0], ATTR_DIRECTORY, c, now);
+        memcpy(dot[0].nameext, ".          ", 11);
+        vfat_dirent_init(&dot[1], ATTR_DIRECTORY, dir == vfat_info.root_cluster ? 0 : dir, now);
+        memcpy(dot[1].nameext, "..         ", 11);
+        if(vfat_cache_write_dir(c, compose_buf, 0, vfat_info.cluster_size) != 0)
+            ret = -EIO;
+
+        vfat_dirent_init(&e, ATTR_DIRECTORY, c, now);
+        if(ret == 0)
+            ret = entry_create(path, &e, &loc);
+        if(ret != 0)
+            vfat_chain_free(c);
+    }
+    pthread_mutex_unlock(&vfat_write_lock);
+    return ret;
+}
+
+// Removes the entry at loc and frees its clusters, called with vfat_write_lock held
+static int entry_remove(const char *name, const struct stat *st, const struct vfat_dirent_loc *loc)
+{
+    uint32_t first_cluster = (uint32_t) st->st_ino;
+    int held;
+
+    if(vfat_dir_remove(loc) != 0)
+        return -EIO;
+    entry_changed(loc->dir, name, NULL, NULL);
+    vfat_alloc_unreserve(entry_owner(loc));
+    // a file still open keeps its chain until the last release
+    held = open_unlinked(loc, first_cluster);
+    if(first_cluster != 0) {
+        if(!held)
+            vfat_chain_reclaim(first_cluster);
+        vfat_extent_map_invalidate(first_cluster);
+        vfat_readahead_invalidate(first_cluster);
+        if(S_ISDIR(st->st_mode)) {
+            vfat_dir_index_invalidate(first_cluster);
+            vfat_dir_size_invalidate(first_cluster);
+        }
+    }
+    return 0;
+}
+
+int vfat_fuse_unlink(const char *path)
+{
+    struct stat st;
+    struct vfat_dirent_loc loc;
+    int ret;
+
+    if(vfat_info.read_only)
+        return -EROFS;
+
+    pthread_mutex_lock(&vfat_write_lock);
+    if(vfat_resolve_loc(path+1, &st, &loc) != 0)
+        ret = -ENOENT;
+    else if(S_ISDIR(st.st_mode))
+        ret = -EISDIR;
+    else
+        ret = entry_remove(strrchr(path, '/') + 1, &st, &loc);
+    pthread_mutex_unlock(&vfat_write_lock);
+    return ret;
+}
+
+int vfat_fuse_rmdir(const char *path)
+{
+    struct stat st;
+    struct vfat_dirent_loc loc;
+    const char *name = strrchr(path, '/') + 1;
+    int ret;
+
+    if(vfat_info.read_only)
+        return -EROFS;
+    if(strcmp(path, "/") == 0)
+        return -EBUSY;
+    if(strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+        return -EINVAL;
+
+    pthread_mutex_lock(&vfat_write_lock);
+    if(vfat_resolve_loc(path+1, &st, &loc) != 0)
+        ret = -ENOENT;
+    else if(!S_ISDIR(st.st_mode))
+        ret = -ENOTDIR;
+    else if(!vfat_dir_is_empty((uint32_t) st.st_ino))
+        ret = -ENOTEMPTY;
+    else
+        ret = entry_remove(name, &st, &loc);
+    pthread_mutex_unlock(&vfat_write_lock);
+    return ret;
+}
+
+// Whether directory dir is cluster or lies somewhere below it
+static int dir_is_below(uint32_t dir, uint32_t cluster)
+{
+    struct stat st;
+    size_t hops = 0;
+
+    while(dir != vfat_info.root_cluster && hops++ <= vfat_info.count_of_cluster) {
+        if(dir == cluster)
+            return 1;
+        if(vfat_dir_index_lookup(dir, "..", &st, NULL) != 0)
+            return 0;
+        dir = st.st_ino ? (uint32_t) st.st_ino : vfat_info.root_cluster;
+    }
+    return dir == cluster;
+}
+
+int vfat_fuse_rename(const char *from, const char *to)
+{
+    struct stat st, to_st;
+    struct vfat_dirent_loc loc, to_loc, new_loc;
+    struct fat32_direntry e, dotdot;
+    const char *name, *from_name = strrchr(from, '/') + 1;
+    uint32_t dir;
+    int ret, replace = 0;
+
+    if(vfat_info.read_only)
+        return -EROFS;
+
+    pthread_mutex_lock(&vfat_write_lock);
+    ret = vfat_resolve_loc(from+1, &st, &loc) != 0 ? -ENOENT : 0;
+    if(ret == 0 && loc.dir == 0)
+        ret = -EBUSY;
+    if(ret == 0)
+        ret = resolve_parent(to, &dir, &name);
+    if(ret == 0 && S_ISDIR(st.st_mode) && dir_is_below(dir, (uint32_t) st.st_ino))
+        ret = -EINVAL;
+    if(ret != 0)
+        goto out;
+
+    // an existing target is replaced, unless it is the entry itself under
+    // another spelling
+    if(vfat_resolve_loc(to+1, &to_st, &to_loc) == 0) {
+        if(to_loc.dir == loc.dir && to_loc.slot == loc.slot) {
+            if(strcmp(from_name, name) == 0)
+                goto out;
+        } else if(S_ISDIR(st.st_mode) && !S_ISDIR(to_st.st_mode)) {
+            ret = -ENOTDIR;
+        } else if(!S_ISDIR(st.st_mode) && S_ISDIR(to_st.st_mode)) {
+            ret = -EISDIR;
+        } else if(S_ISDIR(to_st.st_mode) && !vfat_dir_is_empty((uint32_t) to_st.st_ino)) {
+            ret = -ENOTEMPTY;
+        } else {
+            replace = 1;
+        }
+        if(ret != 0)
+            goto out;
+    }
+
+    // the new entry goes in before the target and the old one are removed,
+    // a full directory leaves both files where they were
+    if(vfat_dirent_read(loc.dir, loc.slot, &e) != 0) {
+        ret = -EIO;
+        goto out;
+    }
+    ret = vfat_dir_add(dir, name, &e, &new_loc);
+    if(ret != 0)
+        goto out;
+    if(replace && (ret = entry_remove(name, &to_st, &to_loc)) != 0) {
+        vfat_dir_remove(&new_loc);
+        goto out;
+    }
+    if(vfat_dir_remove(&loc) != 0) {
+        ret = -EIO;
+        goto out;
+    }
+    open_moved(&loc, &new_loc);
+    entry_changed(loc.dir, from_name, NULL, NULL);
+    entry_changed(dir, name, &e, &new_loc);
+    vfat_alloc_unreserve(entry_owner(&loc));
+
+    // a directory that moved elsewhere points its ".." at the new parent
+    if(S_ISDIR(st.st_mode) && dir != loc.dir &&
+       vfat_dirent_read((uint32_t) st.st_ino, 1, &dotdot) == 0 &&
+       memcmp(dotdot.nameext, "..         ", 11) == 0) {
+        struct vfat_dirent_loc dotdot_loc = { (uint32_t) st.st_ino, 1, 1 };
+
+        vfat_dirent_set_cluster(&dotdot, dir == vfat_info.root_cluster ? 0 : dir);
+        if(vfat_dirent_write((uint32_t) st.st_ino, 1, &dotdot) != 0)
+            ret = -EIO;
+        entry_changed((uint32_t) st.st_ino, "..", &dotdot, &dotdot_loc);
+    }
+out:
+    pthread_mutex_unlock(&vfat_write_lock);
+    return ret;
+}
+
+int vfat_fuse_utimens(const char *path, const struct timespec tv[2])
+{
+    struct stat st;
+    struct vfat_dirent_loc loc;
+    struct fat32_direntry e;
+    uint16_t date, time_entry;
+    int ret = 0;
+
+    if(vfat_info.read_only)
+        return -EROFS;
+
+    pthread_mutex_lock(&vfat_write_lock);
+    if(vfat_resolve_loc(path+1, &st, &loc) != 0 || loc.dir == 0) {
+        // the root directory has no entry to keep times in
+        ret = loc.dir == 0 && strcmp(path, "/") == 0 ? 0 : -ENOENT;
+    } else if(vfat_dirent_read(loc.dir, loc.slot, &e) != 0) {
+        ret = -EIO;
+    } else {
+        pack_time(tv[0].tv_sec, &date, NULL);
+        e.atime_date = htole16(date);
+        pack_time(tv[1].tv_sec, &date, &time_entry);
+        e.mtime_date = htole16(date);
+        e.mtime_time = htole16(time_entry);
+        if(vfat_dirent_write(loc.dir, loc.slot, &e) != 0)
+            ret = -EIO;
+        else
+            entry_changed(loc.dir, strrchr(path, '/') + 1, &e, &loc);
+    }
+    pthread_mutex_unlock(&vfat_write_lock);
+    return ret;
+}
+
+/**
+ * Reserves room for a file to grow to end bytes right behind its last
+ * cluster, the file keeps its size
+ * @returns 0 on success, -errno otherwise
+ */
+static int file_reserve(const struct vfat_dirent_loc *loc, off_t end)
+{
+    struct fat32_direntry e;
+    struct vfat_extent_map* map;
+    uint32_t first_cluster, goal = 0, have = 0, need;
+
+    if(vfat_dirent_read(loc->dir, loc->slot, &e) != 0)
+        return -EIO;
+    first_cluster = entry_cluster(&e);
+    if(first_cluster != 0) {
+        map = vfat_extent_map_get(first_cluster);
+        have = map->nclusters;
+        if(map->count > 0)
+            goal = map->extents[map->count - 1].disk_cluster + map->extents[map->count - 1].length;
+        vfat_extent_map_put(map);
+    }
+    need = (end + vfat_info.cluster_size - 1) / vfat_info.cluster_size;
+    if(need > have && vfat_alloc_reserve(entry_owner(loc), goal, need - have) < need - have)
+        return -ENOSPC;
+    return 0;
+}
+
+// FAT has no unwritten extents: growing a file writes zeros, with
+// FALLOC_FL_KEEP_SIZE the clusters are only reserved until the file is closed
+int vfat_fuse_fallocate(const char *path, int mode, off_t offs, off_t len,
+                        struct fuse_file_info *unused)
+{
+    struct stat st;
+    struct vfat_dirent_loc loc;
+    int ret = 0;
+
+    if(vfat_info.read_only)
+        return -EROFS;
+    if(mode & ~FALLOC_FL_KEEP_SIZE)
+        return -EOPNOTSUPP;
+    if(offs < 0 || len <= 0)
+        return -EINVAL;
+    if(offs + len > 0xFFFFFFFFLL)
+        return -EFBIG;
+
+    pthread_mutex_lock(&vfat_write_lock);
+    if(vfat_resolve_loc(path+1, &st, &loc) != 0)
+        ret = -ENOENT;
+    else if(!S_ISREG(st.st_mode))
+        ret = -EISDIR;
+    else if(mode & FALLOC_FL_KEEP_SIZE)
+        ret = file_reserve(&loc, offs + len);
+    else if(offs + len > st.st_size)
+        ret = file_truncate(strrchr(path, '/') + 1, &loc, offs + len);
+    pthread_mutex_unlock(&vfat_write_lock);
+    return ret;
+}
+
+/**
+ * Puts the first moved clusters of a file that was being moved to the
+ * run at start back where the map has them, and releases the run of n.
+ * Slots written back meanwhile are copied, like on the way there.
+ */
+static void settle_undo(const struct vfat_extent_map* map, uint32_t start,
+                        uint32_t moved, uint32_t n)
+{
+    const struct vfat_extent* ext;
+    uint32_t j, c;
+
+    for(j = 0 ; j < moved ; j++) {
+        ext = vfat_extent_find(map, j);
+        c = ext->disk_cluster + (j - ext->file_cluster);
+        if(vfat_cache_move(start + j, c) != 0) {
+            // a failed copy loses the cluster's unwritten data, not the mount
+            if(vfat_cache_read_cluster(start + j, compose_buf) == 0)
+                vfat_cache_write(c, compose_buf, 0, vfat_info.cluster_size);
+            vfat_cache_invalidate(start + j);
+        }
+    }
+    vfat_release_run(start, n);
+}
+
+/**
+ * Moves a file that ended up in pieces to one free run, if none of its
+ * data has reached the device yet. The data is relabelled in the cache,
+ * so this is where allocation is finally decided. Settling is only an
+ * optimisation: whatever fails leaves the file where it was.
+ */
+static void file_settle(const char *name, const struct vfat_dirent_loc *loc)
+{
+    struct fat32_direntry e;
+    struct vfat_extent_map* map;
+    uint32_t first_cluster, n, start, got, i, c;
+
+    if(vfat_dirent_read(loc->dir, loc->slot, &e) != 0)
+        return;
+    first_cluster = entry_cluster(&e);
+    if(first_cluster == 0)
+        return;
+    map = vfat_extent_map_get(first_cluster);
+    n = map->nclusters;
+    if(map->count < 2 || n > VFAT_SETTLE_MAX / vfat_info.cluster_size)
+        goto out;
+    for(i = 0 ; i < map->count ; i++) {
+        for(c = 0 ; c < map->extents[i].length ; c++) {
+            if(!vfat_cache_is_dirty(map->extents[i].disk_cluster + c))
+                goto out;
+        }
+    }
+    start = vfat_alloc_run(0, 0, n, 0, &got);
+    if(start != 0 && got < n)
+        vfat_release_run(start, got);
+    if(got < n)
+        goto out;
+
+    for(i = 0 ; i < n ; i++) {
+        const struct vfat_extent* ext = vfat_extent_find(map, i);
+
+        c = ext->disk_cluster + (i - ext->file_cluster);
+        if(vfat_cache_move(c, start + i) == 0)
+            continue;
+        // written back in the meantime, it is copied then
+        if(vfat_cache_read_cluster(c, compose_buf) == 0 &&
+           vfat_cache_write(start + i, compose_buf, 0, vfat_info.cluster_size) == 0)
+            continue;
+        settle_undo(map, start, i, n);
+        goto out;
+    }
+    for(i = 0 ; i < n ; i++)
+        vfat_fat_set(start + i, i + 1 < n ? start + i + 1 : VFAT_EOC);
+    vfat_dirent_set_cluster(&e, start);
+    if(vfat_dirent_write(loc->dir, loc->slot, &e) != 0) {
+        // the entry still names the old chain, the run is free again
+        for(i = 0 ; i < n ; i++)
+            vfat_fat_set(start + i, 0);
+        settle_undo(map, start, n, n);
+        goto out;
+    }
+    entry_changed(loc->dir, name, &e, loc);
+    vfat_cache_mark_file(start);
+    vfat_extent_map_put(map);
+    vfat_extent_map_invalidate(first_cluster);
+    vfat_readahead_invalidate(first_cluster);
+    vfat_chain_reclaim(first_cluster);
+    return;
+out:
+    vfat_extent_map_put(map);
+}
+
+// Last close of an open file. Once its last writer is gone the file is
+// done growing for now, it gives up its reservation and is settled. Its
+// data stays in the cache until the next periodic flush, so files closed
+// together can still be moved.
+int vfat_fuse_release(const char *path, struct fuse_file_info *fi)
+{
+    struct vfat_handle* h = file_handle(fi);
+    struct vfat_dirent_loc loc;
+
+    if(is_debugfs(path))
+        return debugfs_fuse_release(path + strlen(DEBUGFS_PATH), fi);
+    if(h != NULL && h->writable) {
+        // renames hold the lock too, loc stays where the entry is
+        pthread_mutex_lock(&vfat_write_lock);
+        if(open_writer_done(h->file, &loc) && path != NULL) {
+            vfat_alloc_unreserve(entry_owner(&loc));
+            file_settle(strrchr(path, '/') + 1, &loc);
+        }
+        pthread_mutex_unlock(&vfat_write_lock);
+    }
+    if(h != NULL)
+        handle_free(h);
+    fi->fh = 0;
+    return 0;
+}
+
+int vfat_fuse_fsync(const char *path, int datasync, struct fuse_file_info *unused)
+{
+    return vfat_sync(1) != 0 ? -EIO : 0;
+}
+
+// FUSE is up and the process is detached, background work can start
+void *vfat_fuse_init(struct fuse_conn_info *unused)
+{
+    vfat_sidecar_start();
+    return NULL;
+}
+
+void vfat_fuse_destroy(void *unused)
+{
+    vfat_reclaim_drain();
+    vfat_sync(1);
+}
+
+// Every FUSE call goes through the tracer, see trace.c
+static int traced_getattr(const char *path, struct stat *st)
+{
+    struct vfat_trace_span sp;
+    int ret;
+
+    vfat_trace_begin(&sp);
+    ret = vfat_fuse_getattr(path, st);
+    vfat_trace_end(&sp, "getattr", path, ret);
+    return ret;
+}
+
+static int traced_getxattr(const char *path, const char* name, char* buf, size_t size)
+{
+    struct vfat_trace_span sp;
+    int ret;
+
+    vfat_trace_begin(&sp);
+    ret = vfat_fuse_getxattr(path, name, buf, size);
+    vfat_trace_end(&sp, "getxattr", path, ret);
+    return ret;
+}
+
+static int traced_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offs,
+        struct fuse_file_info *fi)
+{
+    struct vfat_trace_span sp;
+    int ret;
+
+    vfat_trace_begin(&sp);
+    ret = vfat_fuse_readdir(path, buf, filler, offs, fi);
+    vfat_trace_end(&sp, "readdir", path, ret);
+    return ret;
+}
+
+static int traced_open(const char *path, struct fuse_file_info *fi)
+{
+    struct vfat_trace_span sp;
+    int ret;
+
+    vfat_trace_begin(&sp);
+    ret = vfat_fuse_open(path, fi);
+    vfat_trace_end(&sp, "open", path, ret);
+    return ret;
+}
+
+static int traced_read(const char *path, char *buf, size_t size, off_t offs,
+        struct fuse_file_info *fi)
+{
+    struct vfat_trace_span sp;
+    int ret;
+
+    vfat_trace_begin(&sp);
+    ret = vfat_fuse_read(path, buf, size, offs, fi);
+    vfat_trace_end(&sp, "read", path, ret);
+    return ret;
+}
+
+static int traced_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offs,
+        struct fuse_file_info *fi)
+{
+    struct vfat_trace_span sp;
+    int ret;
+
+    vfat_trace_begin(&sp);
+    ret = vfat_fuse_read_buf(path, bufp, size, offs, fi);
+    vfat_trace_end(&sp, "read_buf", path, ret);
+    return ret;
+}
+
+static int traced_statfs(const char *path, struct statvfs *sv)
+{
+    struct vfat_trace_span sp;
+    int ret;
+
+    vfat_trace_begin(&sp);
+    ret = vfat_fuse_statfs(path, sv);
+    vfat_trace_end(&sp, "statfs", path, ret);
+    return ret;
+}
+
+static int traced_write(const char *path, const char *buf, size_t size, off_t offs,
+        struct fuse_file_info *fi)
+{
+    struct vfat_trace_span sp;
+    int ret;
+
+    vfat_trace_begin(&sp);
+    ret = vfat_fuse_write(path, buf, size, offs, fi);
+    vfat_trace_end(&sp, "write", path, ret);
+    return ret;
+}
+
+static int traced_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+    struct vfat_trace_span sp;
+    int ret;
+
+    vfat_trace_begin(&sp);
+    ret = vfat_fuse_create(path, mode, fi);
+    vfat_trace_end(&sp, "create", path, ret);
+    return ret;
+}
+
+static int traced_truncate(const char *path, off_t size)
+{
+    struct vfat_trace_span sp;
+    int ret;
+
+    vfat_trace_begin(&sp);
+    ret = vfat_fuse_truncate(path, size);
+    vfat_trace_end(&sp, "truncate", path, ret);
+    return ret;
+}
+
+static int traced_unlink(const char *path)
+{
+    struct vfat_trace_span sp;
+    int ret;
+
+    vfat_trace_begin(&sp);
+    ret = vfat_fuse_unlink(path);
+    vfat_trace_end(&sp, "unlink", path, ret);
+    return ret;
+}
+
+static int traced_mkdir(const char *path, mode_t mode)
+{
+    struct vfat_trace_span sp;
+    int ret;
+
+    vfat_trace_begin(&sp);
+    ret = vfat_fuse_mkdir(path, mode);
+    vfat_trace_end(&sp, "mkdir", path, ret);
+    return ret;
+}
+
+static int traced_rmdir(const char *path)
+{
+    struct vfat_trace_span sp;
+    int ret;
+
+    vfat_trace_begin(&sp);
+    ret = vfat_fuse_rmdir(path);
+    vfat_trace_end(&sp, "rmdir", path, ret);
+    return ret;
+}
+
+static int traced_rename(const char *from, const char *to)
+{
+    struct vfat_trace_span sp;
+    int ret;
+
+    vfat_trace_begin(&sp);
+    ret = vfat_fuse_rename(from, to);
+    vfat_trace_end(&sp, "rename", from, ret);
+    return ret;
+}
+
+static int traced_utimens(const char *path, const struct timespec tv[2])
+{
+    struct vfat_trace_span sp;
+    int ret;
+
+    vfat_trace_begin(&sp);
+    ret = vfat_fuse_utimens(path, tv);
+    vfat_trace_end(&sp, "utimens", path, ret);
+    return ret;
+}
+
+static int traced_fallocate(const char *path, int mode, off_t offs, off_t len,
+        struct fuse_file_info *fi)
+{
+    struct vfat_trace_span sp;
+    int ret;
+
+    vfat_trace_begin(&sp);
+    ret = vfat_fuse_fallocate(path, mode, offs, len, fi);
+    vfat_trace_end(&sp, "fallocate", path, ret);
+    return ret;
+}
+
+static int traced_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+    struct vfat_trace_span sp;
+    int ret;
+
+    vfat_trace_begin(&sp);
+    ret = vfat_fuse_fsync(path, datasync, fi);
+    vfat_trace_end(&sp, "fsync", path, ret);
+    return ret;
+}
+
+static int traced_release(const char *path, struct fuse_file_info *fi)
+{
+    struct vfat_trace_span sp;
+    int ret;
+
+    vfat_trace_begin(&sp);
+    ret = vfat_fuse_release(path, fi);
+    vfat_trace_end(&sp, "release", path, ret);
+    return ret;
+}
+
+////////////// No need to modify anything below this point
+#ifndef VFAT_BENCH
+// -o options of our own, the rest is handed to FUSE
+static struct fuse_opt vfat_opts[] = {
+    { "cache_mb=%lu", offsetof(struct vfat_data, cache_mb), 0 },
+    { "trace_slow_ms=%lu", offsetof(struct vfat_data, trace_slow_ms), 0 },
+    { "index=%s", offsetof(struct vfat_data, index_path), 0 },
+    { "fat=compact", offsetof(struct vfat_data, fat_compact), 1 },
+    { "fat=flat", offsetof(struct vfat_data, fat_compact), 0 },
+    { "backend=pread", offsetof(struct vfat_data, backend), VFAT_BACKEND_PREAD },
+    { "backend=mmap", offsetof(struct vfat_data, backend), VFAT_BACKEND_MMAP },
+    { "backend=direct", offsetof(struct vfat_data, backend), VFAT_BACKEND_DIRECT },
+    FUSE_OPT_END
+};
+
+int
+vfat_opt_args(void *data, const char *arg, int key, struct fuse_args *oargs)
+{
+    if (key == FUSE_OPT_KEY_NONOPT && !vfat_info.dev) {
+        vfat_info.dev = strdup(arg);
+        return (0);
+    }
+    // "ro" is for the kernel as well, so it is only peeked at
+    if (key == FUSE_OPT_KEY_OPT && strcmp(arg, "ro") == 0)
+        vfat_info.read_only = 1;
+    return (1);
+}
+#endif
+
+struct fuse_operations vfat_available_ops = {
+    .getattr = traced_getattr,
+    .getxattr = traced_getxattr,
+    .readdir = traced_readdir,
+    .open = traced_open,
+    .read = traced_read,
+    .read_buf = traced_read_buf,
+    .statfs = traced_statfs,
+    .write = traced_write,
+    .create = traced_create,
+    .truncate = traced_truncate,
+    .unlink = traced_unlink,
+    .mkdir = traced_mkdir,
+    .rmdir = traced_rmdir,
+    .rename = traced_rename,
+    .utimens = traced_utimens,
+    .fallocate = traced_fallocate,
+    .fsync = traced_fsync,
+    .release = traced_release,
+    .init = vfat_fuse_init,
+    .destroy = vfat_fuse_destroy,
+};
+
+#ifdef VFAT_BENCH
+// bench.c mounts read-only in its own process, without FUSE
+void vfat_bench_mount(const char *dev)
+{
+    vfat_info.dev = dev;
+    vfat_info.read_only = 1;
+    vfat_init(dev);
+}
+#else
 int main(int argc, char **argv)
 {
     /*
@@ -803,7 +2501,9 @@ int main(int argc, char **argv)
 */
     struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
 
-    fuse_opt_parse(&args, NULL, NULL, vfat_opt_args);
+    vfat_info.cache_mb = VFAT_CACHE_DEFAULT_MB;
+    vfat_info.trace_slow_ms = VFAT_TRACE_SLOW_MS;
+    fuse_opt_parse(&args, &vfat_info, vfat_opts, vfat_opt_args);
 
     if (!vfat_info.dev)
         errx(1, "missing file system parameter");
@@ -812,3 +2512,4 @@ int main(int argc, char **argv)
     //read_cluster(2);
     return (fuse_main(args.argc, args.argv, &vfat_available_ops, NULL));
 }
+#endif
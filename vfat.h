@@ -47,6 +47,21 @@ struct fat_boot_header {
     /*510*/ uint16_t signature;
 } __attribute__ ((__packed__));
 
+// FSInfo sector, hints about free space maintained by the last writer
+struct fat_fsinfo {
+    /*  0*/ uint32_t lead_sig;
+    /*  4*/ uint8_t  reserved1[480];
+    /*484*/ uint32_t struc_sig;
+    /*488*/ uint32_t free_count;    // 0xFFFFFFFF if unknown
+    /*492*/ uint32_t next_free;     // 0xFFFFFFFF if unknown
+    /*496*/ uint8_t  reserved2[12];
+    /*508*/ uint32_t trail_sig;
+} __attribute__ ((__packed__));
+
+#define FSINFO_LEAD_SIG     0x41615252
+#define FSINFO_STRUC_SIG    0x61417272
+#define FSINFO_TRAIL_SIG    0xAA550000
+#define FSINFO_UNKNOWN      0xFFFFFFFF
 
 struct fat32_direntry {
     /* 0*/  union {
@@ -95,6 +110,9 @@ struct fat32_direntry_long {
 #define VFAT_LFN_SEQ_START      0x40
 #define VFAT_LFN_SEQ_DELETED    0x80
 #define VFAT_LFN_SEQ_MASK       0x3f
+#define VFAT_LFN_MAX_UNITS      260     // 20 entries * 13 UTF-16 units
+#define VFAT_NAME_MAX_UTF8      (VFAT_LFN_MAX_UNITS * 3 + 1)
+#define VFAT_MAX_CLUSTER_SIZE   (32 * 1024)
 
 // A kitchen sink for all important data about filesystem
 struct vfat_data {
@@ -124,22 +142,60 @@ struct vfat_data {
     size_t      cluster_size;           // 8 * 512
     off_t       fat_begin_offset;       // boot record + reseved area;
     size_t      fat_size;               // 32 -> 
+    size_t      fat_count;              // number of FAT copies (2)
+    size_t      active_fat;             // FAT copy we read chains from
+    int         fat_mirrored;           // FAT changes go to every copy
+    size_t      cache_mb;               // cluster cache budget (-o cache_mb=N)
+    size_t      trace_slow_ms;          // log operations slower than this (-o trace_slow_ms=N)
+    const char* index_path;             // sidecar index of the image (-o index=FILE)
+    int         fat_compact;            // FAT kept as runs, fat is NULL (-o fat=compact)
+    int         backend;                // enum vfat_backend (-o backend=pread|mmap|direct)
+    int         read_only;              // -o ro, or the device could not be opened for writing
+    size_t      fsinfo_sector;          // 0 if the volume has none or it is not valid
+    uint32_t    fsinfo_free;            // FSInfo free count hint, FSINFO_UNKNOWN if unusable
+    uint32_t    fsinfo_next_free;
     struct stat root_inode;
-    uint32_t*   fat; // use util::mmap_file() to map this directly into the memory 
+    uint32_t*   fat; // active FAT, mapped once at mount by vfat_init()
 };
 
-struct vfat_data vfat_info;
+extern struct vfat_data vfat_info;
+
+#define VFAT_DIRSIZE_SLOTS 1024
 
-void seek_cluster(uint32_t cluster_num);
+// Where the entry of a file lives. Slots are 32-byte directory entries
+// counted from the start of the parent directory's chain.
+struct vfat_dirent_loc {
+    uint32_t dir;       // first cluster of the parent directory
+    uint32_t slot;      // the short entry
+    uint32_t first;     // first LFN slot, or slot itself without a long name
+};
+
+// vfat_readdir_loc() callback, like fuse_fill_dir_t plus the entry location
+typedef int (*vfat_dirent_fill_t)(void *data, const char *name, const struct stat *st,
+                                  const struct vfat_dirent_loc *loc);
 
 /// FOR debugfs
 int vfat_next_cluster(uint32_t cluster_num);
+int vfat_readdir(uint32_t first_cluster, fuse_fill_dir_t filler, void *fillerdata);
+int vfat_readdir_loc(uint32_t first_cluster, vfat_dirent_fill_t fill, void *filldata);
 int vfat_resolve(const char *path, struct stat *st);
+int vfat_resolve_loc(const char *path, struct stat *st, struct vfat_dirent_loc *loc);
+off_t vfat_dir_size(uint32_t cluster_no);
+void vfat_dir_size_invalidate(uint32_t cluster_no);
+ssize_t vfat_read_file(uint32_t first_cluster, char *buf, size_t size, off_t offs);
 int vfat_fuse_getattr(const char *path, struct stat *st);
+int vfat_fuse_open(const char *path, struct fuse_file_info *fi);
+int vfat_fuse_read(const char *path, char *buf, size_t size, off_t offs,
+                   struct fuse_file_info *fi);
+int vfat_fuse_release(const char *path, struct fuse_file_info *fi);
+#ifdef VFAT_BENCH
+void vfat_bench_mount(const char *dev);
+#endif
 ///
-static int read_cluster(uint32_t cluster_num, fuse_fill_dir_t filler, void *fillerdata);
-char * GetFileName(char * nameext, char * filename);
+char * GetFileName(const char * nameext, uint8_t case_flags, char * filename);
 time_t conv_time(uint16_t date_entry, uint16_t time_entry);
-void setStat(struct fat32_direntry dir_entry, char* buffer, fuse_fill_dir_t filler, void *fillerdata, uint32_t cluster_no);
+void pack_time(time_t t, uint16_t *date_entry, uint16_t *time_entry);
+unsigned char ChkSum(unsigned char *pFcbName);
+int setStat(const struct fat32_direntry *dir_entry, const char *buffer, fuse_fill_dir_t filler, void *fillerdata, uint32_t cluster_no);
 
 #endif